@@ -25,11 +25,17 @@
  * in the \ref paes_functions.h file.
  */
 
+#include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "paes_constants_and_datatypes.h"
 #include "paes_functions.h"
@@ -46,31 +52,104 @@ const unsigned short default_key_size_bits = 128;
  */
 void show_help(char *argv[])
 {
-	printf("\nUsage: %s -i INPUT -o OUTPUT -m MODE [-k KEY_SIZE] [-p PASSWD] [-d DEV] [-g GSIZE] [-l LSIZE]\n\n", argv[0]);
+	printf("\nUsage: %s -i INPUT -o OUTPUT -m MODE [-k KEY_SIZE] [-p PASSWD] [-d DEV] [-e ENGINE] [-s DIST] [-t LAYOUT] [-M CHAINING] [-S SIZE] [-N SECTOR] [-D MACRO] [-c CHUNK] [-b DEPTH] [-f] [-g GSIZE] [-l LSIZE]\n", argv[0]);
+	printf("       %s -B LIST -o OUTPUT -m MODE [-k KEY_SIZE] [-p PASSWD] [-d DEV] [-s DIST] [-M CHAINING] [-S SIZE] [-N SECTOR] [-D MACRO] [-g GSIZE] [-l LSIZE]\n", argv[0]);
+	printf("       %s --tune[=SIZE] [-k KEY_SIZE] [-d DEV]\n\n", argv[0]);
 	printf("  -i INPUT         the input file\n");
-	printf("  -o OUTPUT        the output file\n");
+	printf("  -o OUTPUT        the output file, or the output directory with -B\n");
+	printf("  -B LIST          the batch mode: encrypts or decrypts all the files of the directory LIST, or the ones\n");
+	printf("                   written in the text file LIST (one per line, optionally followed by a tab and the\n");
+	printf("                   password of that file), with a single launch, and writes them into the OUTPUT\n");
+	printf("                   directory with the same names; it supports ecb, ctr and xts\n");
 	printf("  -m MODE          MODE can be encrypt or decrypt\n");
 	printf("  -k KEY_SIZE      the key size can be 128, 192 or 256 (default is %d)\n", default_key_size_bits);
 	printf("  -p PASSWD        the password; if unspecified the user will be asked to type it\n");
-	printf("  -d DEV           DEV can be cpu or gpu (default is %s)\n", get_opencl_device_name(DEFAULT_DEVICE));
-	printf("  -g GSIZE         the OpenCL global work size (default is decided by OpenCL)\n");
-	printf("  -l LSIZE         the OpenCL local work size (default is %u)\n", (unsigned) OPENCL_DEFAULT_LOCAL_SIZE);
+	printf("  -d DEV           DEV can be cpu, gpu, all, native or auto (default is %s, it was %s before native and\n", get_opencl_device_name(DEFAULT_DEVICE), get_opencl_device_name(OPENCL_DEVICE_CPU));
+	printf("                   auto); all shares ecb, ctr or xts among every device of every OpenCL platform; native\n");
+	printf("                   runs on the processor itself, without OpenCL, with its AES instructions if it has them\n");
+	printf("                   and a thread per core; auto runs native below the crossover found by --tune, or measured\n");
+	printf("                   once if the device hasn't been tuned (%u bytes without the cache), and on the gpu\n", (unsigned) DISPATCH_DEFAULT_CROSSOVER);
+	printf("                   (or the cpu) above it or if -e, -s, -t, -D, -g or -l are given\n");
+	printf("  -e ENGINE        ENGINE can be global, private, ttable, bitslice or auto (default is %s, the fastest one\n", get_aes_engine_name(DEFAULT_ENGINE));
+	printf("                   found by --tune, or %s)\n", get_aes_engine_name(AES_ENGINE_PRIVATE));
+	printf("  -s DIST          DIST can be contiguous or strided (default is %s)\n", get_aes_distribution_name(DEFAULT_DISTRIBUTION));
+	printf("  -t LAYOUT        LAYOUT can be linear or interleaved (default is %s)\n", get_aes_layout_name(DEFAULT_LAYOUT));
+	printf("  -M CHAINING      CHAINING can be ecb, ctr, xts, gcm or cbc (default is %s)\n", get_aes_chaining_name(DEFAULT_CHAINING));
+	printf("                   ctr, xts, gcm and cbc run standard AES (FIPS-197), as OpenSSL does; ecb fills the state of\n");
+	printf("                   each block by rows, as the PAES engines and the serial ../aes do, so it isn't standard AES\n");
+	printf("  -S SIZE          the xts sector size or the cbc segment size in bytes, a multiple of %u;\n", (unsigned) AES_BLOCK_SIZE);
+	printf("                   the default is %u for xts and the whole file for cbc\n", (unsigned) XTS_DEFAULT_SECTOR_SIZE);
+	printf("  -N SECTOR        the xts number of the first sector of the input file (default is 0)\n");
+	printf("  -D MACRO         defines MACRO or MACRO=VALUE when building the kernels, to select their variants\n");
+	printf("                   (e.g. SHIFT_ROWS, MIX_COLUMNS, SUB_BYTES, ADD_ROUND_KEY, BITSLICE_64, T_TABLE_COPIES=4,\n");
+	printf("                   or INTERLEAVE=4 for the blocks taken together by ttable); it can be repeated\n");
+	printf("  -c CHUNK         streams the file in chunks of CHUNK bytes (a k, m or g suffix multiplies it by 1024,\n");
+	printf("                   1024^2 or 1024^3), overlapping the I/O, the copies and the encryption;\n");
+	printf("                   it supports ecb, ctr and xts with the linear layout\n");
+	printf("  -b DEPTH         the number of chunks in flight when streaming, at least 2 (default is %u)\n", (unsigned) STREAM_DEFAULT_DEPTH);
+	printf("  -f               maps the input and output files in memory instead of reading and writing them\n");
+	printf("  -g GSIZE         the OpenCL global work size (default is the one found by --tune, or a built in one)\n");
+	printf("  -l LSIZE         the OpenCL local work size (default is the one found by --tune, or a built in one)\n");
+	printf("  --tune[=SIZE]    finds the fastest engine, kernel variant and work sizes of the device, encrypting\n");
+	printf("                   SIZE bytes with each of them (default is %u, a k, m or g suffix is allowed), and\n", (unsigned) TUNE_DEFAULT_SIZE);
+	printf("                   stores them in the device profile of the key size, that is used by the next runs\n");
+	printf("                   with that key size, with the crossover of auto\n");
 	printf("\n");
+	printf("The compiled OpenCL programs, the device profiles and the crossover of auto are cached in\n");
+	printf("$%s (default is ~/%s); set it to the empty string to disable the cache.\n", PROGRAM_CACHE_VARIABLE, PROGRAM_CACHE_HOME_DIRECTORY);
+	printf("The native device uses the fastest implementation that the processor supports; $%s\n", NATIVE_IMPLEMENTATION_VARIABLE);
+	printf("can force vaes, aes-ni or table instead, if the processor supports it, otherwise paes warns.\n\n");
 	exit(EXIT_SUCCESS);
 }
 
+/**
+ * Parses a size in bytes, optionally followed by a k, m or g suffix that multiplies it by 1024, 1024^2 or 1024^3.
+ * \param text the size
+ * \return the size in bytes, 0 if it's wrong
+ */
+size_t parse_size(const char *text)
+{
+	char *suffix;
+	unsigned long long size = strtoull(text, &suffix, 10);
+	if (*suffix == 'k' || *suffix == 'K')
+		size <<= 10;
+	else if (*suffix == 'm' || *suffix == 'M')
+		size <<= 20;
+	else if (*suffix == 'g' || *suffix == 'G')
+		size <<= 30;
+	else if (*suffix != '\0')
+		size = 0;
+	return (size_t) size;
+}
+
 /**
  * Parses the command line options and uses them to set some variables
  * \param argc the number of command line arguments, including the executable file itself
  * \param argv the value of command line arguments, including the executable file itself
  * \param input_file_name the pointer to the string where the input file name specified by the user will be stored
  * \param output_file_name the pointer to the string where the output file name specified by the user will be stored
+ *        (the output directory in the batch mode)
+ * \param batch_list the pointer to the directory or to the text file with the files of the batch mode, NULL if
+ *        there's a single file
  * \param mode the pointer to the AES mode (keeps track if the task will be to encrypt or to decrypt)
  * \param key_size_bits the pointer to the key size value, in bits
  * \param password the pointer to the password string
- * \param device the pointer to the OpenCL device to be used (cpu or gpu)
+ * \param device the pointer to the OpenCL device to be used (cpu, gpu, all, native or auto)
+ * \param engine the pointer to the AES engine to be used (global, private, ttable, bitslice or auto)
+ * \param distribution the pointer to the blocks distribution among the work items (contiguous or strided)
+ * \param layout the pointer to the device buffer layout (linear or interleaved)
+ * \param chaining the pointer to the chaining of the blocks (ecb, ctr, xts, gcm or cbc)
+ * \param sector_size the pointer to the xts sector size or to the cbc segment size, in bytes
+ * \param first_sector the pointer to the xts number of the first sector
+ * \param defines the pointer to the clBuildProgram options that define the macros given by the user
+ * \param chunk_size the pointer to the chunk size of the streaming mode, 0 if the file isn't streamed
+ * \param depth the pointer to the number of chunks in flight in the streaming mode
+ * \param map_files the pointer to the flag that tells if the files are mapped in memory
+ * \param global_size the pointer to the OpenCL global work size, 0 if unspecified
+ * \param local_size the pointer to the OpenCL local work size, 0 if unspecified
+ * \param tune_size the pointer to the data size of each configuration tried by the tuner, 0 if the device isn't tuned
  */
-void parse_command_line(int argc, char *argv[], char **input_file_name, char **output_file_name, aes_mode * mode, unsigned short *key_size_bits, char **password, opencl_device * device)
+void parse_command_line(int argc, char *argv[], char **input_file_name, char **output_file_name, char **batch_list, aes_mode * mode, unsigned short *key_size_bits, char **password, opencl_device * device, aes_engine * engine, aes_distribution * distribution, aes_layout * layout, aes_chaining * chaining, cl_uint * sector_size, cl_ulong * first_sector, char **defines, size_t * chunk_size, unsigned *depth, bool *map_files, size_t * global_size, size_t * local_size, size_t * tune_size)
 {
 	/* If the user called the program with no arguments, he has no clue and 
 	   needs some tutoring. */
@@ -78,15 +157,32 @@ void parse_command_line(int argc, char *argv[], char **input_file_name, char **o
 		show_help(argv);
 
 	int c;
+	static const struct option long_options[] = {
+		{"tune", optional_argument, NULL, 'T'},
+		{NULL, 0, NULL, 0}
+	};
 
 	// Default values
 	*key_size_bits = default_key_size_bits;
 	*password = NULL;
 	*device = DEFAULT_DEVICE;
+	*engine = DEFAULT_ENGINE;
+	*distribution = DEFAULT_DISTRIBUTION;
+	*layout = DEFAULT_LAYOUT;
+	*chaining = DEFAULT_CHAINING;
+	*sector_size = 0;
+	*first_sector = 0;
+	*defines = (char *) calloc(1, sizeof(char));
+	*chunk_size = 0;
+	*depth = STREAM_DEFAULT_DEPTH;
+	*map_files = false;
+	*global_size = 0;
+	*local_size = 0;
+	*tune_size = 0;
 	*mode = AES_MODE_NONE;
 
 	do {
-		c = getopt(argc, argv, "hi:o:m:k:p:d:g:l:");
+		c = getopt_long(argc, argv, "hi:o:B:m:M:S:N:D:c:b:fk:p:d:e:s:t:g:l:", long_options, NULL);
 		switch (c) {
 		case 'i':
 			*input_file_name = (char *) malloc(sizeof(char) * strlen(optarg) + 1);
@@ -96,14 +192,118 @@ void parse_command_line(int argc, char *argv[], char **input_file_name, char **o
 			*output_file_name = (char *) malloc(sizeof(char) * strlen(optarg) + 1);
 			strcpy(*output_file_name, optarg);
 			break;
+		case 'B':
+			*batch_list = (char *) malloc(sizeof(char) * strlen(optarg) + 1);
+			strcpy(*batch_list, optarg);
+			break;
 		case 'd':
 			if (strcmp(optarg, "cpu") == 0)
 				*device = OPENCL_DEVICE_CPU;
 			else if (strcmp(optarg, "gpu") == 0)
 				*device = OPENCL_DEVICE_GPU;
+			else if (strcmp(optarg, "all") == 0)
+				*device = OPENCL_DEVICE_ALL;
+			else if (strcmp(optarg, "native") == 0)
+				*device = OPENCL_DEVICE_NATIVE;
+			else if (strcmp(optarg, "auto") == 0)
+				*device = OPENCL_DEVICE_AUTO;
 			else
 				*device = OPENCL_DEVICE_NONE;
 			break;
+		case 'e':
+			if (strcmp(optarg, "global") == 0)
+				*engine = AES_ENGINE_GLOBAL;
+			else if (strcmp(optarg, "private") == 0)
+				*engine = AES_ENGINE_PRIVATE;
+			else if (strcmp(optarg, "ttable") == 0)
+				*engine = AES_ENGINE_TTABLE;
+			else if (strcmp(optarg, "bitslice") == 0)
+				*engine = AES_ENGINE_BITSLICE;
+			else if (strcmp(optarg, "auto") == 0)
+				*engine = AES_ENGINE_AUTO;
+			else
+				*engine = AES_ENGINE_NONE;
+			break;
+		case 's':
+			if (strcmp(optarg, "contiguous") == 0)
+				*distribution = AES_DISTRIBUTION_CONTIGUOUS;
+			else if (strcmp(optarg, "strided") == 0)
+				*distribution = AES_DISTRIBUTION_STRIDED;
+			else
+				*distribution = AES_DISTRIBUTION_NONE;
+			break;
+		case 't':
+			if (strcmp(optarg, "linear") == 0)
+				*layout = AES_LAYOUT_LINEAR;
+			else if (strcmp(optarg, "interleaved") == 0)
+				*layout = AES_LAYOUT_INTERLEAVED;
+			else
+				*layout = AES_LAYOUT_NONE;
+			break;
+		case 'M':
+			if (strcmp(optarg, "ecb") == 0)
+				*chaining = AES_CHAINING_ECB;
+			else if (strcmp(optarg, "ctr") == 0)
+				*chaining = AES_CHAINING_CTR;
+			else if (strcmp(optarg, "xts") == 0)
+				*chaining = AES_CHAINING_XTS;
+			else if (strcmp(optarg, "gcm") == 0)
+				*chaining = AES_CHAINING_GCM;
+			else if (strcmp(optarg, "cbc") == 0)
+				*chaining = AES_CHAINING_CBC;
+			else
+				*chaining = AES_CHAINING_NONE;
+			break;
+		case 'S':
+			*sector_size = atoi(optarg);
+			break;
+		case 'N':
+			*first_sector = strtoull(optarg, NULL, 10);
+			break;
+		case 'D':
+			// The macros end up among the build options, so they mustn't smuggle other options
+			if (!is_valid_macro(optarg)) {
+				fprintf(stderr, "ERROR: wrong macro '%s', it should be NAME or NAME=VALUE.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			*defines = (char *) realloc(*defines, sizeof(char) * (strlen(*defines) + strlen(optarg) + 5));
+			strcat(*defines, **defines ? " -D " : "-D ");
+			strcat(*defines, optarg);
+			break;
+		case 'c':
+			*chunk_size = parse_size(optarg);
+			if (*chunk_size == 0) {
+				fprintf(stderr, "ERROR: wrong chunk size '%s'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			*depth = atoi(optarg);
+			break;
+		case 'f':
+			*map_files = true;
+			break;
+		case 'g':
+			*global_size = parse_size(optarg);
+			if (*global_size == 0) {
+				fprintf(stderr, "ERROR: wrong global work size '%s'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'l':
+			*local_size = parse_size(optarg);
+			if (*local_size == 0) {
+				fprintf(stderr, "ERROR: wrong local work size '%s'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			*tune_size = optarg != NULL ? parse_size(optarg) : TUNE_DEFAULT_SIZE;
+			if (*tune_size == 0) {
+				fprintf(stderr, "ERROR: wrong tuning size '%s'.\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'k':
 			*key_size_bits = atoi(optarg);
 			break;
@@ -123,6 +323,10 @@ void parse_command_line(int argc, char *argv[], char **input_file_name, char **o
 			show_help(argv);
 		}
 	} while (c != -1);
+
+	// Without a segment size CBC chains the whole file, XTS needs a sector size anyway
+	if (*chaining == AES_CHAINING_XTS && *sector_size == 0)
+		*sector_size = XTS_DEFAULT_SECTOR_SIZE;
 }
 
 /**
@@ -130,11 +334,23 @@ void parse_command_line(int argc, char *argv[], char **input_file_name, char **o
  * It doesn't include the I/O files because they'll be checked later in the program, when they'll be used.
  * \param mode the AES mode (keeps track if the task will be to encrypt or to decrypt)
  * \param key_size_bits the key size
- * \param device the OpenCL device to be used (cpu or gpu)
+ * \param device the OpenCL device to be used (cpu, gpu, all, native or auto)
+ * \param engine the AES engine to be used (global, private, ttable, bitslice or auto)
+ * \param distribution the blocks distribution among the work items (contiguous or strided)
+ * \param layout the device buffer layout (linear or interleaved)
+ * \param chaining the chaining of the blocks (ecb, ctr, xts, gcm or cbc)
+ * \param sector_size the xts sector size or the cbc segment size, in bytes
+ * \param chunk_size the chunk size of the streaming mode, 0 if the file isn't streamed
+ * \param depth the number of chunks in flight in the streaming mode
+ * \param map_files whether the files are mapped in memory
+ * \param tune_size the data size of each configuration tried by the tuner, 0 if the device isn't tuned
+ * \param defines the macros that select the variants of the kernels, empty if there are none
+ * \param batch whether the files are processed in the batch mode
  */
-void check_arguments(aes_mode mode, unsigned short key_size_bits, opencl_device device)
+void check_arguments(aes_mode mode, unsigned short key_size_bits, opencl_device device, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uint sector_size, size_t chunk_size, unsigned depth, bool map_files, size_t tune_size, const char *defines, bool batch)
 {
-	if (mode == AES_MODE_NONE) {
+	// The tuner doesn't encrypt any file
+	if (mode == AES_MODE_NONE && tune_size == 0) {
 		fprintf(stderr, "ERROR: wrong AES mode, it should be encrypt or decrypt.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -145,31 +361,673 @@ void check_arguments(aes_mode mode, unsigned short key_size_bits, opencl_device
 	}
 
 	if (device == OPENCL_DEVICE_NONE) {
-		fprintf(stderr, "ERROR: wrong OpenCL device, it should be cpu or gpu.\n");
+		fprintf(stderr, "ERROR: wrong OpenCL device, it should be cpu, gpu, all, native or auto.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (device == OPENCL_DEVICE_ALL && chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) {
+		fprintf(stderr, "ERROR: the %s chaining can't be shared among the devices, it needs a single device.\n", get_aes_chaining_name(chaining));
+		exit(EXIT_FAILURE);
+	}
+
+	if (device == OPENCL_DEVICE_ALL && chunk_size != 0) {
+		fprintf(stderr, "ERROR: the streaming mode needs a single device.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (device == OPENCL_DEVICE_NATIVE && (chunk_size != 0 || tune_size != 0 || *defines != '\0')) {
+		fprintf(stderr, "ERROR: the %s needs an OpenCL device.\n", tune_size != 0 ? "tuner" : chunk_size != 0 ? "streaming mode" : "kernel variants selection");
+		exit(EXIT_FAILURE);
+	}
+
+	if (engine == AES_ENGINE_NONE) {
+		fprintf(stderr, "ERROR: wrong AES engine, it should be global, private, ttable, bitslice or auto.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (distribution == AES_DISTRIBUTION_NONE) {
+		fprintf(stderr, "ERROR: wrong blocks distribution, it should be contiguous or strided.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (layout == AES_LAYOUT_NONE) {
+		fprintf(stderr, "ERROR: wrong buffer layout, it should be linear or interleaved.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (engine == AES_ENGINE_GLOBAL && layout != AES_LAYOUT_LINEAR) {
+		fprintf(stderr, "ERROR: the global engine supports only the linear layout.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (chaining == AES_CHAINING_NONE) {
+		fprintf(stderr, "ERROR: wrong chaining, it should be ecb, ctr, xts, gcm or cbc.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (chaining != AES_CHAINING_ECB && ((engine != AES_ENGINE_PRIVATE && engine != AES_ENGINE_AUTO) || layout != AES_LAYOUT_LINEAR)) {
+		fprintf(stderr, "ERROR: the %s chaining is supported only by the private engine with the linear layout.\n", get_aes_chaining_name(chaining));
+		exit(EXIT_FAILURE);
+	}
+
+	if (chaining == AES_CHAINING_GCM && distribution != AES_DISTRIBUTION_CONTIGUOUS) {
+		fprintf(stderr, "ERROR: the gcm chaining supports only the contiguous distribution.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (sector_size % AES_BLOCK_SIZE != 0) {
+		fprintf(stderr, "ERROR: wrong sector size, it should be a multiple of %u.\n", (unsigned) AES_BLOCK_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	if (chunk_size != 0 && ((chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) || layout != AES_LAYOUT_LINEAR)) {
+		fprintf(stderr, "ERROR: the streaming mode supports only the ecb, ctr and xts chainings with the linear layout.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (depth < 2) {
+		fprintf(stderr, "ERROR: wrong number of chunks in flight, it should be at least 2.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (chunk_size != 0 && map_files) {
+		fprintf(stderr, "ERROR: the streaming mode doesn't map the files in memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (batch && ((chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) || (engine != AES_ENGINE_PRIVATE && engine != AES_ENGINE_AUTO) || layout != AES_LAYOUT_LINEAR)) {
+		fprintf(stderr, "ERROR: the batch mode supports only the ecb, ctr and xts chainings, with the private engine and the linear layout.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (batch && device == OPENCL_DEVICE_ALL) {
+		fprintf(stderr, "ERROR: the batch mode needs a single device.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (batch && (chunk_size != 0 || map_files || tune_size != 0)) {
+		fprintf(stderr, "ERROR: the batch mode can't stream, map the files in memory or tune the device.\n");
 		exit(EXIT_FAILURE);
 	}
 }
 
 /** 
- * Returns an hashed version of the given password, truncard to size bytes.
+ * Returns some hashed versions of the given password, truncard to size bytes
+ * each and stored one after the other. The first one is the hash of the
+ * password, the i-th one is the hash of the password followed by the byte i;
+ * this way each key is unrelated to the others.
  * \param password the password to be hashed
- * \param size the size of the hashed password
- * \return the hashed password
+ * \param size the size of each hashed password
+ * \param keys the number of hashed passwords (e.g. 2 for xts, which needs a tweak key too)
+ * \return the hashed passwords
  */
-cl_uchar *hash_password(char *password, size_t size)
+cl_uchar *hash_password(char *password, size_t size, unsigned keys)
 {
-	cl_uchar *hash = (cl_uchar *) malloc(size * sizeof(cl_uchar));
+	cl_uchar *hash = (cl_uchar *) malloc(keys * size * sizeof(cl_uchar));
 
-	SHA256_CONTEXT context;
-	sha256_init(&context);
-	sha256_write(&context, (unsigned char *) password, strlen(password));
-	sha256_final(&context);
+	for (unsigned i = 0; i < keys; ++i) {
+		unsigned char index = (unsigned char) i;
+		SHA256_CONTEXT context;
+		sha256_init(&context);
+		sha256_write(&context, (unsigned char *) password, strlen(password));
+		if (i > 0)
+			sha256_write(&context, &index, 1);
+		sha256_final(&context);
 
-	memcpy(hash, sha256_read(&context), size);
+		memcpy(hash + i * size, sha256_read(&context), size);
+	}
 
 	return hash;
 }
 
+/** 
+ * Fills the initialization vector with random bytes.
+ * \param iv the AES_IV_SIZE bytes initialization vector
+ */
+void generate_iv(cl_uchar * iv)
+{
+	FILE *random = fopen("/dev/urandom", "rb");
+	if (random == NULL || fread(iv, 1, AES_IV_SIZE, random) != AES_IV_SIZE) {
+		fprintf(stderr, "ERROR: unable to read the initialization vector from /dev/urandom.\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(random);
+}
+
+/** 
+ * Pads the data to a whole number of blocks, with n bytes of value n (PKCS#7);
+ * there's always some padding, at least one byte and at most a whole block.
+ * \param data the data, followed by enough room for the padding (see \ref padded_size)
+ * \param size the data size
+ * \return the padded data size
+ */
+size_t pad_blocks(cl_uchar * data, size_t size)
+{
+	size_t padding = AES_BLOCK_SIZE - size % AES_BLOCK_SIZE;
+	memset(data + size, (int) padding, padding);
+	return size + padding;
+}
+
+/** 
+ * Returns the size of the data padded by \ref pad_blocks.
+ * \param size the data size
+ * \return the padded data size
+ */
+size_t padded_size(size_t size)
+{
+	return size + AES_BLOCK_SIZE - size % AES_BLOCK_SIZE;
+}
+
+/** 
+ * Checks and removes the padding added by \ref pad_blocks.
+ * \param data the decrypted data
+ * \param size the pointer to the data size, that will be reduced by the padding size
+ * \return -1 if the padding is wrong (e.g. because of a wrong password), 0 otherwise
+ */
+int unpad_blocks(cl_uchar * data, size_t * size)
+{
+	size_t padding = data[*size - 1];
+	if (padding == 0 || padding > AES_BLOCK_SIZE) {
+		fprintf(stderr, "ERROR: wrong padding, the data is corrupted or the password is wrong.\n");
+		return -1;
+	}
+	for (size_t i = *size - padding; i < *size; ++i) {
+		if (data[i] != padding) {
+			fprintf(stderr, "ERROR: wrong padding, the data is corrupted or the password is wrong.\n");
+			return -1;
+		}
+	}
+	*size -= padding;
+	return 0;
+}
+
+/** 
+ * Tells whether two names are the same file, e.g. through a link.
+ * \param first_file_name the name of the first file
+ * \param second_file_name the name of the second file
+ * \return true if both files exist and they're the same, false otherwise
+ */
+bool same_file(char *first_file_name, char *second_file_name)
+{
+	struct stat first_status, second_status;
+	if (stat(first_file_name, &first_status) == -1 || stat(second_file_name, &second_status) == -1)
+		return false;
+	return first_status.st_dev == second_status.st_dev && first_status.st_ino == second_status.st_ino;
+}
+
+/** 
+ * Encrypts or decrypts a file in the streaming mode (see \ref paes_engine_stream), without
+ * loading it all in memory; the parameters are the ones returned by \ref parse_command_line.
+ * \return -1 if something went wrong, 0 otherwise
+ */
+int stream_file(char *input_file_name, char *output_file_name, aes_mode mode, unsigned short key_size_bits, char *password, opencl_device device, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uint sector_size, cl_ulong first_sector, char *defines, size_t chunk_size, unsigned depth, size_t global_size, size_t local_size)
+{
+	cl_uchar iv[AES_IV_SIZE];
+	size_t header_size = chaining == AES_CHAINING_CTR ? AES_IV_SIZE : 0;
+	int result = -1;
+
+	int input = open(input_file_name, O_RDONLY);
+	if (input == -1) {
+		fprintf(stderr, "ERROR: unable to open input file '%s'.\n", input_file_name);
+		return -1;
+	}
+	struct stat status_buf;
+	fstat(input, &status_buf);
+	size_t size = (size_t) status_buf.st_size;
+
+	// As in main(), the initialization vector is at the beginning of the encrypted file
+	if (header_size > 0 && mode == AES_MODE_ENCRYPT) {
+		generate_iv(iv);
+	} else if (header_size > 0) {
+		if (size < header_size || read(input, iv, header_size) != (ssize_t) header_size) {
+			fprintf(stderr, "ERROR: the input file is too short to contain the initialization vector.\n");
+			close(input);
+			return -1;
+		}
+		size -= header_size;
+	}
+
+	if (password == NULL) {
+		char *getpass(const char *prompt);
+		password = getpass("\nPlease type the password: ");
+	}
+	cl_uchar *password_hash = hash_password(password, key_size_bits / 8, chaining == AES_CHAINING_XTS ? 2 : 1);
+
+	printf("PARAMETERS:\n");
+	printf("   Input file: %s\n", input_file_name);
+	printf("   Output file: %s\n", output_file_name);
+	printf("   AES mode: %s\n", get_aes_mode_name(mode));
+	printf("   Key size: %u\n", key_size_bits);
+	printf("   Device: %s\n", get_opencl_device_name(device));
+	printf("   Engine: %s\n", get_aes_engine_name(engine));
+	printf("   Chaining: %s\n", get_aes_chaining_name(chaining));
+	printf("   Chunk size: %lu bytes\n", (long unsigned) chunk_size);
+	printf("   Chunks in flight: %u\n", depth);
+	printf("   File size: %lu bytes\n", (long unsigned) size);
+	printf("\n\n");
+
+	int output = open(output_file_name, O_WRONLY | O_CREAT | O_TRUNC, FILE_WRITE_MASK);
+	if (output == -1) {
+		fprintf(stderr, "ERROR: unable to open output file '%s'.\n", output_file_name);
+	} else if (mode == AES_MODE_ENCRYPT && write(output, iv, header_size) != (ssize_t) header_size) {
+		fprintf(stderr, "ERROR: unable to write to output file '%s'.\n", output_file_name);
+	} else {
+		paes_engine *paes = paes_engine_create(device, key_size_bits, defines);
+		if (paes != NULL) {
+			paes_engine_set_work_sizes(paes, global_size, local_size);
+			result = paes_engine_stream(paes, input, output, size, mode, engine, distribution, layout, chaining, iv, password_hash, password_hash + key_size_bits / 8, sector_size, first_sector, chunk_size, depth);
+			paes_engine_destroy(paes);
+		}
+	}
+
+	// A partial output file would look like a good one
+	if (output != -1) {
+		close(output);
+		if (result == -1)
+			unlink(output_file_name);
+	}
+	close(input);
+	free(password_hash);
+
+	printf("\n\n----- It ends here... -----\n\n\n");
+
+	return result;
+}
+
+/**
+ * A file of the batch mode (see \ref batch_files).
+ */
+typedef struct {
+	char *input_file_name;
+	char *output_file_name;
+	size_t header_size;	//!< the size of the initialization vector at the beginning of the encrypted file
+	paes_segment segment;	//!< where the data of the file is in the buffer of its launch
+	bool failed;		//!< whether the file couldn't be read, processed or written
+} batch_file;
+
+/**
+ * The files that the I/O threads of the batch mode read into a buffer, or write from it:
+ * each thread takes the next file until they're over.
+ */
+typedef struct {
+	pthread_mutex_t mutex;
+	batch_file *files;
+	size_t next;
+	size_t end;
+	cl_uchar *buffer;
+	aes_mode mode;
+	bool writing;
+} batch_io;
+
+/**
+ * The body of an I/O thread of the batch mode.
+ * \param argument the \ref batch_io shared by the threads
+ * \return NULL
+ */
+void *batch_io_thread(void *argument)
+{
+	batch_io *io = (batch_io *) argument;
+
+	for (;;) {
+		pthread_mutex_lock(&io->mutex);
+		size_t i = io->next < io->end ? io->next++ : io->end;
+		pthread_mutex_unlock(&io->mutex);
+		if (i == io->end)
+			return NULL;
+
+		batch_file *file = io->files + i;
+		if (file->failed)
+			continue;
+		cl_uchar *data = io->buffer + file->segment.offset;
+		if (io->writing) {
+			size_t header_size = io->mode == AES_MODE_ENCRYPT ? file->header_size : 0;
+			int fd = open(file->output_file_name, O_WRONLY | O_CREAT | O_TRUNC, FILE_WRITE_MASK);
+			if (fd == -1 || !write_fully(fd, file->segment.iv, header_size) || !write_fully(fd, data, file->segment.length)) {
+				fprintf(stderr, "ERROR: unable to write to output file '%s'.\n", file->output_file_name);
+				file->failed = true;
+			}
+			if (fd != -1) {
+				close(fd);
+				if (file->failed)
+					unlink(file->output_file_name);
+			}
+		} else {
+			size_t header_size = io->mode == AES_MODE_DECRYPT ? file->header_size : 0;
+			int fd = open(file->input_file_name, O_RDONLY);
+			if (fd == -1 || !read_fully(fd, file->segment.iv, header_size) || !read_fully(fd, data, file->segment.length)) {
+				fprintf(stderr, "ERROR: unable to read input file '%s'.\n", file->input_file_name);
+				file->failed = true;
+			}
+			if (fd != -1)
+				close(fd);
+		}
+	}
+}
+
+/**
+ * Reads or writes some files of the batch mode with up to BATCH_IO_THREADS threads.
+ * \param files the files
+ * \param first the index of the first file
+ * \param end the index after the last file
+ * \param buffer the buffer of the launch of the files
+ * \param mode whether the files are encrypted or decrypted
+ * \param writing true to write the files, false to read them
+ */
+void batch_io_files(batch_file * files, size_t first, size_t end, cl_uchar * buffer, aes_mode mode, bool writing)
+{
+	batch_io io = { .files = files, .next = first, .end = end, .buffer = buffer, .mode = mode, .writing = writing };
+	pthread_t threads[BATCH_IO_THREADS - 1];
+	unsigned started = 0;
+
+	pthread_mutex_init(&io.mutex, NULL);
+	// The calling thread is one of them, so that the files are done even if no thread starts
+	while (started < BATCH_IO_THREADS - 1 && started + 1 < end - first && pthread_create(&threads[started], NULL, batch_io_thread, &io) == 0)
+		++started;
+	batch_io_thread(&io);
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&io.mutex);
+}
+
+/**
+ * Compares two file names for qsort.
+ * \param first the pointer to the first name
+ * \param second the pointer to the second name
+ * \return the result of strcmp
+ */
+int compare_file_names(const void *first, const void *second)
+{
+	return strcmp(*(char *const *) first, *(char *const *) second);
+}
+
+/**
+ * Compares two batch files for qsort by their output names, and then by
+ * their order in the list.
+ * \param first the pointer to the pointer to the first file
+ * \param second the pointer to the pointer to the second file
+ * \return a negative number, zero or a positive number as in strcmp
+ */
+int compare_output_names(const void *first, const void *second)
+{
+	const batch_file *first_file = *(batch_file * const *) first, *second_file = *(batch_file * const *) second;
+	int result = strcmp(first_file->output_file_name, second_file->output_file_name);
+	if (result != 0)
+		return result;
+	return first_file < second_file ? -1 : first_file > second_file;
+}
+
+/**
+ * Appends a copy of a file name, and of its password, to a list of names.
+ * \param names the pointer to the list, that's reallocated
+ * \param passwords the pointer to the list of the passwords of the files, that's reallocated
+ * \param count the pointer to the number of names
+ * \param directory the directory of the file, NULL if the name is already a whole path
+ * \param name the file name
+ * \param password the password of the file, NULL if it's the one of every file
+ */
+void append_file_name(char ***names, char ***passwords, size_t * count, const char *directory, const char *name, const char *password)
+{
+	size_t length = strlen(name) + (directory != NULL ? strlen(directory) + 1 : 0);
+	char *path = (char *) malloc(sizeof(char) * (length + 1));
+	if (directory != NULL)
+		sprintf(path, "%s/%s", directory, name);
+	else
+		strcpy(path, name);
+	*names = (char **) realloc(*names, sizeof(char *) * (*count + 1));
+	*passwords = (char **) realloc(*passwords, sizeof(char *) * (*count + 1));
+	(*passwords)[*count] = NULL;
+	if (password != NULL) {
+		(*passwords)[*count] = (char *) malloc(sizeof(char) * strlen(password) + 1);
+		strcpy((*passwords)[*count], password);
+	}
+	(*names)[(*count)++] = path;
+}
+
+/**
+ * Lists the input files of the batch mode: the regular files of a directory, in alphabetical
+ * order, or the files written in a text file, one per line, in their order; in the text file
+ * a name can be followed by a tab and by the password of that file.
+ * \param list the directory or the text file
+ * \param count the pointer to the number of files
+ * \param passwords the pointer to the passwords of the files, NULL where there's none
+ * \return the file names, NULL if the list couldn't be read
+ */
+char **list_batch_files(char *list, size_t * count, char ***passwords)
+{
+	char **names = NULL;
+	struct stat status_buf;
+
+	*count = 0;
+	*passwords = NULL;
+	if (stat(list, &status_buf) == -1) {
+		fprintf(stderr, "ERROR: unable to open the file list '%s'.\n", list);
+		return NULL;
+	}
+
+	if (S_ISDIR(status_buf.st_mode)) {
+		DIR *directory = opendir(list);
+		if (directory == NULL) {
+			fprintf(stderr, "ERROR: unable to open the directory '%s'.\n", list);
+			return NULL;
+		}
+		struct dirent *entry;
+		while ((entry = readdir(directory)) != NULL) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+			append_file_name(&names, passwords, count, list, entry->d_name, NULL);
+			// Subdirectories, sockets and so on aren't encrypted
+			if (stat(names[*count - 1], &status_buf) == -1 || !S_ISREG(status_buf.st_mode))
+				free(names[--*count]);
+		}
+		closedir(directory);
+		// There are no passwords to keep in the same order
+		if (*count > 1)
+			qsort(names, *count, sizeof(char *), compare_file_names);
+	} else {
+		FILE *file = fopen(list, "r");
+		if (file == NULL) {
+			fprintf(stderr, "ERROR: unable to open the file list '%s'.\n", list);
+			return NULL;
+		}
+		char line[FILENAME_MAX + 2];
+		while (fgets(line, sizeof(line), file) != NULL) {
+			line[strcspn(line, "\r\n")] = '\0';
+			char *password = strchr(line, '\t');
+			if (password != NULL)
+				*password++ = '\0';
+			if (line[0] != '\0')
+				append_file_name(&names, passwords, count, NULL, line, password);
+		}
+		fclose(file);
+	}
+
+	if (*count == 0) {
+		fprintf(stderr, "ERROR: there are no files in '%s'.\n", list);
+		free(names);
+		free(*passwords);
+		return NULL;
+	}
+	return names;
+}
+
+/** 
+ * Encrypts or decrypts many files in the batch mode: the files are packed one after the other into
+ * a buffer, each one starting at a whole block, and processed by a single launch (see
+ * \ref apply_aes_batch), or by one for every BATCH_MAX_SIZE bytes; they're read and written by
+ * the I/O threads. Every output file is named after its input file, in the output directory.
+ * The files with their own password in the list have their own key, in the same launch of the
+ * others. The parameters are the ones returned by \ref parse_command_line.
+ * \return -1 if something went wrong with any file, 0 otherwise
+ */
+int batch_files(char *batch_list, char *output_directory, aes_mode mode, unsigned short key_size_bits, char *password, opencl_device device, aes_distribution distribution, aes_chaining chaining, cl_uint sector_size, cl_ulong first_sector, char *defines, size_t global_size, size_t local_size)
+{
+	size_t count, failures = 0, total_size = 0, launches = 0, key_count = 0;
+	size_t key_size = (chaining == AES_CHAINING_XTS ? 2 : 1) * key_size_bits / 8;
+	char **passwords;
+	int result = 0;
+
+	if (output_directory == NULL) {
+		fprintf(stderr, "ERROR: the batch mode needs the output directory.\n");
+		return -1;
+	}
+	char **names = list_batch_files(batch_list, &count, &passwords);
+	if (names == NULL)
+		return -1;
+	if (mkdir(output_directory, S_IRWXU) == -1 && errno != EEXIST) {
+		fprintf(stderr, "ERROR: unable to create the output directory '%s'.\n", output_directory);
+		for (size_t i = 0; i < count; ++i) {
+			free(names[i]);
+			free(passwords[i]);
+		}
+		free(names);
+		free(passwords);
+		return -1;
+	}
+
+	// As in main(), the CTR initialization vector is at the beginning of the encrypted file
+	batch_file *files = (batch_file *) calloc(count, sizeof(batch_file));
+	for (size_t i = 0; i < count; ++i) {
+		batch_file *file = files + i;
+		struct stat status_buf;
+		const char *base_name = strrchr(names[i], '/') != NULL ? strrchr(names[i], '/') + 1 : names[i];
+		file->input_file_name = names[i];
+		file->output_file_name = (char *) malloc(sizeof(char) * (strlen(output_directory) + strlen(base_name) + 2));
+		sprintf(file->output_file_name, "%s/%s", output_directory, base_name);
+		file->header_size = chaining == AES_CHAINING_CTR ? AES_IV_SIZE : 0;
+		file->segment.first_sector = first_sector;
+
+		if (stat(file->input_file_name, &status_buf) == -1) {
+			fprintf(stderr, "ERROR: unable to open input file '%s'.\n", file->input_file_name);
+			file->failed = true;
+		} else if (mode == AES_MODE_DECRYPT && (size_t) status_buf.st_size < file->header_size) {
+			fprintf(stderr, "ERROR: the input file '%s' is too short to contain the initialization vector.\n", file->input_file_name);
+			file->failed = true;
+		} else {
+			file->segment.length = (size_t) status_buf.st_size - (mode == AES_MODE_DECRYPT ? file->header_size : 0);
+			if (chaining == AES_CHAINING_XTS && file->segment.length > 0 && file->segment.length < AES_BLOCK_SIZE) {
+				fprintf(stderr, "ERROR: the input file '%s' is shorter than the %u bytes needed by the xts chaining.\n", file->input_file_name, (unsigned) AES_BLOCK_SIZE);
+				file->failed = true;
+			} else if (mode == AES_MODE_ENCRYPT && file->header_size > 0) {
+				generate_iv(file->segment.iv);
+			}
+		}
+	}
+	free(names);
+
+	/* The output files are named after the base names of the input files,
+	   so two input files from different directories may have the same
+	   output file: the first one in the list gets it, the others fail. */
+	batch_file **sorted_files = (batch_file **) malloc(sizeof(batch_file *) * count);
+	for (size_t i = 0; i < count; ++i)
+		sorted_files[i] = files + i;
+	qsort(sorted_files, count, sizeof(batch_file *), compare_output_names);
+	for (size_t i = 1; i < count; ++i) {
+		batch_file *file = sorted_files[i];
+		for (size_t j = i; j > 0 && strcmp(sorted_files[j - 1]->output_file_name, file->output_file_name) == 0; --j) {
+			if (!sorted_files[j - 1]->failed) {
+				fprintf(stderr, "ERROR: the input files '%s' and '%s' have the same output file '%s'.\n", sorted_files[j - 1]->input_file_name, file->input_file_name, file->output_file_name);
+				file->failed = true;
+				break;
+			}
+		}
+	}
+	free(sorted_files);
+	for (size_t i = 0; i < count; ++i) {
+		if (files[i].failed)
+			files[i].segment.length = 0;
+		total_size += files[i].segment.length;
+	}
+
+	/* The key 0 is the one of the files without a password of their own, if
+	   there are any; every other file has its own key. As everywhere else,
+	   XTS has two keys, that are next to each other in the key table. */
+	cl_uchar *keys = (cl_uchar *) malloc(sizeof(cl_uchar) * key_size * (count + 1));
+	for (size_t i = 0; i < count && key_count == 0; ++i) {
+		if (passwords[i] == NULL) {
+			if (password == NULL) {
+				char *getpass(const char *prompt);
+				password = getpass("\nPlease type the password: ");
+			}
+			cl_uchar *password_hash = hash_password(password, key_size_bits / 8, chaining == AES_CHAINING_XTS ? 2 : 1);
+			memcpy(keys, password_hash, key_size);
+			free(password_hash);
+			key_count = 1;
+		}
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (passwords[i] != NULL) {
+			cl_uchar *password_hash = hash_password(passwords[i], key_size_bits / 8, chaining == AES_CHAINING_XTS ? 2 : 1);
+			memcpy(keys + key_count * key_size, password_hash, key_size);
+			free(password_hash);
+			files[i].segment.key = (cl_uint) key_count++;
+			free(passwords[i]);
+		}
+	}
+	free(passwords);
+
+	printf("PARAMETERS:\n");
+	printf("   File list: %s\n", batch_list);
+	printf("   Output directory: %s\n", output_directory);
+	printf("   AES mode: %s\n", get_aes_mode_name(mode));
+	printf("   Key size: %u\n", key_size_bits);
+	printf("   Device: %s\n", get_opencl_device_name(device));
+	printf("   Distribution: %s\n", get_aes_distribution_name(distribution));
+	printf("   Chaining: %s\n", get_aes_chaining_name(chaining));
+	if (chaining == AES_CHAINING_XTS) {
+		printf("   Sector size: %u bytes\n", (unsigned) sector_size);
+		printf("   First sector: %llu\n", (unsigned long long) first_sector);
+	}
+	printf("   Files: %lu\n", (long unsigned) count);
+	printf("   Keys: %lu\n", (long unsigned) key_count);
+	printf("   Total size: %lu bytes\n", (long unsigned) total_size);
+	printf("\n\n");
+
+	// Each launch takes the files that fit in BATCH_MAX_SIZE bytes, but at least one
+	paes_segment *segments = (paes_segment *) malloc(sizeof(paes_segment) * count);
+	for (size_t first = 0, end; first < count && result != -1; first = end) {
+		size_t size = 0;
+		for (end = first; end < count; ++end) {
+			size_t padded_length = (files[end].segment.length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+			if (end > first && size + padded_length > BATCH_MAX_SIZE)
+				break;
+			files[end].segment.offset = size;
+			size += padded_length;
+		}
+
+		cl_uchar *buffer = allocate_buffer(size);
+		batch_io_files(files, first, end, buffer, mode, false);
+		for (size_t i = first; i < end; ++i)
+			segments[i - first] = files[i].segment;
+		printf("LAUNCH %lu: files from %lu to %lu, %lu bytes\n", (long unsigned) ++launches, (long unsigned) first + 1, (long unsigned) end, (long unsigned) size);
+		if (size > 0)
+			result = apply_aes_batch(buffer, size, segments, end - first, keys, key_count, device, mode, distribution, chaining, key_size_bits, sector_size, defines, global_size, local_size);
+		if (result != -1)
+			batch_io_files(files, first, end, buffer, mode, true);
+		else
+			for (size_t i = first; i < count; ++i)
+				files[i].failed = true;
+		printf("\n");
+		free(buffer);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if (files[i].failed)
+			++failures;
+		free(files[i].input_file_name);
+		free(files[i].output_file_name);
+	}
+	printf("%lu files processed, %lu failed\n", (long unsigned) (count - failures), (long unsigned) failures);
+	if (failures > 0)
+		result = -1;
+	free(segments);
+	free(files);
+	free(keys);
+
+	printf("\n\n----- It ends here... -----\n\n\n");
+
+	return result;
+}
+
 /** 
  * The main program.
  * \param argc the number of command line arguments (the first is the executable file's name)
@@ -177,27 +1035,138 @@ cl_uchar *hash_password(char *password, size_t size)
  */
 int main(int argc, char *argv[])
 {
-	char *input_file_name = NULL, *output_file_name = NULL;
+	char *input_file_name = NULL, *output_file_name = NULL, *batch_list = NULL;
 	aes_mode mode;
 	unsigned short key_size_bits;
 	char *password = NULL;
 	cl_uchar *password_hash = NULL;
 	opencl_device device;
-	cl_uchar *buffer = NULL;
+	aes_engine engine;
+	aes_distribution distribution;
+	aes_layout layout;
+	aes_chaining chaining;
+	cl_uint sector_size;
+	cl_ulong first_sector;
+	char *defines = NULL;
+	size_t chunk_size;
+	unsigned depth;
+	bool map_files;
+	size_t global_size, local_size, tune_size;
+	cl_uchar *buffer = NULL, *output = NULL;
+	cl_uchar iv[AES_IV_SIZE], tag[GCM_TAG_SIZE];
+	size_t header_size = 0, trailer_size = 0, output_size = 0;
 
 	printf("\n\n-------- PAES --------\n\n\n");
 
-	parse_command_line(argc, argv, &input_file_name, &output_file_name, &mode, &key_size_bits, &password, &device);
-	check_arguments(mode, key_size_bits, device);
+	parse_command_line(argc, argv, &input_file_name, &output_file_name, &batch_list, &mode, &key_size_bits, &password, &device, &engine, &distribution, &layout, &chaining, &sector_size, &first_sector, &defines, &chunk_size, &depth, &map_files, &global_size, &local_size, &tune_size);
+	check_arguments(mode, key_size_bits, device, engine, distribution, layout, chaining, sector_size, chunk_size, depth, map_files, tune_size, defines, batch_list != NULL);
+
+	if (tune_size != 0) {
+		printf("TUNING:\n");
+		printf("   Key size: %u\n", key_size_bits);
+		printf("   Device: %s\n", get_opencl_device_name(device));
+		printf("   Size: %lu bytes\n", (long unsigned) tune_size);
+		printf("\n\n");
+		int result = paes_tune(device, key_size_bits, tune_size);
+		free(input_file_name);
+		free(output_file_name);
+		free(password);
+		free(defines);
+		printf("\n\n----- It ends here... -----\n\n\n");
+		return result == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (chunk_size != 0) {
+		int result = stream_file(input_file_name, output_file_name, mode, key_size_bits, password, device, engine, distribution, layout, chaining, sector_size, first_sector, defines, chunk_size, depth, global_size, local_size);
+		free(input_file_name);
+		free(output_file_name);
+		free(password);
+		free(defines);
+		return result == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (batch_list != NULL) {
+		int result = batch_files(batch_list, output_file_name, mode, key_size_bits, password, device, distribution, chaining, sector_size, first_sector, defines, global_size, local_size);
+		free(input_file_name);
+		free(output_file_name);
+		free(batch_list);
+		free(password);
+		free(defines);
+		return result == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	/* Mapping the output file would truncate the input file too, while it's
+	   mapped, if they're the same file; the whole file is read and then
+	   written instead, which works in place. */
+	if (map_files && same_file(input_file_name, output_file_name)) {
+		printf("The input and output files are the same, so they aren't mapped in memory\n\n");
+		map_files = false;
+	}
+
+	/* CTR, CBC and GCM need an initialization vector: it's randomly
+	   generated when encrypting and stored at the beginning of the encrypted
+	   file, where it's taken from when decrypting. XTS doesn't, because the
+	   sectors are told apart by their numbers, and the encrypted file keeps
+	   its size. GCM also stores the authentication tag at the end. */
+	if (chaining == AES_CHAINING_CTR || chaining == AES_CHAINING_CBC)
+		header_size = AES_IV_SIZE;
+	else if (chaining == AES_CHAINING_GCM) {
+		header_size = GCM_IV_SIZE;
+		trailer_size = GCM_TAG_SIZE;
+	}
+
+	/* When decrypting, the initialization vector is read on its own, so
+	   that the data starts at a page, as the buffer does, and the devices
+	   that share the host memory use it in place; the mapped data is
+	   copied at the start of the output file instead. */
+	size_t size, data_offset = 0;
+	if (map_files) {
+		buffer = map_input_file(input_file_name, &size);
+		data_offset = mode == AES_MODE_DECRYPT ? header_size : 0;
+	} else if (mode == AES_MODE_DECRYPT && header_size > 0)
+		size = read_file_after_header(input_file_name, iv, header_size, &buffer) + header_size;
+	else
+		size = read_file(input_file_name, &buffer);
+
+	if (header_size > 0) {
+		if (mode == AES_MODE_ENCRYPT) {
+			generate_iv(iv);
+		} else {
+			if (size < header_size + trailer_size) {
+				fprintf(stderr, "ERROR: the input file is too short to contain the initialization vector.\n");
+				exit(EXIT_FAILURE);
+			}
+			if (map_files)
+				memcpy(iv, buffer, header_size);
+			memcpy(tag, buffer + data_offset + size - header_size - trailer_size, trailer_size);
+		}
+	}
+	cl_uchar *data = buffer + data_offset;
+	size_t data_size = mode == AES_MODE_DECRYPT ? size - header_size - trailer_size : size;
 
-	size_t size = read_file(input_file_name, &buffer);
+	// CBC works on whole blocks only, so the data is padded (PKCS#7)
+	if (chaining == AES_CHAINING_CBC) {
+		if (mode == AES_MODE_ENCRYPT && !map_files) {
+			// Unlike realloc, allocate_buffer keeps the data at a page
+			cl_uchar *padded = allocate_buffer(padded_size(size));
+			memcpy(padded, buffer, size);
+			free(buffer);
+			buffer = padded;
+			data = buffer;
+			data_size = pad_blocks(data, size);
+		} else if (mode == AES_MODE_DECRYPT && (data_size == 0 || data_size % AES_BLOCK_SIZE != 0)) {
+			fprintf(stderr, "ERROR: the input file isn't made of whole blocks.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	if (password == NULL) {
 		char *getpass(const char *prompt);
 		password = getpass("\nPlease type the password: ");
 	}
 
-	password_hash = hash_password(password, key_size_bits / 8);
+	// XTS has two keys: the first one encrypts the data, the second one the sector numbers
+	password_hash = hash_password(password, key_size_bits / 8, chaining == AES_CHAINING_XTS ? 2 : 1);
 
 	printf("PARAMETERS:\n");
 	printf("   Input file: %s\n", input_file_name);
@@ -205,13 +1174,58 @@ int main(int argc, char *argv[])
 	printf("   AES mode: %s\n", get_aes_mode_name(mode));
 	printf("   Key size: %u\n", key_size_bits);
 	printf("   Device: %s\n", get_opencl_device_name(device));
+	printf("   Engine: %s\n", get_aes_engine_name(engine));
+	printf("   Distribution: %s\n", get_aes_distribution_name(distribution));
+	printf("   Layout: %s\n", get_aes_layout_name(layout));
+	printf("   Chaining: %s\n", get_aes_chaining_name(chaining));
+	if (chaining == AES_CHAINING_XTS) {
+		printf("   Sector size: %u bytes\n", (unsigned) sector_size);
+		printf("   First sector: %llu\n", (unsigned long long) first_sector);
+	}
+	if (chaining == AES_CHAINING_CBC)
+		printf("   Segment size: %u bytes\n", (unsigned) sector_size);
 	printf("   File size: %u bytes\n", (unsigned) size);
 	printf("\n\n");
 
-	if (apply_aes(buffer, size, device, mode, password_hash, key_size_bits) != -1)
-		write_file(output_file_name, buffer, size);
+	/* The mapped files are processed in place in the output file, where the
+	   input data is copied first: the device reads from and writes to the
+	   page cache, with no other buffer in the middle. */
+	if (map_files) {
+		output_size = chaining == AES_CHAINING_CBC && mode == AES_MODE_ENCRYPT ? padded_size(data_size) : data_size;
+		if (mode == AES_MODE_ENCRYPT)
+			output_size += header_size + trailer_size;
+		output = map_output_file(output_file_name, output_size);
+		cl_uchar *output_data = mode == AES_MODE_ENCRYPT ? output + header_size : output;
+		if (data_size > 0)
+			memcpy(output_data, data, data_size);
+		data = output_data;
+		if (chaining == AES_CHAINING_CBC && mode == AES_MODE_ENCRYPT)
+			data_size = pad_blocks(data, data_size);
+		if (mode == AES_MODE_ENCRYPT && header_size > 0)
+			memcpy(output, iv, header_size);
+	}
+
+	int result = apply_aes(data, data_size, device, mode, engine, distribution, layout, chaining, iv, password_hash, password_hash + key_size_bits / 8, key_size_bits, sector_size, first_sector, tag, defines, global_size, local_size);
+	if (result != -1 && chaining == AES_CHAINING_CBC && mode == AES_MODE_DECRYPT)
+		result = unpad_blocks(data, &data_size);
+	if (map_files) {
+		if (result != -1 && mode == AES_MODE_ENCRYPT && trailer_size > 0)
+			memcpy(data + data_size, tag, trailer_size);
+		// The decrypted file loses the CBC padding
+		if (unmap_file(output_file_name, output, output_size, mode == AES_MODE_ENCRYPT ? output_size : data_size) == -1)
+			result = -1;
+		// As when the files aren't mapped, a wrong result mustn't be left behind
+		if (result == -1)
+			unlink(output_file_name);
+		unmap_file(input_file_name, buffer, size, size);
+	} else if (result != -1) {
+		if (mode == AES_MODE_ENCRYPT)
+			write_file(output_file_name, iv, header_size, data, data_size, tag, trailer_size);
+		else
+			write_file(output_file_name, NULL, 0, data, data_size, NULL, 0);
+	}
 
-	if (buffer)
+	if (buffer && !map_files)
 		free(buffer);
 	if (input_file_name)
 		free(input_file_name);
@@ -221,8 +1235,11 @@ int main(int argc, char *argv[])
 		free(password);
 	if (password_hash)
 		free(password_hash);
+	if (defines)
+		free(defines);
 
 	printf("\n\n----- It ends here... -----\n\n\n");
 
-	return EXIT_SUCCESS;
+	// e.g. a wrong GCM tag must be noticed by scripts too
+	return result == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -21,16 +21,45 @@
  * This is where business happens; this code is compiled and executed on CPU or GPU.
  */
 
-/* It seems that OpenCL's preprocessor doesn't play well with #includes,
-   but the following include directive works nontheless because this file is 
-   explicitly preprocessed in the Makefile via the classic c preprocessor (cpp). */
+/* The host embeds the constants right before this file (see the Makefile and
+   paes_kernel_source.h), so that there's nothing to include at runtime; the
+   include directive is there only for the offline compilers. */
+#ifndef __PAES_CONSTANTS_AND_DATATYPES_H__
 #include "paes_constants_and_datatypes.h"
+#endif
 
 __constant const uchar sbox_encrypt[AES_SBOX_SIZE] = AES_SBOX_ENCRYPT;
 __constant const uchar sbox_decrypt[AES_SBOX_SIZE] = AES_SBOX_DECRYPT;
 __constant const uchar logtable[AES_SBOX_SIZE] = AES_LOGTABLE;
 __constant const uchar alogtable[AES_SBOX_SIZE] = AES_ALOGTABLE;
 
+/* How many copies of the T-tables are kept in local memory by the table
+   driven engine; the work items of a work group are spread among them in
+   order to reduce the local memory bank conflicts. The copies are
+   interleaved, entry by entry, so that each one is in its own banks:
+   the work items that use different copies never contend for a bank. */
+#ifndef T_TABLE_COPIES
+#define T_TABLE_COPIES 1
+#endif
+
+/* The bitsliced engine processes together as many blocks as the bits of a
+   bitslice_t word: 32 by default, 64 if BITSLICE_64 is defined. */
+#ifdef BITSLICE_64
+typedef ulong bitslice_t;
+#define BITSLICE_WIDTH 64
+#else
+typedef uint bitslice_t;
+#define BITSLICE_WIDTH 32
+#endif
+
+/* NR, the number of AES rounds, isn't defined here: the host passes it to
+   clBuildProgram as the -DNR=10, -DNR=12 or -DNR=14 build option, according
+   to the key size. Every engine but the per round kernel_aes uses it as a
+   compile time constant, so that the rounds are completely unrolled.
+   In the same way the host chooses for the device INTERLEAVE, the number of
+   blocks that the T-table kernels process together (2, 4 or 8), and
+   INTERLEAVE_VECTOR, the vector type as wide as those blocks. */
+
 void sub_bytes(size_t block, __global uchar * buffer, __constant const uchar * sbox)
 {
 	for (size_t i = 0; i < 16; ++i)
@@ -147,17 +176,95 @@ void add_round_key(size_t block, __global uchar * buffer, __constant const uchar
         buffer[block * 16 + i] ^= round_key[round_key_index * 16 + i];
 }
 
-/** 
- * OpenCL kernel that does a single AES round.
- * \param buffer the input/output buffer
- * \param blocks the number of blocks contained in the buffer
- * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+/* The functions below work on a whole block held in private memory as a
+   uchar16, loaded and stored with a single vload16/vstore16; as in the buffer,
+   the components 4r..4r+3 of the vector are the r-th row of the AES state. */
+
+uchar16 sub_bytes_private(uchar16 state, __constant const uchar * sbox)
+{
+	return (uchar16) (sbox[state.s0], sbox[state.s1], sbox[state.s2], sbox[state.s3],
+			  sbox[state.s4], sbox[state.s5], sbox[state.s6], sbox[state.s7],
+			  sbox[state.s8], sbox[state.s9], sbox[state.sa], sbox[state.sb],
+			  sbox[state.sc], sbox[state.sd], sbox[state.se], sbox[state.sf]);
+}
+
+uchar16 shift_rows_private(uchar16 state)
+{
+	// Rotates the rows 1, 2 and 3 by 1, 2 and 3 columns to left
+	return state.s01235674ab89fcde;
+}
+
+uchar16 inv_shift_rows_private(uchar16 state)
+{
+	// Rotates the rows 1, 2 and 3 by 1, 2 and 3 columns to right
+	return state.s01237456ab89defc;
+}
+
+//! Multiplies by 2 each byte of the state in the AES field.
+uchar16 xtime_private(uchar16 state)
+{
+	return (state << (uchar) 1) ^ ((state >> (uchar) 7) * (uchar) 0x1b);
+}
+
+uchar16 mix_columns_private(uchar16 state)
+{
+	/* Since the state is stored by rows, each column is mixed at the same
+	   time as the others: new row r = 2 * r ^ 3 * (r + 1) ^ (r + 2) ^ (r + 3) */
+	uchar16 rows1 = state.s456789abcdef0123;
+	uchar16 rows2 = state.s89abcdef01234567;
+	uchar16 rows3 = state.scdef0123456789ab;
+	return xtime_private(state ^ rows1) ^ rows1 ^ rows2 ^ rows3;
+}
+
+uchar16 inv_mix_columns_private(uchar16 state)
+{
+	/* InvMixColumns is MixColumns preceded by the multiplication of each
+	   column by the polynomial {04}x^2 + {05}. */
+	uchar16 rows2 = state.s89abcdef01234567;
+	state ^= xtime_private(xtime_private(state ^ rows2));
+	return mix_columns_private(state);
+}
+
+uchar16 add_round_key_private(uchar16 state, const uchar16 * round_key, size_t round_key_index)
+{
+	return state ^ round_key[round_key_index];
+}
+
+/**
+ * Copies the NR + 1 round keys in private memory, where they are read by
+ * the engines during the whole life of the work item.
  * \param round_key the AES round keys
- * \param rounds the number of rounds
- * \param round the AES round to do
+ * \param private_key the private array that will hold the round keys
  */
-__kernel __attribute__ ((vec_type_hint(uchar)))
-void kernel_aes(__global uchar * buffer, const ulong blocks, const uint mode, __constant const uchar * round_key, const uint rounds, const uint round)
+void load_round_keys(__constant const uchar * round_key, uchar16 * private_key)
+{
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		private_key[round] = vload16(round, round_key);
+}
+
+/**
+ * Copies the NR + 1 round keys in private memory, as \ref load_round_keys,
+ * from a key table in global memory (e.g. the one of kernel_aes_batch).
+ * \param round_key the AES round keys
+ * \param private_key the private array that will hold the round keys
+ */
+void load_global_round_keys(__global const uchar * round_key, uchar16 * private_key)
+{
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		private_key[round] = vload16(round, round_key);
+}
+
+/**
+ * Computes the range of blocks that the current work item has to process.
+ * Each work item will process any block b such as from_block <= b < to_block;
+ * if from_block >= to_block there is nothing to do.
+ * \param blocks the number of blocks contained in the buffer
+ * \param from_block the first block to process
+ * \param to_block the block after the last one to process
+ */
+void get_work_item_blocks(const ulong blocks, size_t * from_block, size_t * to_block)
 {
 	size_t global_work_size = get_global_size(0);
 	size_t global_id = get_global_id(0);
@@ -165,80 +272,1700 @@ void kernel_aes(__global uchar * buffer, const ulong blocks, const uint mode, __
 	   1 block to process, otherwise it could be several blocks per work item. */
 	size_t blocks_per_work_item = global_work_size < blocks ? blocks / global_work_size : 1;
 	size_t reminder = global_work_size < blocks ? blocks % global_work_size : 0;
-	size_t from_block = global_id * blocks_per_work_item;
+	*from_block = global_id * blocks_per_work_item;
 	if (global_id < reminder)
-		from_block += global_id;
+		*from_block += global_id;
 	else
-		from_block += reminder;
-
-	/* If the work item should start working from a block outside the input data
-	   boundaries, it shall do nothing. */
-	if (from_block < blocks) {
-		/* The last work item will process the input data from its start block to
-		   the very last block. The other work items will just do blocks_per_work_item
-		   blocks.
-		   Each work item will process any block b such as from_block <= b < to_block. */
-		//~ size_t to_block = global_id == global_work_size - 1 ? blocks : from_block + blocks_per_work_item;
-		size_t to_block = from_block + blocks_per_work_item;
-		if (global_id < reminder)
-			to_block += 1;
-		switch (mode) {
-		case AES_MODE_ENCRYPT:
-			{
-				for (size_t b = from_block; b < to_block; ++b) {
+		*from_block += reminder;
+
+	/* The first reminder work items will process one block more than the
+	   others. If the work item should start working from a block outside the
+	   input data boundaries, it shall do nothing. */
+	*to_block = *from_block + blocks_per_work_item;
+	if (global_id < reminder)
+		*to_block += 1;
+	if (*to_block > blocks)
+		*to_block = blocks;
+}
+
+/**
+ * Gets the blocks processed by the current work item as the sequence
+ * first, first + step, first + 2 * step, ... up to (but not including) end.
+ * With AES_DISTRIBUTION_CONTIGUOUS each work item processes a contiguous
+ * range of blocks (see \ref get_work_item_blocks), with AES_DISTRIBUTION_STRIDED
+ * the work item i processes the blocks i, i + global_size, i + 2 * global_size...
+ * so that neighbouring work items always access neighbouring blocks.
+ * \param blocks the number of blocks to be processed by the whole NDRange
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ * \param first the pointer to the first block to be processed
+ * \param end the pointer to the end of the sequence of blocks
+ * \param step the pointer to the distance between two blocks of the sequence
+ */
+void get_work_item_sequence(const ulong blocks, const uint distribution, size_t * first, size_t * end, size_t * step)
+{
+	if (distribution == AES_DISTRIBUTION_STRIDED) {
+		*first = get_global_id(0);
+		*end = blocks;
+		*step = get_global_size(0);
+	} else {
+		get_work_item_blocks(blocks, first, end);
+		*step = 1;
+	}
+}
+
+/**
+ * Returns the offset in the buffer of a byte of a block.
+ * With AES_LAYOUT_LINEAR blocks are stored one after the other; with
+ * AES_LAYOUT_INTERLEAVED the buffer holds first the first 32 bits word of
+ * every block, then the second word of every block and so on.
+ * \param block the block
+ * \param i the byte of the block (0-15)
+ * \param blocks the number of blocks contained in the buffer
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+size_t block_byte_offset(size_t block, uint i, const ulong blocks, const uint layout)
+{
+	if (layout == AES_LAYOUT_INTERLEAVED)
+		return ((i / 4) * blocks + block) * 4 + i % 4;
+	return block * AES_BLOCK_SIZE + i;
+}
+
+//! Loads a block from the buffer, according to its layout.
+uchar16 load_block(size_t block, __global const uchar * buffer, const ulong blocks, const uint layout)
+{
+	if (layout == AES_LAYOUT_INTERLEAVED) {
+		__global const uint *words = (__global const uint *) buffer;
+		return as_uchar16((uint4) (words[block], words[blocks + block], words[2 * blocks + block], words[3 * blocks + block]));
+	}
+	return vload16(block, buffer);
+}
+
+//! Stores a block into the buffer, according to its layout.
+void store_block(uchar16 state, size_t block, __global uchar * buffer, const ulong blocks, const uint layout)
+{
+	if (layout == AES_LAYOUT_INTERLEAVED) {
+		__global uint *words = (__global uint *) buffer;
+		uint4 w = as_uint4(state);
+		words[block] = w.x;
+		words[blocks + block] = w.y;
+		words[2 * blocks + block] = w.z;
+		words[3 * blocks + block] = w.w;
+	} else {
+		vstore16(state, block, buffer);
+	}
+}
+
+/**
+ * Encrypts a single block, doing every AES round on it.
+ * \param block the block to encrypt
+ * \param buffer the input/output buffer
+ * \param round_key the AES round keys
+ */
+void encrypt_block(size_t block, __global uchar * buffer, __constant const uchar * round_key)
+{
 #ifdef SHIFT_ROWS
-					shift_rows(b, buffer);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		shift_rows(block, buffer);
 #elif defined(MIX_COLUMNS)
-					mix_columns(b, buffer);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		mix_columns(block, buffer);
 #elif defined(ADD_ROUND_KEY)
-					add_round_key(b, buffer, round_key, rounds);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		add_round_key(block, buffer, round_key, NR);
 #elif defined(SUB_BYTES)
-					sub_bytes(b, buffer, sbox_encrypt);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		sub_bytes(block, buffer, sbox_encrypt);
 #else
-					if (round == 0) {
-						add_round_key(b, buffer, round_key, 0);
-					} else if (round == rounds) {
-						sub_bytes(b, buffer, sbox_encrypt);
-						shift_rows(b, buffer);
-						add_round_key(b, buffer, round_key, rounds);
-					} else {
-						sub_bytes(b, buffer, sbox_encrypt);
-						shift_rows(b, buffer);
-						mix_columns(b, buffer);
-						add_round_key(b, buffer, round_key, round);
-					}
+	add_round_key(block, buffer, round_key, 0);
+#pragma unroll
+	for (uint round = 1; round < NR; ++round) {
+		sub_bytes(block, buffer, sbox_encrypt);
+		shift_rows(block, buffer);
+		mix_columns(block, buffer);
+		add_round_key(block, buffer, round_key, round);
+	}
+	sub_bytes(block, buffer, sbox_encrypt);
+	shift_rows(block, buffer);
+	add_round_key(block, buffer, round_key, NR);
 #endif
-				}
-				break;
-			}
-		case AES_MODE_DECRYPT:
-			{
-				for (size_t b = from_block; b < to_block; ++b) {
+}
+
+/**
+ * Decrypts a single block, doing every AES round on it.
+ * \param block the block to decrypt
+ * \param buffer the input/output buffer
+ * \param round_key the AES round keys
+ */
+void decrypt_block(size_t block, __global uchar * buffer, __constant const uchar * round_key)
+{
 #ifdef SHIFT_ROWS
-					inv_shift_rows(b, buffer);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		inv_shift_rows(block, buffer);
 #elif defined(MIX_COLUMNS)
-					inv_mix_columns(b, buffer);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		inv_mix_columns(block, buffer);
 #elif defined(ADD_ROUND_KEY)
-					add_round_key(b, buffer, round_key, rounds);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		add_round_key(block, buffer, round_key, NR);
 #elif defined(SUB_BYTES)
-					sub_bytes(b, buffer, sbox_decrypt);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		sub_bytes(block, buffer, sbox_decrypt);
 #else
-					if (round == 0) {
-						add_round_key(b, buffer, round_key, rounds);
-					} else if (round == rounds) {
-						inv_shift_rows(b, buffer);
-						sub_bytes(b, buffer, sbox_decrypt);
-						add_round_key(b, buffer, round_key, 0);
-					} else {
-						inv_shift_rows(b, buffer);
-						sub_bytes(b, buffer, sbox_decrypt);
-						add_round_key(b, buffer, round_key, rounds - round);
-						inv_mix_columns(b, buffer);
-					}
+	add_round_key(block, buffer, round_key, NR);
+#pragma unroll
+	for (uint round = NR - 1; round > 0; --round) {
+		inv_shift_rows(block, buffer);
+		sub_bytes(block, buffer, sbox_decrypt);
+		add_round_key(block, buffer, round_key, round);
+		inv_mix_columns(block, buffer);
+	}
+	inv_shift_rows(block, buffer);
+	sub_bytes(block, buffer, sbox_decrypt);
+	add_round_key(block, buffer, round_key, 0);
 #endif
-				}
-				break;
-			}
+}
+
+/**
+ * Encrypts a single block held in private memory, doing every AES round on it.
+ * \param state the block to encrypt
+ * \param round_key the AES round keys
+ * \return the encrypted block
+ */
+uchar16 encrypt_state(uchar16 state, const uchar16 * round_key)
+{
+#ifdef SHIFT_ROWS
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = shift_rows_private(state);
+#elif defined(MIX_COLUMNS)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = mix_columns_private(state);
+#elif defined(ADD_ROUND_KEY)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = add_round_key_private(state, round_key, NR);
+#elif defined(SUB_BYTES)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = sub_bytes_private(state, sbox_encrypt);
+#else
+	state = add_round_key_private(state, round_key, 0);
+#pragma unroll
+	for (uint round = 1; round < NR; ++round) {
+		state = sub_bytes_private(state, sbox_encrypt);
+		state = shift_rows_private(state);
+		state = mix_columns_private(state);
+		state = add_round_key_private(state, round_key, round);
+	}
+	state = sub_bytes_private(state, sbox_encrypt);
+	state = shift_rows_private(state);
+	state = add_round_key_private(state, round_key, NR);
+#endif
+	return state;
+}
+
+/**
+ * Decrypts a single block held in private memory, doing every AES round on it.
+ * \param state the block to decrypt
+ * \param round_key the AES round keys
+ * \return the decrypted block
+ */
+uchar16 decrypt_state(uchar16 state, const uchar16 * round_key)
+{
+#ifdef SHIFT_ROWS
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = inv_shift_rows_private(state);
+#elif defined(MIX_COLUMNS)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = inv_mix_columns_private(state);
+#elif defined(ADD_ROUND_KEY)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = add_round_key_private(state, round_key, NR);
+#elif defined(SUB_BYTES)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		state = sub_bytes_private(state, sbox_decrypt);
+#else
+	state = add_round_key_private(state, round_key, NR);
+#pragma unroll
+	for (uint round = NR - 1; round > 0; --round) {
+		state = inv_shift_rows_private(state);
+		state = sub_bytes_private(state, sbox_decrypt);
+		state = add_round_key_private(state, round_key, round);
+		state = inv_mix_columns_private(state);
+	}
+	state = inv_shift_rows_private(state);
+	state = sub_bytes_private(state, sbox_decrypt);
+	state = add_round_key_private(state, round_key, 0);
+#endif
+	return state;
+}
+
+/* The chainings other than ECB run standard AES (FIPS-197), whose blocks
+   fill the state by columns: they transpose each block into the row-major
+   state of the engines and back, and the host transposes their round keys
+   (see key_expansion in paes_functions.c). */
+
+//! Transposes a block between the column-major order of FIPS-197 and the row-major state.
+uchar16 transpose_block(uchar16 block)
+{
+	return block.s048c159d26ae37bf;
+}
+
+//! Encrypts a block with standard AES; the round keys must be transposed.
+uchar16 encrypt_standard(uchar16 block, const uchar16 * round_key)
+{
+	return transpose_block(encrypt_state(transpose_block(block), round_key));
+}
+
+//! Decrypts a block with standard AES; the round keys must be transposed.
+uchar16 decrypt_standard(uchar16 block, const uchar16 * round_key)
+{
+	return transpose_block(decrypt_state(transpose_block(block), round_key));
+}
+
+/* The functions below implement the table driven engine. The state of a
+   block is held as an uint4 of columns: the byte r of the component c is the
+   element of the r-th row and c-th column of the AES state. Every round
+   (SubBytes, ShiftRows, MixColumns and AddRoundKey) is made of 16 lookups in
+   the four T-tables, that hold the MixColumns'ed S-Box rotated by 0, 8, 16
+   and 24 bits, and of XORs. */
+
+//! Multiplies by 2 each of the 4 bytes of a column in the AES field.
+uint xtime_column(uint column)
+{
+	return ((column & 0x7f7f7f7fu) << 1) ^ (((column >> 7) & 0x01010101u) * 0x1bu);
+}
+
+//! Converts a row-major block into its columns.
+uint4 block_to_columns(uchar16 block)
+{
+	return convert_uint4(block.s0123) | (convert_uint4(block.s4567) << 8) | (convert_uint4(block.s89ab) << 16) | (convert_uint4(block.scdef) << 24);
+}
+
+//! Converts the columns of a block back into a row-major block.
+uchar16 columns_to_block(uint4 columns)
+{
+	return (uchar16) (convert_uchar4(columns), convert_uchar4(columns >> 8), convert_uchar4(columns >> 16), convert_uchar4(columns >> 24));
+}
+
+//! Stores the T-table entry t, rotated by 0, 8, 16 and 24 bits, in every copy of the 4 T-tables.
+void store_t_tables(__local uint * t_tables, size_t i, uint t)
+{
+	for (size_t copy = 0; copy < T_TABLE_COPIES; ++copy)
+		for (uint table = 0; table < 4; ++table)
+			t_tables[(table * AES_SBOX_SIZE + i) * T_TABLE_COPIES + copy] = rotate(t, table * 8);
+}
+
+//! Stores the NR + 1 round keys in local memory as columns.
+void init_columns_key(__constant const uchar * round_key, __local uint * columns_key)
+{
+	for (size_t i = get_local_id(0); i < (NR + 1) * AES_STATE_SIDE; i += get_local_size(0)) {
+		size_t round = i / AES_STATE_SIDE;
+		size_t column = i % AES_STATE_SIDE;
+		__constant const uchar *key = round_key + round * AES_BLOCK_SIZE + column;
+		columns_key[i] = key[0] | (key[4] << 8) | (key[8] << 16) | (key[12] << 24);
+	}
+}
+
+/**
+ * Fills the local memory with the encryption T-tables and the round keys
+ * needed by the work group. It must be called by every work item of the work group.
+ * \param t_tables the local memory that will hold the T_TABLE_COPIES copies of the 4 T-tables
+ * \param round_key the AES round keys
+ * \param columns_key the local memory that will hold the round keys as columns
+ */
+void init_encrypt_tables(__local uint * t_tables, __constant const uchar * round_key, __local uint * columns_key)
+{
+	for (size_t i = get_local_id(0); i < AES_SBOX_SIZE; i += get_local_size(0)) {
+		uint s = sbox_encrypt[i];
+		uint s2 = xtime_column(s);
+		store_t_tables(t_tables, i, s2 | (s << 8) | (s << 16) | ((s2 ^ s) << 24));
+	}
+	init_columns_key(round_key, columns_key);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/**
+ * Fills the local memory with the decryption T-tables and the round keys
+ * needed by the work group. It must be called by every work item of the work group.
+ * \param t_tables the local memory that will hold the T_TABLE_COPIES copies of the 4 T-tables
+ * \param inv_sbox the local memory that will hold the decryption S-Box
+ * \param decryption_key the decryption round keys of the equivalent inverse cipher
+ * \param columns_key the local memory that will hold the decryption round keys as columns
+ */
+void init_decrypt_tables(__local uint * t_tables, __local uchar * inv_sbox, __constant const uchar * decryption_key, __local uint * columns_key)
+{
+	for (size_t i = get_local_id(0); i < AES_SBOX_SIZE; i += get_local_size(0)) {
+		uint s = sbox_decrypt[i];
+		uint s2 = xtime_column(s);
+		uint s4 = xtime_column(s2);
+		uint s8 = xtime_column(s4);
+		store_t_tables(t_tables, i, (s8 ^ s4 ^ s2) | ((s8 ^ s) << 8) | ((s8 ^ s4 ^ s) << 16) | ((s8 ^ s2 ^ s) << 24));
+		inv_sbox[i] = sbox_decrypt[i];
+	}
+	init_columns_key(decryption_key, columns_key);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+//! A middle encryption round (SubBytes, ShiftRows and MixColumns) on the columns of a block, without AddRoundKey.
+uint4 encrypt_columns_round(uint4 s, __local const uint * te)
+{
+	__local const uint *te0 = te;
+	__local const uint *te1 = te + AES_SBOX_SIZE * T_TABLE_COPIES;
+	__local const uint *te2 = te + 2 * AES_SBOX_SIZE * T_TABLE_COPIES;
+	__local const uint *te3 = te + 3 * AES_SBOX_SIZE * T_TABLE_COPIES;
+	uint4 t;
+	t.x = te0[(s.x & 0xff) * T_TABLE_COPIES] ^ te1[((s.y >> 8) & 0xff) * T_TABLE_COPIES] ^ te2[((s.z >> 16) & 0xff) * T_TABLE_COPIES] ^ te3[(s.w >> 24) * T_TABLE_COPIES];
+	t.y = te0[(s.y & 0xff) * T_TABLE_COPIES] ^ te1[((s.z >> 8) & 0xff) * T_TABLE_COPIES] ^ te2[((s.w >> 16) & 0xff) * T_TABLE_COPIES] ^ te3[(s.x >> 24) * T_TABLE_COPIES];
+	t.z = te0[(s.z & 0xff) * T_TABLE_COPIES] ^ te1[((s.w >> 8) & 0xff) * T_TABLE_COPIES] ^ te2[((s.x >> 16) & 0xff) * T_TABLE_COPIES] ^ te3[(s.y >> 24) * T_TABLE_COPIES];
+	t.w = te0[(s.w & 0xff) * T_TABLE_COPIES] ^ te1[((s.x >> 8) & 0xff) * T_TABLE_COPIES] ^ te2[((s.y >> 16) & 0xff) * T_TABLE_COPIES] ^ te3[(s.z >> 24) * T_TABLE_COPIES];
+	return t;
+}
+
+//! The last encryption round (SubBytes and ShiftRows) on the columns of a block, without AddRoundKey.
+uint4 encrypt_columns_last_round(uint4 s, __local const uint * te)
+{
+	__local const uint *te0 = te;
+	__local const uint *te1 = te + AES_SBOX_SIZE * T_TABLE_COPIES;
+	__local const uint *te2 = te + 2 * AES_SBOX_SIZE * T_TABLE_COPIES;
+	__local const uint *te3 = te + 3 * AES_SBOX_SIZE * T_TABLE_COPIES;
+	uint4 t;
+	/* The last round has no MixColumns: the S-Box value of each row is picked
+	   from the T-table that has it unchanged in that row. */
+	t.x = (te2[(s.x & 0xff) * T_TABLE_COPIES] & 0xff) ^ (te3[((s.y >> 8) & 0xff) * T_TABLE_COPIES] & 0xff00) ^ (te0[((s.z >> 16) & 0xff) * T_TABLE_COPIES] & 0xff0000) ^ (te1[(s.w >> 24) * T_TABLE_COPIES] & 0xff000000);
+	t.y = (te2[(s.y & 0xff) * T_TABLE_COPIES] & 0xff) ^ (te3[((s.z >> 8) & 0xff) * T_TABLE_COPIES] & 0xff00) ^ (te0[((s.w >> 16) & 0xff) * T_TABLE_COPIES] & 0xff0000) ^ (te1[(s.x >> 24) * T_TABLE_COPIES] & 0xff000000);
+	t.z = (te2[(s.z & 0xff) * T_TABLE_COPIES] & 0xff) ^ (te3[((s.w >> 8) & 0xff) * T_TABLE_COPIES] & 0xff00) ^ (te0[((s.x >> 16) & 0xff) * T_TABLE_COPIES] & 0xff0000) ^ (te1[(s.y >> 24) * T_TABLE_COPIES] & 0xff000000);
+	t.w = (te2[(s.w & 0xff) * T_TABLE_COPIES] & 0xff) ^ (te3[((s.x >> 8) & 0xff) * T_TABLE_COPIES] & 0xff00) ^ (te0[((s.y >> 16) & 0xff) * T_TABLE_COPIES] & 0xff0000) ^ (te1[(s.z >> 24) * T_TABLE_COPIES] & 0xff000000);
+	return t;
+}
+
+//! A middle decryption round of the equivalent inverse cipher on the columns of a block, without AddRoundKey.
+uint4 decrypt_columns_round(uint4 s, __local const uint * td)
+{
+	__local const uint *td0 = td;
+	__local const uint *td1 = td + AES_SBOX_SIZE * T_TABLE_COPIES;
+	__local const uint *td2 = td + 2 * AES_SBOX_SIZE * T_TABLE_COPIES;
+	__local const uint *td3 = td + 3 * AES_SBOX_SIZE * T_TABLE_COPIES;
+	uint4 t;
+	t.x = td0[(s.x & 0xff) * T_TABLE_COPIES] ^ td1[((s.w >> 8) & 0xff) * T_TABLE_COPIES] ^ td2[((s.z >> 16) & 0xff) * T_TABLE_COPIES] ^ td3[(s.y >> 24) * T_TABLE_COPIES];
+	t.y = td0[(s.y & 0xff) * T_TABLE_COPIES] ^ td1[((s.x >> 8) & 0xff) * T_TABLE_COPIES] ^ td2[((s.w >> 16) & 0xff) * T_TABLE_COPIES] ^ td3[(s.z >> 24) * T_TABLE_COPIES];
+	t.z = td0[(s.z & 0xff) * T_TABLE_COPIES] ^ td1[((s.y >> 8) & 0xff) * T_TABLE_COPIES] ^ td2[((s.x >> 16) & 0xff) * T_TABLE_COPIES] ^ td3[(s.w >> 24) * T_TABLE_COPIES];
+	t.w = td0[(s.w & 0xff) * T_TABLE_COPIES] ^ td1[((s.z >> 8) & 0xff) * T_TABLE_COPIES] ^ td2[((s.y >> 16) & 0xff) * T_TABLE_COPIES] ^ td3[(s.x >> 24) * T_TABLE_COPIES];
+	return t;
+}
+
+//! The last decryption round (InvSubBytes and InvShiftRows) on the columns of a block, without AddRoundKey.
+uint4 decrypt_columns_last_round(uint4 s, __local const uchar * inv_sbox)
+{
+	uint4 t;
+	t.x = inv_sbox[s.x & 0xff] | (inv_sbox[(s.w >> 8) & 0xff] << 8) | (inv_sbox[(s.z >> 16) & 0xff] << 16) | ((uint) inv_sbox[s.y >> 24] << 24);
+	t.y = inv_sbox[s.y & 0xff] | (inv_sbox[(s.x >> 8) & 0xff] << 8) | (inv_sbox[(s.w >> 16) & 0xff] << 16) | ((uint) inv_sbox[s.z >> 24] << 24);
+	t.z = inv_sbox[s.z & 0xff] | (inv_sbox[(s.y >> 8) & 0xff] << 8) | (inv_sbox[(s.x >> 16) & 0xff] << 16) | ((uint) inv_sbox[s.w >> 24] << 24);
+	t.w = inv_sbox[s.w & 0xff] | (inv_sbox[(s.z >> 8) & 0xff] << 8) | (inv_sbox[(s.y >> 16) & 0xff] << 16) | ((uint) inv_sbox[s.x >> 24] << 24);
+	return t;
+}
+
+/**
+ * Encrypts a single block held in private memory as columns, using the T-tables.
+ * \param s the columns of the block to encrypt
+ * \param te the 4 encryption T-tables
+ * \param columns_key the round keys, as columns
+ * \return the columns of the encrypted block
+ */
+uint4 encrypt_columns(uint4 s, __local const uint * te, const uint4 * columns_key)
+{
+	s ^= columns_key[0];
+#pragma unroll
+	for (uint round = 1; round < NR; ++round)
+		s = encrypt_columns_round(s, te) ^ columns_key[round];
+	return encrypt_columns_last_round(s, te) ^ columns_key[NR];
+}
+
+/**
+ * Decrypts a single block held in private memory as columns, using the T-tables.
+ * \param s the columns of the block to decrypt
+ * \param td the 4 decryption T-tables
+ * \param inv_sbox the decryption S-Box
+ * \param columns_key the decryption round keys of the equivalent inverse cipher, as columns
+ * \return the columns of the decrypted block
+ */
+uint4 decrypt_columns(uint4 s, __local const uint * td, __local const uchar * inv_sbox, const uint4 * columns_key)
+{
+	s ^= columns_key[0];
+#pragma unroll
+	for (uint round = 1; round < NR; ++round)
+		s = decrypt_columns_round(s, td) ^ columns_key[round];
+	return decrypt_columns_last_round(s, inv_sbox) ^ columns_key[NR];
+}
+
+/**
+ * Encrypts INTERLEAVE blocks held in private memory as columns, using the
+ * T-tables. The blocks go through each round together, so that the lookups
+ * of independent blocks can overlap.
+ * \param s the columns of the blocks to encrypt, replaced by the encrypted ones
+ * \param te the 4 encryption T-tables
+ * \param columns_key the round keys, as columns
+ */
+void encrypt_columns_interleaved(uint4 * s, __local const uint * te, const uint4 * columns_key)
+{
+#pragma unroll
+	for (uint i = 0; i < INTERLEAVE; ++i)
+		s[i] ^= columns_key[0];
+#pragma unroll
+	for (uint round = 1; round < NR; ++round)
+#pragma unroll
+		for (uint i = 0; i < INTERLEAVE; ++i)
+			s[i] = encrypt_columns_round(s[i], te) ^ columns_key[round];
+#pragma unroll
+	for (uint i = 0; i < INTERLEAVE; ++i)
+		s[i] = encrypt_columns_last_round(s[i], te) ^ columns_key[NR];
+}
+
+/**
+ * Decrypts INTERLEAVE blocks held in private memory as columns, using the
+ * T-tables. The blocks go through each round together, so that the lookups
+ * of independent blocks can overlap.
+ * \param s the columns of the blocks to decrypt, replaced by the decrypted ones
+ * \param td the 4 decryption T-tables
+ * \param inv_sbox the decryption S-Box
+ * \param columns_key the decryption round keys of the equivalent inverse cipher, as columns
+ */
+void decrypt_columns_interleaved(uint4 * s, __local const uint * td, __local const uchar * inv_sbox, const uint4 * columns_key)
+{
+#pragma unroll
+	for (uint i = 0; i < INTERLEAVE; ++i)
+		s[i] ^= columns_key[0];
+#pragma unroll
+	for (uint round = 1; round < NR; ++round)
+#pragma unroll
+		for (uint i = 0; i < INTERLEAVE; ++i)
+			s[i] = decrypt_columns_round(s[i], td) ^ columns_key[round];
+#pragma unroll
+	for (uint i = 0; i < INTERLEAVE; ++i)
+		s[i] = decrypt_columns_last_round(s[i], inv_sbox) ^ columns_key[NR];
+}
+
+/* The functions below implement the bitsliced engine. BITSLICE_WIDTH blocks
+   are transposed into 128 bit planes: the bit j of the plane 8 * p + b is the
+   bit b of the byte p of the j-th block. Each AES transformation becomes a
+   sequence of logic operations on whole planes, so the blocks are processed
+   all together with no data dependent memory access; in particular SubBytes
+   is computed with the Boyar-Peralta Boolean circuit instead of S-Box lookups.
+   Bytes are still stored by rows, so the byte p = 4 * r + c is the element of
+   the r-th row and c-th column of the AES state. */
+
+//! The number of bit planes of a bitsliced state
+#define BITSLICE_PLANES (AES_BLOCK_SIZE * 8)
+
+/**
+ * Transposes up to BITSLICE_WIDTH consecutive blocks into bit planes.
+ * \param q the bit planes
+ * \param buffer the input/output buffer
+ * \param first_block the first block to transpose
+ * \param count how many blocks to transpose
+ * \param blocks the number of blocks contained in the buffer
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+void load_bitslice(bitslice_t * q, __global const uchar * buffer, size_t first_block, uint count, const ulong blocks, const uint layout)
+{
+	for (uint i = 0; i < BITSLICE_PLANES; ++i)
+		q[i] = 0;
+	for (uint j = 0; j < count; ++j) {
+		for (uint p = 0; p < AES_BLOCK_SIZE; ++p) {
+			bitslice_t byte = buffer[block_byte_offset(first_block + j, p, blocks, layout)];
+			for (uint b = 0; b < 8; ++b)
+				q[p * 8 + b] |= ((byte >> b) & 1) << j;
+		}
+	}
+}
+
+/**
+ * Transposes the bit planes back into up to BITSLICE_WIDTH consecutive blocks.
+ * \param q the bit planes
+ * \param buffer the input/output buffer
+ * \param first_block the first block to store
+ * \param count how many blocks to store
+ * \param blocks the number of blocks contained in the buffer
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+void store_bitslice(const bitslice_t * q, __global uchar * buffer, size_t first_block, uint count, const ulong blocks, const uint layout)
+{
+	for (uint j = 0; j < count; ++j) {
+		for (uint p = 0; p < AES_BLOCK_SIZE; ++p) {
+			uchar byte = 0;
+			for (uint b = 0; b < 8; ++b)
+				byte |= (uchar) (((q[p * 8 + b] >> j) & 1) << b);
+			buffer[block_byte_offset(first_block + j, p, blocks, layout)] = byte;
+		}
+	}
+}
+
+/**
+ * The AES S-Box as the Boyar-Peralta Boolean circuit (113 gates), applied
+ * to the 8 bit planes of a byte.
+ * \note the variables x* and s* are numbered from the most significant bit.
+ */
+void sbox_bitslice(bitslice_t * q)
+{
+	bitslice_t x0, x1, x2, x3, x4, x5, x6, x7;
+	bitslice_t y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11, y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+	bitslice_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11, z12, z13, z14, z15, z16, z17;
+	bitslice_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	bitslice_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	bitslice_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49, t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	bitslice_t t60, t61, t62, t63, t64, t65, t66, t67;
+	bitslice_t s0, s1, s2, s3, s4, s5, s6, s7;
+	x0 = q[7];
+	x1 = q[6];
+	x2 = q[5];
+	x3 = q[4];
+	x4 = q[3];
+	x5 = q[2];
+	x6 = q[1];
+	x7 = q[0];
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+	q[7] = s0;
+	q[6] = s1;
+	q[5] = s2;
+	q[4] = s3;
+	q[3] = s4;
+	q[2] = s5;
+	q[1] = s6;
+	q[0] = s7;
+}
+
+/**
+ * Applies the linear part of the inverse of the S-Box affine transformation,
+ * followed by the XOR with its constant {05}, to the 8 bit planes of a byte.
+ */
+void inv_affine_bitslice(bitslice_t * q)
+{
+	bitslice_t r[8];
+	for (uint i = 0; i < 8; ++i)
+		r[i] = q[(i + 7) & 7] ^ q[(i + 5) & 7] ^ q[(i + 2) & 7];
+	for (uint i = 0; i < 8; ++i)
+		q[i] = r[i];
+	q[0] = ~q[0];
+	q[2] = ~q[2];
+}
+
+void sub_bytes_bitslice(bitslice_t * q)
+{
+	for (uint p = 0; p < AES_BLOCK_SIZE; ++p)
+		sbox_bitslice(q + p * 8);
+}
+
+void inv_sub_bytes_bitslice(bitslice_t * q)
+{
+	/* Since S(x) = A(x^-1) ^ {63}, the inverse S-Box is computed as
+	   S^-1(y) = A^-1(S(A^-1(y ^ {63})) ^ {63}), with the same circuit. */
+	for (uint p = 0; p < AES_BLOCK_SIZE; ++p) {
+		inv_affine_bitslice(q + p * 8);
+		sbox_bitslice(q + p * 8);
+		inv_affine_bitslice(q + p * 8);
+	}
+}
+
+/**
+ * Rotates the rows 1, 2 and 3 of the state to left (or to right) by 1, 2 and 3 columns.
+ * \param q the bit planes
+ * \param direction AES_SHIFT_LEFT or AES_SHIFT_RIGHT
+ */
+void shift_rows_bitslice(bitslice_t * q, int direction)
+{
+	bitslice_t row[AES_STATE_SIDE * 8];
+	for (uint r = 1; r < AES_STATE_SIDE; ++r) {
+		for (uint i = 0; i < AES_STATE_SIDE * 8; ++i)
+			row[i] = q[r * AES_STATE_SIDE * 8 + i];
+		for (uint c = 0; c < AES_STATE_SIDE; ++c) {
+			uint from = (c + AES_STATE_SIDE + direction * (int) r) % AES_STATE_SIDE;
+			for (uint b = 0; b < 8; ++b)
+				q[(r * AES_STATE_SIDE + c) * 8 + b] = row[from * 8 + b];
+		}
+	}
+}
+
+//! Multiplies by 2 a bitsliced byte in the AES field.
+void xtime_bitslice(const bitslice_t * a, bitslice_t * x)
+{
+	x[0] = a[7];
+	x[1] = a[0] ^ a[7];
+	x[2] = a[1];
+	x[3] = a[2] ^ a[7];
+	x[4] = a[3] ^ a[7];
+	x[5] = a[4];
+	x[6] = a[5];
+	x[7] = a[6];
+}
+
+void mix_columns_bitslice(bitslice_t * q)
+{
+	for (uint c = 0; c < AES_STATE_SIDE; ++c) {
+		bitslice_t a[AES_STATE_SIDE][8], t[8], x[8];
+		for (uint r = 0; r < AES_STATE_SIDE; ++r)
+			for (uint b = 0; b < 8; ++b)
+				a[r][b] = q[(r * AES_STATE_SIDE + c) * 8 + b];
+		// new row r = 2 * r ^ 3 * (r + 1) ^ (r + 2) ^ (r + 3)
+		for (uint r = 0; r < AES_STATE_SIDE; ++r) {
+			for (uint b = 0; b < 8; ++b)
+				t[b] = a[r][b] ^ a[(r + 1) % AES_STATE_SIDE][b];
+			xtime_bitslice(t, x);
+			for (uint b = 0; b < 8; ++b)
+				q[(r * AES_STATE_SIDE + c) * 8 + b] = x[b] ^ a[(r + 1) % AES_STATE_SIDE][b] ^ a[(r + 2) % AES_STATE_SIDE][b] ^ a[(r + 3) % AES_STATE_SIDE][b];
+		}
+	}
+}
+
+void inv_mix_columns_bitslice(bitslice_t * q)
+{
+	/* InvMixColumns is MixColumns preceded by the multiplication of each
+	   column by the polynomial {04}x^2 + {05}. */
+	for (uint c = 0; c < AES_STATE_SIDE; ++c) {
+		for (uint r = 0; r < 2; ++r) {
+			bitslice_t t[8], x[8];
+			__private bitslice_t *a0 = q + (r * AES_STATE_SIDE + c) * 8;
+			__private bitslice_t *a2 = q + ((r + 2) * AES_STATE_SIDE + c) * 8;
+			for (uint b = 0; b < 8; ++b)
+				t[b] = a0[b] ^ a2[b];
+			xtime_bitslice(t, x);
+			xtime_bitslice(x, t);
+			for (uint b = 0; b < 8; ++b) {
+				a0[b] ^= t[b];
+				a2[b] ^= t[b];
+			}
+		}
+	}
+	mix_columns_bitslice(q);
+}
+
+void add_round_key_bitslice(bitslice_t * q, const uchar16 * round_key, size_t round_key_index)
+{
+	uchar key[AES_BLOCK_SIZE];
+	vstore16(round_key[round_key_index], 0, key);
+	for (uint p = 0; p < AES_BLOCK_SIZE; ++p) {
+		for (uint b = 0; b < 8; ++b)
+			q[p * 8 + b] ^= (bitslice_t) 0 - ((key[p] >> b) & 1);
+	}
+}
+
+/**
+ * Encrypts BITSLICE_WIDTH bitsliced blocks, doing every AES round on them.
+ * \param q the bit planes of the blocks to encrypt
+ * \param round_key the AES round keys
+ */
+void encrypt_bitslice(bitslice_t * q, const uchar16 * round_key)
+{
+#ifdef SHIFT_ROWS
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		shift_rows_bitslice(q, AES_SHIFT_LEFT);
+#elif defined(MIX_COLUMNS)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		mix_columns_bitslice(q);
+#elif defined(ADD_ROUND_KEY)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		add_round_key_bitslice(q, round_key, NR);
+#elif defined(SUB_BYTES)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		sub_bytes_bitslice(q);
+#else
+	add_round_key_bitslice(q, round_key, 0);
+#pragma unroll
+	for (uint round = 1; round < NR; ++round) {
+		sub_bytes_bitslice(q);
+		shift_rows_bitslice(q, AES_SHIFT_LEFT);
+		mix_columns_bitslice(q);
+		add_round_key_bitslice(q, round_key, round);
+	}
+	sub_bytes_bitslice(q);
+	shift_rows_bitslice(q, AES_SHIFT_LEFT);
+	add_round_key_bitslice(q, round_key, NR);
+#endif
+}
+
+/**
+ * Decrypts BITSLICE_WIDTH bitsliced blocks, doing every AES round on them.
+ * \param q the bit planes of the blocks to decrypt
+ * \param round_key the AES round keys
+ */
+void decrypt_bitslice(bitslice_t * q, const uchar16 * round_key)
+{
+#ifdef SHIFT_ROWS
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		shift_rows_bitslice(q, AES_SHIFT_RIGHT);
+#elif defined(MIX_COLUMNS)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		inv_mix_columns_bitslice(q);
+#elif defined(ADD_ROUND_KEY)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		add_round_key_bitslice(q, round_key, NR);
+#elif defined(SUB_BYTES)
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		inv_sub_bytes_bitslice(q);
+#else
+	add_round_key_bitslice(q, round_key, NR);
+#pragma unroll
+	for (uint round = NR - 1; round > 0; --round) {
+		shift_rows_bitslice(q, AES_SHIFT_RIGHT);
+		inv_sub_bytes_bitslice(q);
+		add_round_key_bitslice(q, round_key, round);
+		inv_mix_columns_bitslice(q);
+	}
+	shift_rows_bitslice(q, AES_SHIFT_RIGHT);
+	inv_sub_bytes_bitslice(q);
+	add_round_key_bitslice(q, round_key, 0);
+#endif
+}
+
+/** 
+ * OpenCL kernel that does a single AES round.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks contained in the buffer
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the AES round keys
+ * \param rounds the number of rounds
+ * \param round the AES round to do
+ */
+__kernel __attribute__ ((vec_type_hint(uchar)))
+void kernel_aes(__global uchar * buffer, const ulong blocks, const uint mode, __constant const uchar * round_key, const uint rounds, const uint round)
+{
+	size_t from_block, to_block;
+	get_work_item_blocks(blocks, &from_block, &to_block);
+
+	if (from_block < to_block) {
+		switch (mode) {
+		case AES_MODE_ENCRYPT:
+			{
+				for (size_t b = from_block; b < to_block; ++b) {
+#ifdef SHIFT_ROWS
+					shift_rows(b, buffer);
+#elif defined(MIX_COLUMNS)
+					mix_columns(b, buffer);
+#elif defined(ADD_ROUND_KEY)
+					add_round_key(b, buffer, round_key, rounds);
+#elif defined(SUB_BYTES)
+					sub_bytes(b, buffer, sbox_encrypt);
+#else
+					if (round == 0) {
+						add_round_key(b, buffer, round_key, 0);
+					} else if (round == rounds) {
+						sub_bytes(b, buffer, sbox_encrypt);
+						shift_rows(b, buffer);
+						add_round_key(b, buffer, round_key, rounds);
+					} else {
+						sub_bytes(b, buffer, sbox_encrypt);
+						shift_rows(b, buffer);
+						mix_columns(b, buffer);
+						add_round_key(b, buffer, round_key, round);
+					}
+#endif
+				}
+				break;
+			}
+		case AES_MODE_DECRYPT:
+			{
+				for (size_t b = from_block; b < to_block; ++b) {
+#ifdef SHIFT_ROWS
+					inv_shift_rows(b, buffer);
+#elif defined(MIX_COLUMNS)
+					inv_mix_columns(b, buffer);
+#elif defined(ADD_ROUND_KEY)
+					add_round_key(b, buffer, round_key, rounds);
+#elif defined(SUB_BYTES)
+					sub_bytes(b, buffer, sbox_decrypt);
+#else
+					if (round == 0) {
+						add_round_key(b, buffer, round_key, rounds);
+					} else if (round == rounds) {
+						inv_shift_rows(b, buffer);
+						sub_bytes(b, buffer, sbox_decrypt);
+						add_round_key(b, buffer, round_key, 0);
+					} else {
+						inv_shift_rows(b, buffer);
+						sub_bytes(b, buffer, sbox_decrypt);
+						add_round_key(b, buffer, round_key, rounds - round);
+						inv_mix_columns(b, buffer);
+					}
+#endif
+				}
+				break;
+			}
+		}
+	}
+}
+
+/** 
+ * OpenCL kernel that does every AES round of its blocks in a single launch,
+ * so that the host doesn't need to enqueue (and wait for) a kernel per round.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks contained in the buffer
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the AES round keys
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar)))
+void kernel_aes_fused(__global uchar * buffer, const ulong blocks, const uint mode, __constant const uchar * round_key, const uint distribution)
+{
+	size_t first_block, end_block, step;
+	get_work_item_sequence(blocks, distribution, &first_block, &end_block, &step);
+
+	switch (mode) {
+	case AES_MODE_ENCRYPT:
+		for (size_t b = first_block; b < end_block; b += step)
+			encrypt_block(b, buffer, round_key);
+		break;
+	case AES_MODE_DECRYPT:
+		for (size_t b = first_block; b < end_block; b += step)
+			decrypt_block(b, buffer, round_key);
+		break;
+	}
+}
+
+/** 
+ * OpenCL kernel that does every AES round of its blocks in a single launch,
+ * keeping each block in private memory: a block is read from the buffer with
+ * a single 16 bytes load and written back with a single 16 bytes store.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks contained in the buffer
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the AES round keys
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_private(__global uchar * buffer, const ulong blocks, const uint mode, __constant const uchar * round_key, const uint distribution, const uint layout)
+{
+	uchar16 private_key[NR + 1];
+	size_t first_block, end_block, step;
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence(blocks, distribution, &first_block, &end_block, &step);
+
+	switch (mode) {
+	case AES_MODE_ENCRYPT:
+		for (size_t b = first_block; b < end_block; b += step)
+			store_block(encrypt_state(load_block(b, buffer, blocks, layout), private_key), b, buffer, blocks, layout);
+		break;
+	case AES_MODE_DECRYPT:
+		for (size_t b = first_block; b < end_block; b += step)
+			store_block(decrypt_state(load_block(b, buffer, blocks, layout), private_key), b, buffer, blocks, layout);
+		break;
+	}
+}
+
+/** 
+ * OpenCL kernel that encrypts its blocks in a single launch, using four
+ * T-tables copied in local memory by each work group. The blocks are taken
+ * INTERLEAVE at a time; the last blocks % INTERLEAVE are taken one at a time.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks contained in the buffer
+ * \param round_key the AES round keys
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+__kernel __attribute__ ((vec_type_hint(INTERLEAVE_VECTOR)))
+void kernel_aes_encrypt(__global uchar * buffer, const ulong blocks, __constant const uchar * round_key, const uint distribution, const uint layout)
+{
+	size_t first_block, end_block, step;
+#if defined(SHIFT_ROWS) || defined(MIX_COLUMNS) || defined(ADD_ROUND_KEY) || defined(SUB_BYTES)
+	uchar16 private_key[NR + 1];
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence(blocks, distribution, &first_block, &end_block, &step);
+
+	// A table driven round can't be split in its single operations
+	for (size_t b = first_block; b < end_block; b += step)
+		store_block(encrypt_state(load_block(b, buffer, blocks, layout), private_key), b, buffer, blocks, layout);
+#else
+	__local uint t_tables[T_TABLE_COPIES * 4 * AES_SBOX_SIZE];
+	__local uint columns_key[ROUND_KEY_SIZE / 4];
+	uint4 private_columns_key[NR + 1];
+	uint4 s[INTERLEAVE];
+
+	init_encrypt_tables(t_tables, round_key, columns_key);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		private_columns_key[round] = vload4(round, columns_key);
+	__local const uint *t_table = t_tables + get_local_id(0) % T_TABLE_COPIES;
+
+	get_work_item_sequence(blocks / INTERLEAVE, distribution, &first_block, &end_block, &step);
+	for (size_t g = first_block; g < end_block; g += step) {
+#pragma unroll
+		for (uint i = 0; i < INTERLEAVE; ++i)
+			s[i] = block_to_columns(load_block(g * INTERLEAVE + i, buffer, blocks, layout));
+		encrypt_columns_interleaved(s, t_table, private_columns_key);
+#pragma unroll
+		for (uint i = 0; i < INTERLEAVE; ++i)
+			store_block(columns_to_block(s[i]), g * INTERLEAVE + i, buffer, blocks, layout);
+	}
+
+	for (size_t b = blocks - blocks % INTERLEAVE + get_global_id(0); b < blocks; b += get_global_size(0))
+		store_block(columns_to_block(encrypt_columns(block_to_columns(load_block(b, buffer, blocks, layout)), t_table, private_columns_key)), b, buffer, blocks, layout);
+#endif
+}
+
+/** 
+ * OpenCL kernel that decrypts its blocks in a single launch, using four
+ * T-tables copied in local memory by each work group. It runs the equivalent
+ * inverse cipher, which has the same structure of the encryption. The blocks
+ * are taken INTERLEAVE at a time; the last blocks % INTERLEAVE are taken one at a time.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks contained in the buffer
+ * \param round_key the AES round keys, followed by the decryption round keys of the equivalent inverse cipher
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+__kernel __attribute__ ((vec_type_hint(INTERLEAVE_VECTOR)))
+void kernel_aes_decrypt(__global uchar * buffer, const ulong blocks, __constant const uchar * round_key, const uint distribution, const uint layout)
+{
+	size_t first_block, end_block, step;
+#if defined(SHIFT_ROWS) || defined(MIX_COLUMNS) || defined(ADD_ROUND_KEY) || defined(SUB_BYTES)
+	uchar16 private_key[NR + 1];
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence(blocks, distribution, &first_block, &end_block, &step);
+
+	for (size_t b = first_block; b < end_block; b += step)
+		store_block(decrypt_state(load_block(b, buffer, blocks, layout), private_key), b, buffer, blocks, layout);
+#else
+	__local uint t_tables[T_TABLE_COPIES * 4 * AES_SBOX_SIZE];
+	__local uchar inv_sbox[AES_SBOX_SIZE];
+	__local uint columns_key[ROUND_KEY_SIZE / 4];
+	uint4 private_columns_key[NR + 1];
+	uint4 s[INTERLEAVE];
+
+	init_decrypt_tables(t_tables, inv_sbox, round_key + (NR + 1) * AES_BLOCK_SIZE, columns_key);
+#pragma unroll
+	for (uint round = 0; round <= NR; ++round)
+		private_columns_key[round] = vload4(round, columns_key);
+	__local const uint *t_table = t_tables + get_local_id(0) % T_TABLE_COPIES;
+
+	get_work_item_sequence(blocks / INTERLEAVE, distribution, &first_block, &end_block, &step);
+	for (size_t g = first_block; g < end_block; g += step) {
+#pragma unroll
+		for (uint i = 0; i < INTERLEAVE; ++i)
+			s[i] = block_to_columns(load_block(g * INTERLEAVE + i, buffer, blocks, layout));
+		decrypt_columns_interleaved(s, t_table, inv_sbox, private_columns_key);
+#pragma unroll
+		for (uint i = 0; i < INTERLEAVE; ++i)
+			store_block(columns_to_block(s[i]), g * INTERLEAVE + i, buffer, blocks, layout);
+	}
+
+	for (size_t b = blocks - blocks % INTERLEAVE + get_global_id(0); b < blocks; b += get_global_size(0))
+		store_block(columns_to_block(decrypt_columns(block_to_columns(load_block(b, buffer, blocks, layout)), t_table, inv_sbox, private_columns_key)), b, buffer, blocks, layout);
+#endif
+}
+
+/** 
+ * OpenCL kernel that does every AES round of its blocks in a single launch,
+ * with the bitsliced implementation: each work item processes groups of
+ * BITSLICE_WIDTH consecutive blocks at a time.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks contained in the buffer
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the AES round keys
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ * \param layout one between AES_LAYOUT_LINEAR and AES_LAYOUT_INTERLEAVED
+ */
+#ifdef BITSLICE_64
+__kernel __attribute__ ((vec_type_hint(ulong)))
+#else
+__kernel __attribute__ ((vec_type_hint(uint)))
+#endif
+void kernel_aes_bitslice(__global uchar * buffer, const ulong blocks, const uint mode, __constant const uchar * round_key, const uint distribution, const uint layout)
+{
+	bitslice_t q[BITSLICE_PLANES];
+	uchar16 private_key[NR + 1];
+	size_t first_group, end_group, step;
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence((blocks + BITSLICE_WIDTH - 1) / BITSLICE_WIDTH, distribution, &first_group, &end_group, &step);
+
+	for (size_t g = first_group; g < end_group; g += step) {
+		size_t first_block = g * BITSLICE_WIDTH;
+		uint count = blocks - first_block < BITSLICE_WIDTH ? blocks - first_block : BITSLICE_WIDTH;
+		load_bitslice(q, buffer, first_block, count, blocks, layout);
+		if (mode == AES_MODE_ENCRYPT)
+			encrypt_bitslice(q, private_key);
+		else
+			decrypt_bitslice(q, private_key);
+		store_bitslice(q, buffer, first_block, count, blocks, layout);
+	}
+}
+
+/**
+ * Returns the counter block of a block for the CTR chaining: the
+ * initialization vector plus the block index, as a 128 bits big endian integer.
+ * \param iv_high the most significant 64 bits of the initialization vector
+ * \param iv_low the least significant 64 bits of the initialization vector
+ * \param block the block index
+ */
+uchar16 counter_block(const ulong iv_high, const ulong iv_low, size_t block)
+{
+	ulong low = iv_low + block;
+	ulong high = iv_high + (low < iv_low);
+	uchar bytes[AES_BLOCK_SIZE];
+	for (uint i = 0; i < 8; ++i) {
+		bytes[i] = (uchar) (high >> (56 - 8 * i));
+		bytes[8 + i] = (uchar) (low >> (56 - 8 * i));
+	}
+	return vload16(0, bytes);
+}
+
+/** 
+ * OpenCL kernel that encrypts or decrypts (it's the same) with the CTR
+ * chaining: each work item makes the counter blocks of its blocks, encrypts
+ * them in private memory and XORs them into the buffer. The trailing bytes
+ * that don't make a whole block are XORed with the beginning of one more
+ * key stream block, so the data size is preserved.
+ * \param buffer the input/output buffer
+ * \param size the size of the buffer, in bytes
+ * \param round_key the AES round keys
+ * \param iv_high the most significant 64 bits of the initialization vector
+ * \param iv_low the least significant 64 bits of the initialization vector
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_ctr(__global uchar * buffer, const ulong size, __constant const uchar * round_key, const ulong iv_high, const ulong iv_low, const uint distribution)
+{
+	uchar16 private_key[NR + 1];
+	size_t first_block, end_block, step;
+	ulong blocks = size / AES_BLOCK_SIZE;
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence(blocks, distribution, &first_block, &end_block, &step);
+
+	for (size_t b = first_block; b < end_block; b += step)
+		vstore16(vload16(b, buffer) ^ encrypt_standard(counter_block(iv_high, iv_low, b), private_key), b, buffer);
+
+	if (size % AES_BLOCK_SIZE != 0 && get_global_id(0) == 0) {
+		uchar key_stream[AES_BLOCK_SIZE];
+		vstore16(encrypt_standard(counter_block(iv_high, iv_low, blocks), private_key), 0, key_stream);
+		for (uint i = 0; i < size % AES_BLOCK_SIZE; ++i)
+			buffer[blocks * AES_BLOCK_SIZE + i] ^= key_stream[i];
+	}
+}
+
+/** 
+ * Converts an XTS tweak from the 16 bytes of a block to a 128 bits integer;
+ * the first byte is the least significant one (IEEE 1619 byte order).
+ * \param block the tweak as a block
+ * \return the tweak as an integer, with the least significant 64 bits in x
+ */
+ulong2 block_to_tweak(uchar16 block)
+{
+	uchar bytes[AES_BLOCK_SIZE];
+	ulong2 tweak = (ulong2) (0, 0);
+	vstore16(block, 0, bytes);
+	for (uint i = 0; i < 8; ++i) {
+		tweak.x |= (ulong) bytes[i] << (8 * i);
+		tweak.y |= (ulong) bytes[8 + i] << (8 * i);
+	}
+	return tweak;
+}
+
+//! The inverse of \ref block_to_tweak.
+uchar16 tweak_to_block(ulong2 tweak)
+{
+	uchar bytes[AES_BLOCK_SIZE];
+	for (uint i = 0; i < 8; ++i) {
+		bytes[i] = (uchar) (tweak.x >> (8 * i));
+		bytes[8 + i] = (uchar) (tweak.y >> (8 * i));
+	}
+	return vload16(0, bytes);
+}
+
+/** 
+ * Multiplies the XTS tweak by x (the primitive element alpha) in GF(2^128),
+ * modulo x^128 + x^7 + x^2 + x + 1; this gives the tweak of the next block.
+ * \param tweak the tweak of a block
+ * \return the tweak of the following block
+ */
+ulong2 double_tweak(ulong2 tweak)
+{
+	ulong2 doubled;
+	doubled.y = (tweak.y << 1) | (tweak.x >> 63);
+	doubled.x = (tweak.x << 1) ^ (0x87 & -(tweak.y >> 63));
+	return doubled;
+}
+
+/** 
+ * Encrypts or decrypts a block with XTS: the block is XORed with the tweak
+ * both before and after going through AES.
+ * \param state the block
+ * \param tweak the tweak of the block
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the round keys, already in private memory
+ * \return the encrypted or decrypted block
+ */
+uchar16 xts_block(uchar16 state, ulong2 tweak, const uint mode, const uchar16 * round_key)
+{
+	uchar16 t = tweak_to_block(tweak);
+	state ^= t;
+	state = mode == AES_MODE_ENCRYPT ? encrypt_standard(state, round_key) : decrypt_standard(state, round_key);
+	return state ^ t;
+}
+
+/** 
+ * Encrypts or decrypts a whole sector (an XTS data unit). If the sector
+ * doesn't end on a block boundary its last whole block and the trailing
+ * bytes are processed with the ciphertext stealing, so the size is preserved.
+ * \param sector the beginning of the sector in the buffer
+ * \param length the sector length in bytes; it must be at least AES_BLOCK_SIZE
+ * \param tweak the tweak of the first block of the sector
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the round keys, already in private memory
+ */
+void xts_sector(__global uchar * sector, size_t length, ulong2 tweak, const uint mode, const uchar16 * round_key)
+{
+	size_t blocks = length / AES_BLOCK_SIZE;
+	uint tail = length % AES_BLOCK_SIZE;
+	size_t whole = tail == 0 ? blocks : blocks - 1;
+
+	for (size_t b = 0; b < whole; ++b) {
+		vstore16(xts_block(vload16(b, sector), tweak, mode, round_key), b, sector);
+		tweak = double_tweak(tweak);
+	}
+	if (tail == 0)
+		return;
+
+	/* Ciphertext stealing: the last whole block is processed with the tweak
+	   that comes after its own when decrypting, and the trailing bytes are
+	   padded with the end of the other one's output. */
+	ulong2 next_tweak = double_tweak(tweak);
+	__global uchar *last = sector + whole * AES_BLOCK_SIZE;
+	uchar stolen[AES_BLOCK_SIZE];
+	vstore16(xts_block(vload16(0, last), mode == AES_MODE_ENCRYPT ? tweak : next_tweak, mode, round_key), 0, stolen);
+	for (uint i = 0; i < tail; ++i) {
+		uchar byte = last[AES_BLOCK_SIZE + i];
+		last[AES_BLOCK_SIZE + i] = stolen[i];
+		stolen[i] = byte;
+	}
+	vstore16(xts_block(vload16(0, stolen), mode == AES_MODE_ENCRYPT ? next_tweak : tweak, mode, round_key), 0, last);
+}
+
+/** 
+ * OpenCL kernel that encrypts or decrypts with the XTS chaining: the buffer
+ * is split in sectors, each one is processed independently by a single work
+ * item. The tweak of the first block of a sector is its number (little
+ * endian) encrypted with the tweak key, the tweaks of the following blocks
+ * are got by doubling it. The last sector may be shorter than the others,
+ * or longer when the trailing bytes don't make a whole block.
+ * \param buffer the input/output buffer
+ * \param size the size of the buffer, in bytes
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the AES round keys of the data key
+ * \param tweak_key the AES round keys of the tweak key
+ * \param sector_size the size of a sector, in bytes; it's a multiple of AES_BLOCK_SIZE
+ * \param first_sector the number of the sector at the beginning of the buffer
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_xts(__global uchar * buffer, const ulong size, const uint mode, __constant const uchar * round_key, __constant const uchar * tweak_key, const uint sector_size, const ulong first_sector, const uint distribution)
+{
+	uchar16 private_key[NR + 1], private_tweak_key[NR + 1];
+	size_t first, end, step;
+	ulong sectors = size / sector_size;
+	// A last sector shorter than a block can't be processed on its own, so it's merged with the previous one
+	if (size % sector_size >= AES_BLOCK_SIZE || sectors == 0)
+		++sectors;
+	load_round_keys(round_key, private_key);
+	load_round_keys(tweak_key, private_tweak_key);
+	get_work_item_sequence(sectors, distribution, &first, &end, &step);
+
+	for (size_t s = first; s < end; s += step) {
+		ulong2 sector_number = (ulong2) (first_sector + s, 0);
+		ulong2 tweak = block_to_tweak(encrypt_standard(tweak_to_block(sector_number), private_tweak_key));
+		size_t offset = s * sector_size;
+		xts_sector(buffer + offset, s == sectors - 1 ? size - offset : sector_size, tweak, mode, private_key);
+	}
+}
+
+/** 
+ * Converts a block to an element of GF(2^128) as GHASH sees it: the first
+ * bit of the block (the most significant one of the first byte) is the
+ * coefficient of x^0.
+ * \param block the block
+ * \return the element, with the first 8 bytes of the block (big endian) in x
+ */
+ulong2 block_to_ghash(uchar16 block)
+{
+	uchar bytes[AES_BLOCK_SIZE];
+	ulong2 element = (ulong2) (0, 0);
+	vstore16(block, 0, bytes);
+	for (uint i = 0; i < 8; ++i) {
+		element.x = (element.x << 8) | bytes[i];
+		element.y = (element.y << 8) | bytes[8 + i];
+	}
+	return element;
+}
+
+//! The inverse of \ref block_to_ghash.
+uchar16 ghash_to_block(ulong2 element)
+{
+	uchar bytes[AES_BLOCK_SIZE];
+	for (uint i = 0; i < 8; ++i) {
+		bytes[i] = (uchar) (element.x >> (56 - 8 * i));
+		bytes[8 + i] = (uchar) (element.y >> (56 - 8 * i));
+	}
+	return vload16(0, bytes);
+}
+
+//! Multiplies a GHASH element by x, modulo x^128 + x^7 + x^2 + x + 1.
+ulong2 gf128_multiply_x(ulong2 v)
+{
+	ulong2 r;
+	r.y = (v.y >> 1) | (v.x << 63);
+	r.x = (v.x >> 1) ^ (0xe100000000000000UL & -(v.y & 1));
+	return r;
+}
+
+/** 
+ * Multiplies two GHASH elements bit by bit; it's slow, so it's used only
+ * once per work item, to align the partial hashes.
+ * \param x the first factor
+ * \param y the second factor
+ * \return the product
+ */
+ulong2 gf128_multiply(ulong2 x, ulong2 y)
+{
+	ulong2 z = (ulong2) (0, 0);
+	for (uint i = 0; i < 128; ++i) {
+		ulong bit = i < 64 ? x.x >> (63 - i) : x.y >> (127 - i);
+		if (bit & 1)
+			z ^= y;
+		y = gf128_multiply_x(y);
+	}
+	return z;
+}
+
+/** 
+ * Multiplies a GHASH element by H, 4 bits at a time, with the table of the
+ * multiples of H (Shoup's method).
+ * \param x the element
+ * \param h_table the 16 products of H and the 4 bits polynomials
+ * \return the product
+ */
+ulong2 ghash_multiply_h(ulong2 x, __constant const ulong2 * h_table)
+{
+	const ushort reduction[16] = { 0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+		0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+	};
+	uchar bytes[AES_BLOCK_SIZE];
+	vstore16(ghash_to_block(x), 0, bytes);
+
+	ulong2 z = (ulong2) (0, 0);
+	for (int i = AES_BLOCK_SIZE * 2 - 1; i >= 0; --i) {
+		uint nibble = i % 2 ? bytes[i / 2] & 0xf : bytes[i / 2] >> 4;
+		uint rem = (uint) z.y & 0xf;
+		z.y = (z.x << 60) | (z.y >> 4);
+		z.x = (z.x >> 4) ^ ((ulong) reduction[rem] << 48);
+		z ^= h_table[nibble];
+	}
+	return z;
+}
+
+/** 
+ * Multiplies a GHASH element by H^exponent, using the precomputed H^(2^j).
+ * \param x the element
+ * \param exponent the power of H
+ * \param h_powers the powers H^(2^j), for j between 0 and 63
+ * \return the product
+ */
+ulong2 ghash_multiply_h_power(ulong2 x, ulong exponent, __constant const ulong2 * h_powers)
+{
+	for (uint j = 0; exponent != 0; ++j, exponent >>= 1)
+		if (exponent & 1)
+			x = gf128_multiply(x, h_powers[j]);
+	return x;
+}
+
+/** 
+ * Returns a GCM counter block: the first 96 bits of the initialization
+ * vector followed by a 32 bits big endian counter.
+ * \param iv_high the first 64 bits of the initialization vector
+ * \param iv_low the last 32 bits of the initialization vector, in the most significant half
+ * \param counter the counter
+ */
+uchar16 gcm_counter_block(const ulong iv_high, const ulong iv_low, uint counter)
+{
+	return counter_block(iv_high, (iv_low & 0xffffffff00000000UL) | counter, 0);
+}
+
+/** 
+ * OpenCL kernel, run by a single work item, that prepares the GHASH table
+ * (see \ref GCM_TABLE_SIZE): the multiples of the hash subkey H = E(0) for
+ * \ref ghash_multiply_h, the powers H^(2^j) and the encrypted first counter
+ * block, that masks the tag.
+ * \param round_key the AES round keys
+ * \param ghash_table where the table will be stored
+ * \param iv_high the first 64 bits of the initialization vector
+ * \param iv_low the last 32 bits of the initialization vector, in the most significant half
+ */
+__kernel void kernel_gcm_setup(__constant const uchar * round_key, __global ulong2 * ghash_table, const ulong iv_high, const ulong iv_low)
+{
+	uchar16 private_key[NR + 1];
+	load_round_keys(round_key, private_key);
+
+	ulong2 h = block_to_ghash(encrypt_standard((uchar16) (0), private_key));
+	ulong2 v = h;
+	ghash_table[0] = (ulong2) (0, 0);
+	for (uint i = 8; i > 0; i >>= 1) {
+		ghash_table[i] = v;
+		v = gf128_multiply_x(v);
+	}
+	for (uint i = 2; i < 16; i <<= 1)
+		for (uint j = 1; j < i; ++j)
+			ghash_table[i + j] = ghash_table[i] ^ ghash_table[j];
+
+	v = h;
+	for (uint j = 0; j < GCM_TABLE_POWERS_SIZE; ++j) {
+		ghash_table[GCM_TABLE_POWERS + j] = v;
+		v = gf128_multiply(v, v);
+	}
+
+	ghash_table[GCM_TABLE_TAG_MASK] = block_to_ghash(encrypt_standard(gcm_counter_block(iv_high, iv_low, 1), private_key));
+}
+
+/** 
+ * OpenCL kernel that encrypts or decrypts with the GCM chaining, computing
+ * GHASH of the encrypted data in the same pass. Each work item encrypts its
+ * contiguous range of blocks with the counters from 2 onwards and hashes
+ * them with Horner's rule; then it multiplies the partial hash by the power
+ * of H that aligns it to the end of the data, so the partial hashes of the
+ * work group are just XORed together. The host combines the work groups'
+ * results, adds the lengths block and masks the tag.
+ * \param buffer the input/output buffer
+ * \param size the size of the buffer, in bytes
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param round_key the AES round keys
+ * \param ghash_table the table prepared by \ref kernel_gcm_setup
+ * \param iv_high the first 64 bits of the initialization vector
+ * \param iv_low the last 32 bits of the initialization vector, in the most significant half
+ * \param ghash_scratch local memory for the work group reduction, an element for each work item
+ * \param ghash_partial where the partial hash of each work group will be stored
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_gcm(__global uchar * buffer, const ulong size, const uint mode, __constant const uchar * round_key, __constant const ulong2 * ghash_table, const ulong iv_high, const ulong iv_low, __local ulong2 * ghash_scratch, __global ulong2 * ghash_partial)
+{
+	uchar16 private_key[NR + 1];
+	size_t from, to;
+	ulong blocks = size / AES_BLOCK_SIZE;
+	uint tail = size % AES_BLOCK_SIZE;
+	ulong hashed_blocks = blocks + (tail != 0);
+	ulong2 hash = (ulong2) (0, 0);
+	load_round_keys(round_key, private_key);
+	get_work_item_blocks(blocks, &from, &to);
+
+	for (size_t b = from; b < to; ++b) {
+		uchar16 data = vload16(b, buffer);
+		uchar16 result = data ^ encrypt_standard(gcm_counter_block(iv_high, iv_low, (uint) b + 2), private_key);
+		vstore16(result, b, buffer);
+		hash = ghash_multiply_h(hash ^ block_to_ghash(mode == AES_MODE_ENCRYPT ? result : data), ghash_table);
+	}
+	if (from < to)
+		hash = ghash_multiply_h_power(hash, hashed_blocks - to, ghash_table + GCM_TABLE_POWERS);
+
+	// The trailing bytes are hashed padded with zeros, as the last block
+	if (tail != 0 && get_global_id(0) == 0) {
+		uchar key_stream[AES_BLOCK_SIZE], hashed[AES_BLOCK_SIZE];
+		vstore16(encrypt_standard(gcm_counter_block(iv_high, iv_low, (uint) blocks + 2), private_key), 0, key_stream);
+		vstore16((uchar16) (0), 0, hashed);
+		for (uint i = 0; i < tail; ++i) {
+			uchar data = buffer[blocks * AES_BLOCK_SIZE + i];
+			uchar result = data ^ key_stream[i];
+			buffer[blocks * AES_BLOCK_SIZE + i] = result;
+			hashed[i] = mode == AES_MODE_ENCRYPT ? result : data;
+		}
+		hash ^= ghash_multiply_h(block_to_ghash(vload16(0, hashed)), ghash_table);
+	}
+
+	uint lid = get_local_id(0);
+	ghash_scratch[lid] = hash;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint n = get_local_size(0); n > 1;) {
+		uint half = (n + 1) / 2;
+		if (lid + half < n)
+			ghash_scratch[lid] ^= ghash_scratch[lid + half];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		n = half;
+	}
+	if (lid == 0)
+		ghash_partial[get_group_id(0)] = ghash_scratch[0];
+}
+
+/** 
+ * OpenCL kernel that encrypts with the CBC chaining: the blocks are split
+ * in segments (independent streams) and each segment is chained by a single
+ * work item, so that many streams are encrypted at once. The initialization
+ * vector of the segment s is the initialization vector plus s, as a 128 bits
+ * big endian integer; with a single segment this is the plain CBC.
+ * \param buffer the input/output buffer
+ * \param blocks the number of blocks in the buffer
+ * \param round_key the AES round keys
+ * \param iv_high the most significant 64 bits of the initialization vector
+ * \param iv_low the least significant 64 bits of the initialization vector
+ * \param segment_blocks the number of blocks of a segment
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_cbc_encrypt(__global uchar * buffer, const ulong blocks, __constant const uchar * round_key, const ulong iv_high, const ulong iv_low, const ulong segment_blocks, const uint distribution)
+{
+	uchar16 private_key[NR + 1];
+	size_t first, end, step;
+	ulong segments = (blocks + segment_blocks - 1) / segment_blocks;
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence(segments, distribution, &first, &end, &step);
+
+	for (size_t s = first; s < end; s += step) {
+		uchar16 chain = counter_block(iv_high, iv_low, s);
+		size_t last = min((size_t) ((s + 1) * segment_blocks), (size_t) blocks);
+		for (size_t b = s * segment_blocks; b < last; ++b) {
+			chain = encrypt_standard(vload16(b, buffer) ^ chain, private_key);
+			vstore16(chain, b, buffer);
+		}
+	}
+}
+
+/** 
+ * OpenCL kernel that decrypts with the CBC chaining (see \ref
+ * kernel_aes_cbc_encrypt). Every block is decrypted on its own and XORed
+ * with the previous encrypted block, or with the initialization vector of
+ * its segment, so the encrypted blocks are read from a separate input
+ * buffer that's never overwritten.
+ * \param input the encrypted blocks
+ * \param output where the decrypted blocks will be stored
+ * \param blocks the number of blocks in the buffers
+ * \param round_key the AES round keys
+ * \param iv_high the most significant 64 bits of the initialization vector
+ * \param iv_low the least significant 64 bits of the initialization vector
+ * \param segment_blocks the number of blocks of a segment
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_cbc_decrypt(__global const uchar * input, __global uchar * output, const ulong blocks, __constant const uchar * round_key, const ulong iv_high, const ulong iv_low, const ulong segment_blocks, const uint distribution)
+{
+	uchar16 private_key[NR + 1];
+	size_t first_block, end_block, step;
+	load_round_keys(round_key, private_key);
+	get_work_item_sequence(blocks, distribution, &first_block, &end_block, &step);
+
+	for (size_t b = first_block; b < end_block; b += step) {
+		uchar16 previous = b % segment_blocks == 0 ? counter_block(iv_high, iv_low, b / segment_blocks) : vload16(b - 1, input);
+		vstore16(decrypt_standard(vload16(b, input), private_key) ^ previous, b, output);
+	}
+}
+
+/**
+ * Finds the segment of a batch that holds a unit (a block, or an XTS sector), with a binary
+ * search on the first units of the segments. The empty segments have the same first unit of
+ * the next one, so the last segment that starts at or before the unit is the right one.
+ * \param segments the segment table (see \ref BATCH_SEGMENT_WORDS)
+ * \param count the number of segments, at least 1
+ * \param unit the unit
+ * \return the index of the segment
+ */
+uint find_segment(__global const ulong * segments, const uint count, const ulong unit)
+{
+	uint low = 0, high = count - 1;
+	while (low < high) {
+		uint middle = (low + high + 1) / 2;
+		if (segments[middle * BATCH_SEGMENT_WORDS + BATCH_SEGMENT_FIRST_UNIT] <= unit)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	return low;
+}
+
+/** 
+ * OpenCL kernel that encrypts or decrypts a batch of independent segments
+ * (e.g. many small files) packed in the same buffer, so that a single launch
+ * keeps the whole device busy. The units of every segment are numbered one
+ * after the other, and each work item finds the segment of its units in the
+ * segment table; the segments are processed as kernel_aes_private,
+ * kernel_aes_ctr and kernel_aes_xts would process them one at a time. With
+ * ECB the units are the whole blocks of a segment, and its trailing bytes
+ * stay as they are; with CTR they include the last partial block, whose key
+ * stream runs into the padding up to the next segment; with XTS they're the
+ * sectors. Every segment has its own key, taken from the key table: a work
+ * item loads the round keys again only when the key changes, which with the
+ * contiguous distribution happens at most a few times.
+ * \param buffer the input/output buffer
+ * \param segments the segment table (see \ref BATCH_SEGMENT_WORDS)
+ * \param count the number of segments
+ * \param units the number of units of all the segments
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param chaining one between AES_CHAINING_ECB, AES_CHAINING_CTR and AES_CHAINING_XTS
+ * \param round_keys the key table: the AES round keys of each key, followed by the ones of its
+ *        tweak key for AES_CHAINING_XTS
+ * \param sector_size the size of an XTS sector, in bytes
+ * \param distribution one between AES_DISTRIBUTION_CONTIGUOUS and AES_DISTRIBUTION_STRIDED
+ */
+__kernel __attribute__ ((vec_type_hint(uchar16)))
+void kernel_aes_batch(__global uchar * buffer, __global const ulong * segments, const uint count, const ulong units, const uint mode, const uint chaining, __global const uchar * round_keys, const uint sector_size, const uint distribution)
+{
+	uchar16 private_key[NR + 1], private_tweak_key[NR + 1];
+	size_t first, end, step;
+	size_t key_stride = (chaining == AES_CHAINING_XTS ? 2 : 1) * (NR + 1) * AES_BLOCK_SIZE;
+	ulong loaded_key = ULONG_MAX;
+	get_work_item_sequence(units, distribution, &first, &end, &step);
+
+	for (size_t u = first; u < end; u += step) {
+		__global const ulong *segment = segments + find_segment(segments, count, u) * BATCH_SEGMENT_WORDS;
+		__global uchar *data = buffer + segment[BATCH_SEGMENT_OFFSET];
+		size_t index = u - segment[BATCH_SEGMENT_FIRST_UNIT];
+
+		if (segment[BATCH_SEGMENT_KEY] != loaded_key) {
+			loaded_key = segment[BATCH_SEGMENT_KEY];
+			load_global_round_keys(round_keys + loaded_key * key_stride, private_key);
+			if (chaining == AES_CHAINING_XTS)
+				load_global_round_keys(round_keys + loaded_key * key_stride + (NR + 1) * AES_BLOCK_SIZE, private_tweak_key);
+		}
+
+		if (chaining == AES_CHAINING_CTR) {
+			vstore16(vload16(index, data) ^ encrypt_standard(counter_block(segment[BATCH_SEGMENT_IV_HIGH], segment[BATCH_SEGMENT_IV_LOW], index), private_key), index, data);
+		} else if (chaining == AES_CHAINING_XTS) {
+			// As in kernel_aes_xts, a last sector shorter than a block is merged with the previous one
+			ulong2 sector_number = (ulong2) (segment[BATCH_SEGMENT_IV_LOW] + index, 0);
+			ulong2 tweak = block_to_tweak(encrypt_standard(tweak_to_block(sector_number), private_tweak_key));
+			size_t offset = index * sector_size, rest = segment[BATCH_SEGMENT_LENGTH] - offset;
+			xts_sector(data + offset, rest < sector_size + AES_BLOCK_SIZE ? rest : sector_size, tweak, mode, private_key);
+		} else if (mode == AES_MODE_ENCRYPT) {
+			vstore16(encrypt_state(vload16(index, data), private_key), index, data);
+		} else {
+			vstore16(decrypt_state(vload16(index, data), private_key), index, data);
 		}
 	}
 }
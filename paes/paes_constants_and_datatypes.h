@@ -171,6 +171,132 @@ typedef unsigned aes_mode;
 //! Represents an invalid AES usage mode.
 #define AES_MODE_NONE 2
 
+/**
+ * Represents one of the ways the blocks are chained (the AES mode of operation).
+ * It can be one between \ref AES_CHAINING_ECB, \ref AES_CHAINING_CTR, \ref AES_CHAINING_XTS, \ref AES_CHAINING_GCM, \ref AES_CHAINING_CBC or \ref AES_CHAINING_NONE.
+ * Every chaining but ECB runs standard AES (FIPS-197); ECB keeps the row-major blocks of the PAES engines.
+ */
+typedef unsigned aes_chaining;
+
+//! Each block is encrypted on its own (Electronic CodeBook).
+#define AES_CHAINING_ECB 0
+
+//! The blocks are XORed with the encrypted counter blocks (CounTeR); encryption and decryption are the same.
+#define AES_CHAINING_CTR 1
+
+//! Each sector is encrypted on its own, with a tweak got from its number and a second key (XEX-based Tweaked CodeBook with ciphertext Stealing).
+#define AES_CHAINING_XTS 2
+
+//! The blocks are encrypted as with CTR and authenticated with GHASH (Galois/Counter Mode).
+#define AES_CHAINING_GCM 3
+
+//! Each block is XORed with the previous encrypted block before being encrypted (Cipher Block Chaining).
+#define AES_CHAINING_CBC 4
+
+//! Represents an invalid chaining.
+#define AES_CHAINING_NONE 5
+
+//! The default chaining, to be used in case the user doesn't specify otherwise.
+#define DEFAULT_CHAINING AES_CHAINING_ECB
+
+//! The size of the initialization vector (the initial counter block for CTR), in bytes; it's the same for CBC
+#define AES_IV_SIZE 16
+
+//! The default size of an XTS sector (data unit), in bytes
+#define XTS_DEFAULT_SECTOR_SIZE 512
+
+//! The size of the GCM initialization vector, in bytes
+#define GCM_IV_SIZE 12
+
+//! The size of the GCM authentication tag, in bytes
+#define GCM_TAG_SIZE 16
+
+/**
+ * The number of elements (128 bits each) of the GHASH table prepared by the device: the 16
+ * multiples of H, \ref GCM_TABLE_POWERS_SIZE powers of H and the tag mask.
+ */
+#define GCM_TABLE_SIZE 81
+
+//! The index in the GHASH table of H itself.
+#define GCM_TABLE_H 8
+
+//! The index in the GHASH table of the powers H^(2^j).
+#define GCM_TABLE_POWERS 16
+
+//! The number of powers H^(2^j) in the GHASH table.
+#define GCM_TABLE_POWERS_SIZE 64
+
+//! The index in the GHASH table of the encrypted first counter block, that masks the tag.
+#define GCM_TABLE_TAG_MASK 80
+
+/**
+ * Represents one of the AES implementations (engines) that can be run by the device.
+ * It can be one between \ref AES_ENGINE_GLOBAL, \ref AES_ENGINE_PRIVATE, \ref AES_ENGINE_TTABLE, \ref AES_ENGINE_BITSLICE,
+ * \ref AES_ENGINE_AUTO or \ref AES_ENGINE_NONE.
+ */
+typedef unsigned aes_engine;
+
+//! Works byte by byte directly on the global memory buffer.
+#define AES_ENGINE_GLOBAL 0
+
+//! Loads each block once in private memory and works on it there.
+#define AES_ENGINE_PRIVATE 1
+
+//! Does whole rounds with lookups in T-tables kept in local memory.
+#define AES_ENGINE_TTABLE 2
+
+//! Processes many blocks together as bit planes, with no table lookups (constant-time).
+#define AES_ENGINE_BITSLICE 3
+
+/**
+ * The fastest engine of the device profile written by the tuner, among the ones that support the
+ * chaining and the layout; \ref AES_ENGINE_PRIVATE if the device hasn't been tuned. It's also the
+ * number of the real engines.
+ */
+#define AES_ENGINE_AUTO 4
+
+//! Represents an invalid AES engine.
+#define AES_ENGINE_NONE 5
+
+//! The default engine, to be used in case the user doesn't specify otherwise.
+#define DEFAULT_ENGINE AES_ENGINE_AUTO
+
+/**
+ * Represents how the blocks are distributed among the work items.
+ * It can be one between \ref AES_DISTRIBUTION_CONTIGUOUS, \ref AES_DISTRIBUTION_STRIDED or \ref AES_DISTRIBUTION_NONE.
+ */
+typedef unsigned aes_distribution;
+
+//! Each work item processes a contiguous range of blocks.
+#define AES_DISTRIBUTION_CONTIGUOUS 0
+
+//! The work item i processes the blocks i, i + global_size, i + 2 * global_size and so on.
+#define AES_DISTRIBUTION_STRIDED 1
+
+//! Represents an invalid distribution.
+#define AES_DISTRIBUTION_NONE 2
+
+//! The default distribution, to be used in case the user doesn't specify otherwise.
+#define DEFAULT_DISTRIBUTION AES_DISTRIBUTION_CONTIGUOUS
+
+/**
+ * Represents how the blocks are stored in the device buffer.
+ * It can be one between \ref AES_LAYOUT_LINEAR, \ref AES_LAYOUT_INTERLEAVED or \ref AES_LAYOUT_NONE.
+ */
+typedef unsigned aes_layout;
+
+//! The blocks are stored one after the other, as in the file.
+#define AES_LAYOUT_LINEAR 0
+
+//! The i-th 32 bits words of all the blocks are stored together, for each i between 0 and 3.
+#define AES_LAYOUT_INTERLEAVED 1
+
+//! Represents an invalid layout.
+#define AES_LAYOUT_NONE 2
+
+//! The default layout, to be used in case the user doesn't specify otherwise.
+#define DEFAULT_LAYOUT AES_LAYOUT_LINEAR
+
 //! To be used with \ref shift_rows when encrypting
 #define AES_SHIFT_LEFT 1
 
@@ -183,12 +309,67 @@ typedef unsigned aes_mode;
 
 
 
+/**************************** STREAMING ****************************/
+
+//! How many chunks are in flight at the same time in the streaming mode, if the user doesn't specify otherwise.
+#define STREAM_DEFAULT_DEPTH 3
+
+/**
+ * With \ref OPENCL_DEVICE_ALL the data are split in chunks that the devices
+ * take one at a time, as soon as they're done with the previous one; there are
+ * this many chunks for each device, so that the faster devices get more of them.
+ */
+#define MULTI_DEVICE_CHUNKS_PER_DEVICE 16
+
+//! The smallest chunk taken by a device with \ref OPENCL_DEVICE_ALL, so that the launches aren't too small to be worth it.
+#define MULTI_DEVICE_MIN_CHUNK_SIZE (1024 * 1024)
+
+
+
+
+/**************************** BATCH ****************************/
+
+/**
+ * The batch mode packs many files into one buffer, each one starting at a whole block, and
+ * processes them with a single launch of kernel_aes_batch; the segment table tells the kernel
+ * where each file (segment) is. A segment takes BATCH_SEGMENT_WORDS ulongs of the table, the
+ * ones at the BATCH_SEGMENT_* indexes.
+ */
+#define BATCH_SEGMENT_WORDS 6
+
+//! The index of the first unit of the segment, among the units of the batch: a unit is a block, or an XTS sector.
+#define BATCH_SEGMENT_FIRST_UNIT 0
+
+//! The index of the offset of the segment in the buffer, in bytes; it's a multiple of AES_BLOCK_SIZE.
+#define BATCH_SEGMENT_OFFSET 1
+
+//! The index of the length of the segment, in bytes.
+#define BATCH_SEGMENT_LENGTH 2
+
+//! The index of the most significant 64 bits of the CTR initialization vector of the segment.
+#define BATCH_SEGMENT_IV_HIGH 3
+
+//! The index of the least significant 64 bits of the CTR initialization vector, or of the number of the first XTS sector.
+#define BATCH_SEGMENT_IV_LOW 4
+
+//! The index of the key of the segment, among the keys of the key table.
+#define BATCH_SEGMENT_KEY 5
+
+//! The most data processed by a single launch in the batch mode; the files beyond it go to the next launch.
+#define BATCH_MAX_SIZE (256 * 1024 * 1024)
+
+//! How many threads read and write the files in the batch mode.
+#define BATCH_IO_THREADS 8
+
+
+
+
 /**************************** OPENCL ****************************/
 
 /**
  * Represents one of the device types that can be used by OpenCL.
- * It should be one between \ref OPENCL_DEVICE_CPU, \ref OPENCL_DEVICE_GPU or
- * \ref OPENCL_DEVICE_NONE
+ * It should be one between \ref OPENCL_DEVICE_CPU, \ref OPENCL_DEVICE_GPU,
+ * \ref OPENCL_DEVICE_ALL, \ref OPENCL_DEVICE_NATIVE, \ref OPENCL_DEVICE_AUTO or \ref OPENCL_DEVICE_NONE
  */
 typedef unsigned opencl_device;
 
@@ -204,21 +385,89 @@ typedef unsigned opencl_device;
 //! Represents a GPU device.
 #define OPENCL_DEVICE_GPU 1
 
+//! Represents every device of every OpenCL platform, sharing the work (see \ref MULTI_DEVICE_CHUNKS_PER_DEVICE).
+#define OPENCL_DEVICE_ALL 2
+
+/**
+ * Represents the host processor itself, without OpenCL: the native engine runs AES with its
+ * instructions, if it has them, and a thread per core (see \ref NATIVE_MIN_THREAD_SIZE).
+ */
+#define OPENCL_DEVICE_NATIVE 3
+
+/**
+ * Represents the native engine for the inputs smaller than the crossover of the device profile,
+ * or the one measured on the first use of an untuned device (see \ref DISPATCH_DEFAULT_CROSSOVER),
+ * and the first GPU, or the first CPU if there are no GPUs, for the bigger ones.
+ */
+#define OPENCL_DEVICE_AUTO 4
+
 //! Represents an invalid device.
-#define OPENCL_DEVICE_NONE 2
+#define OPENCL_DEVICE_NONE 5
 
 //! The default device, to be used in case the user doesn't specify otherwise.
-#define DEFAULT_DEVICE OPENCL_DEVICE_CPU
+#define DEFAULT_DEVICE OPENCL_DEVICE_AUTO
 
-/** 
- * The file containing the OpenCL source code that will be compiled with
- * clBuildProgram.
- *
- * \note the file name is different from the original OpenCL source, which is
- * paes.cl, because <em>it needs to be preprocessed</em> before being compiled;
- * clBuildProgram doesn't do any preprocessing so it's done explicitly in the
- * Makefile, and this is the name of the preprocessing result file.
+/**
+ * Below this size \ref OPENCL_DEVICE_AUTO runs the native engine, if the crossover can't be measured:
+ * without the cache, where it couldn't be kept for the next runs, or if the device fails. Otherwise
+ * the tuner, or the first run on an untuned device, measures the real crossover, where the native
+ * engine becomes slower than setting up the device, copying the data and running the kernel.
+ */
+#define DISPATCH_DEFAULT_CROSSOVER (1024 * 1024)
+
+/**
+ * The environment variable with the directory where the compiled OpenCL
+ * programs are cached; if it's set to the empty string the cache is disabled.
+ */
+#define PROGRAM_CACHE_VARIABLE "PAES_CACHE_DIR"
+
+//! The directory of the compiled programs cache, relative to the home directory, used if PROGRAM_CACHE_VARIABLE isn't set.
+#define PROGRAM_CACHE_HOME_DIRECTORY ".cache/paes"
+
+
+
+
+/**************************** NATIVE ENGINE ****************************/
+
+//! The smallest share of the data taken by a thread of the native engine, so that small files don't pay for many threads.
+#define NATIVE_MIN_THREAD_SIZE (256 * 1024)
+
+//! The most threads run by the native engine.
+#define NATIVE_MAX_THREADS 256
+
+//! How many blocks the native engine processes together, e.g. the counter blocks of CTR.
+#define NATIVE_BATCH_BLOCKS 64
+
+/**
+ * The environment variable that chooses the implementation of the native engine, among the ones
+ * the processor supports: "table", "aes-ni" or "vaes"; by default, or with a warning if the processor
+ * doesn't support the chosen one, it's the fastest one.
  */
-#define OPENCL_SOURCE "preprocessed_paes.cl"
+#define NATIVE_IMPLEMENTATION_VARIABLE "PAES_NATIVE"
+
+
+
+/**************************** TUNING ****************************/
+
+//! How much data the tuner encrypts with each configuration, if the user doesn't specify otherwise.
+#define TUNE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+//! How many times the tuner runs each configuration; the fastest run counts.
+#define TUNE_RUNS 2
+
+//! The biggest local work size tried by the tuner.
+#define TUNE_MAX_LOCAL_SIZE 256
+
+//! The biggest number of work groups per compute unit tried by the tuner; it goes up by powers of 4.
+#define TUNE_MAX_GROUPS_PER_UNIT 64
+
+//! How many times bigger each size measured for the crossover of \ref OPENCL_DEVICE_AUTO is than the one before.
+#define TUNE_CROSSOVER_STEP 16
+
+//! The most sizes measured for the crossover of \ref OPENCL_DEVICE_AUTO, from a block up.
+#define TUNE_CROSSOVER_SIZES 8
+
+//! The maximum length of the kernel variant macros stored in a profile, see \ref TUNE_DEFAULT_SIZE.
+#define TUNE_DEFINES_SIZE 64
 
 #endif
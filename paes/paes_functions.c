@@ -16,23 +16,97 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+// posix_memalign() and the memory mapped files aren't part of C99
+#define _POSIX_C_SOURCE 200112L
+// madvise(), for the huge pages hint
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "paes_functions.h"
+#include "paes_native.h"
 #include "paes_size.h"
+#include "paes_kernel_source.h"
+#include "sha256.h"
 
 #define MALLOC_CHECK_ 1
 
 /**************************** MISCELLANEOUS FUNCTIONS ****************************/
 
+/**
+ * Asks the kernel to back the buffer with huge pages, where they're supported; a big buffer
+ * then needs far less TLB entries. It's just a hint, so a failure doesn't matter.
+ */
+static void advise_huge_pages(void *buffer, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	madvise(buffer, size, MADV_HUGEPAGE);
+#else
+	(void) buffer;
+	(void) size;
+#endif
+}
+
+bool read_fully(int fd, cl_uchar * buffer, size_t size)
+{
+	while (size > 0) {
+		ssize_t bytes = read(fd, buffer, size);
+		if (bytes <= 0)
+			return false;
+		buffer += bytes;
+		size -= (size_t) bytes;
+	}
+	return true;
+}
+
+bool write_fully(int fd, const cl_uchar * buffer, size_t size)
+{
+	while (size > 0) {
+		ssize_t bytes = write(fd, buffer, size);
+		if (bytes <= 0)
+			return false;
+		buffer += bytes;
+		size -= (size_t) bytes;
+	}
+	return true;
+}
+
+//! Returns the size of the memory pages, or 4096 if it's unknown.
+static size_t get_page_size(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	return page_size > 0 ? (size_t) page_size : 4096;
+}
+
+cl_uchar *allocate_buffer(size_t size)
+{
+	void *buffer = NULL;
+	if (posix_memalign(&buffer, get_page_size(), size > 0 ? size : 1) != 0) {
+		fprintf(stderr, "ERROR: unable to allocate %lu bytes.\n", (long unsigned) size);
+		exit(EXIT_FAILURE);
+	}
+	advise_huge_pages(buffer, size);
+	return (cl_uchar *) buffer;
+}
+
 size_t read_file(char *file_name, cl_uchar ** buffer)
+{
+	return read_file_after_header(file_name, NULL, 0, buffer);
+}
+
+size_t read_file_after_header(char *file_name, cl_uchar * header, size_t header_size, cl_uchar ** buffer)
 {
 	int fd = open(file_name, O_RDONLY);
 	if (fd == -1) {
@@ -43,9 +117,15 @@ size_t read_file(char *file_name, cl_uchar ** buffer)
 	struct stat status_buf;
 	fstat(fd, &status_buf);
 	size_t size = (size_t) status_buf.st_size;
+	if (size < header_size) {
+		fprintf(stderr, "ERROR: the input file '%s' is too short to contain the initialization vector.\n", file_name);
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	size -= header_size;
 
-	*buffer = (cl_uchar *) calloc(size, sizeof(cl_uchar));
-	if (read(fd, *buffer, size) == -1) {
+	*buffer = allocate_buffer(size);
+	if (!read_fully(fd, header, header_size) || !read_fully(fd, *buffer, size)) {
 		fprintf(stderr, "ERROR: unable to read from input file '%s'.\n", file_name);
 		close(fd);
 		exit(EXIT_FAILURE);
@@ -56,7 +136,7 @@ size_t read_file(char *file_name, cl_uchar ** buffer)
 	return size;
 }
 
-void write_file(char *file_name, cl_uchar * buffer, size_t size)
+void write_file(char *file_name, cl_uchar * header, size_t header_size, cl_uchar * buffer, size_t size, cl_uchar * trailer, size_t trailer_size)
 {
 	int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, FILE_WRITE_MASK);
 	if (fd == -1) {
@@ -64,13 +144,87 @@ void write_file(char *file_name, cl_uchar * buffer, size_t size)
 		exit(EXIT_FAILURE);
 	}
 
-	if (write(fd, buffer, size) == -1) {
+	if (!write_fully(fd, header, header_size) || !write_fully(fd, buffer, size) || !write_fully(fd, trailer, trailer_size)) {
+		fprintf(stderr, "ERROR: unable to write to output file '%s'.\n", file_name);
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+cl_uchar *map_input_file(char *file_name, size_t * size)
+{
+	int fd = open(file_name, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "ERROR: unable to open input file '%s'.\n", file_name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat status_buf;
+	fstat(fd, &status_buf);
+	*size = (size_t) status_buf.st_size;
+
+	// An empty file can't be mapped
+	void *buffer = NULL;
+	if (*size > 0) {
+		buffer = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buffer == MAP_FAILED) {
+			fprintf(stderr, "ERROR: unable to map input file '%s'.\n", file_name);
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		posix_madvise(buffer, *size, POSIX_MADV_SEQUENTIAL);
+		advise_huge_pages(buffer, *size);
+	}
+
+	close(fd);
+
+	return (cl_uchar *) buffer;
+}
+
+cl_uchar *map_output_file(char *file_name, size_t size)
+{
+	int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, FILE_WRITE_MASK);
+	if (fd == -1) {
+		fprintf(stderr, "ERROR: unable to open output file '%s'.\n", file_name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ftruncate(fd, (off_t) size) == -1) {
 		fprintf(stderr, "ERROR: unable to write to output file '%s'.\n", file_name);
 		close(fd);
 		exit(EXIT_FAILURE);
 	}
 
+	void *buffer = NULL;
+	if (size > 0) {
+		buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (buffer == MAP_FAILED) {
+			fprintf(stderr, "ERROR: unable to map output file '%s'.\n", file_name);
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		posix_madvise(buffer, size, POSIX_MADV_SEQUENTIAL);
+		advise_huge_pages(buffer, size);
+	}
+
 	close(fd);
+
+	return (cl_uchar *) buffer;
+}
+
+int unmap_file(char *file_name, cl_uchar * buffer, size_t mapped_size, size_t size)
+{
+	if (buffer != NULL)
+		munmap(buffer, mapped_size);
+
+	if (size < mapped_size && truncate(file_name, (off_t) size) == -1) {
+		fprintf(stderr, "ERROR: unable to write to output file '%s'.\n", file_name);
+		return -1;
+	}
+
+	return 0;
 }
 
 /**************************** AES HOST FUNCTIONS ****************************/
@@ -81,6 +235,30 @@ char *get_aes_mode_name(aes_mode mode)
 	return aes_mode_name[mode];
 }
 
+char *get_aes_chaining_name(aes_chaining chaining)
+{
+	static char *aes_chaining_name[] = { "ecb", "ctr", "xts", "gcm", "cbc", "unspecified" };
+	return aes_chaining_name[chaining];
+}
+
+char *get_aes_engine_name(aes_engine engine)
+{
+	static char *aes_engine_name[] = { "global", "private", "ttable", "bitslice", "auto", "unspecified" };
+	return aes_engine_name[engine];
+}
+
+char *get_aes_distribution_name(aes_distribution distribution)
+{
+	static char *aes_distribution_name[] = { "contiguous", "strided", "unspecified" };
+	return aes_distribution_name[distribution];
+}
+
+char *get_aes_layout_name(aes_layout layout)
+{
+	static char *aes_layout_name[] = { "linear", "interleaved", "unspecified" };
+	return aes_layout_name[layout];
+}
+
 static inline cl_uint get_rounds_number(unsigned key_size_bits)
 {
 	cl_uint nk = key_size_bits / 32;
@@ -94,8 +272,52 @@ static inline cl_uint get_round_key_size(unsigned key_size_bits)
 	return AES_STATE_SIDE * AES_STATE_SIDE * (nr + 1);
 }
 
-// This function produces nb(nr+1) round keys. The round keys are used in each round to encrypt the states.
-static unsigned char *key_expansion(unsigned char *key, unsigned key_size_bits)
+//! Multiplies two bytes in the AES field.
+static unsigned char multiply(unsigned char a, unsigned char b)
+{
+	unsigned char product = 0;
+	while (b) {
+		if (b & 1)
+			product ^= a;
+		a = (a << 1) ^ ((a >> 7) * 0x1b);
+		b >>= 1;
+	}
+	return product;
+}
+
+//! InvMixColumns on a round key; as the state, the round key is stored by rows.
+static void inv_mix_columns_key(unsigned char *key)
+{
+	unsigned char a[AES_STATE_SIDE];
+	for (unsigned c = 0; c < AES_STATE_SIDE; ++c) {
+		for (unsigned r = 0; r < AES_STATE_SIDE; ++r)
+			a[r] = key[r * AES_STATE_SIDE + c];
+		for (unsigned r = 0; r < AES_STATE_SIDE; ++r)
+			key[r * AES_STATE_SIDE + c] = multiply(a[r], 0x0e) ^ multiply(a[(r + 1) % 4], 0x0b) ^ multiply(a[(r + 2) % 4], 0x0d) ^ multiply(a[(r + 3) % 4], 0x09);
+	}
+}
+
+//! Transposes a block between the column-major order of FIPS-197 and the row-major one of the state.
+static void transpose_block(unsigned char *block)
+{
+	for (unsigned r = 1; r < AES_STATE_SIDE; ++r)
+		for (unsigned c = 0; c < r; ++c) {
+			unsigned char byte = block[r * AES_STATE_SIDE + c];
+			block[r * AES_STATE_SIDE + c] = block[c * AES_STATE_SIDE + r];
+			block[c * AES_STATE_SIDE + r] = byte;
+		}
+}
+
+bool is_standard_chaining(aes_chaining chaining)
+{
+	return chaining == AES_CHAINING_CTR || chaining == AES_CHAINING_XTS || chaining == AES_CHAINING_GCM || chaining == AES_CHAINING_CBC;
+}
+
+/* This function produces nb(nr+1) round keys. The round keys are used in each round to encrypt the states.
+   They are followed by nb(nr+1) decryption round keys for the equivalent inverse cipher: the round keys in
+   reverse order, with the middle ones through InvMixColumns, so that decryption has the same structure as
+   encryption. The chainings that run standard AES get the round keys transposed, as their blocks. */
+static unsigned char *key_expansion(unsigned char *key, unsigned key_size_bits, aes_chaining chaining)
 {
 	size_t i, j;
 	unsigned char temp[4], k;
@@ -106,7 +328,7 @@ static unsigned char *key_expansion(unsigned char *key, unsigned key_size_bits)
 	unsigned nk = key_size_bits / 32;
 
 	unsigned round_key_size = get_round_key_size(key_size_bits);
-	unsigned char *round_key = (unsigned char *) malloc(round_key_size * sizeof(unsigned char));
+	unsigned char *round_key = (unsigned char *) malloc(2 * round_key_size * sizeof(unsigned char));
 
 	// The first round key is the key itself.
 	for (i = 0; i < nk; i++) {
@@ -151,6 +373,18 @@ static unsigned char *key_expansion(unsigned char *key, unsigned key_size_bits)
 		i++;
 	}
 
+	unsigned nr = get_rounds_number(key_size_bits);
+	if (is_standard_chaining(chaining))
+		for (i = 0; i <= nr; ++i)
+			transpose_block(round_key + i * AES_BLOCK_SIZE);
+
+	unsigned char *decryption_key = round_key + round_key_size;
+	for (i = 0; i <= nr; ++i) {
+		memcpy(decryption_key + i * AES_BLOCK_SIZE, round_key + (nr - i) * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		if (i > 0 && i < nr)
+			inv_mix_columns_key(decryption_key + i * AES_BLOCK_SIZE);
+	}
+
 	return round_key;
 }
 
@@ -158,193 +392,1415 @@ static unsigned char *key_expansion(unsigned char *key, unsigned key_size_bits)
 
 char *get_opencl_device_name(opencl_device device)
 {
-	static char *opencl_device_name[] = { "cpu", "gpu", "unspecified" };
+	static char *opencl_device_name[] = { "cpu", "gpu", "all", "native", "auto", "unspecified" };
 	return opencl_device_name[device];
 }
 
-static void print_device_informations(cl_device_id device)
+bool is_valid_macro(const char *macro)
+{
+	return strspn(macro, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_=.") == strlen(macro) && (isalpha((unsigned char) macro[0]) || macro[0] == '_');
+}
+
+/**
+ * Tells whether the macros of a profile entry are "-D MACRO" ones, separated by spaces, each of them
+ * fine for \ref is_valid_macro, so that a tampered profile can't smuggle other build options.
+ */
+static bool are_valid_defines(const char *defines)
+{
+	char macro[TUNE_DEFINES_SIZE];
+	if (strlen(defines) >= sizeof(macro))
+		return false;
+	while (*defines != '\0') {
+		if (strncmp(defines, "-D ", 3) != 0)
+			return false;
+		defines += 3;
+		size_t length = strcspn(defines, " ");
+		memcpy(macro, defines, length);
+		macro[length] = '\0';
+		if (!is_valid_macro(macro))
+			return false;
+		defines += length;
+		if (*defines == ' ')
+			++defines;
+	}
+	return true;
+}
+
+static void print_device_informations(cl_device_id device, const char *prefix)
 {
 	char device_string[1024];
 	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_string), &device_string, NULL);
-	printf("\nDevice: %s\n\n", device_string);
+	printf("\n%sDevice: %s\n\n", prefix, device_string);
+}
+
+/**
+ * Finds the INTERLEAVE macro among the kernel macros, given by the user or tuned, as "-D INTERLEAVE=N"
+ * or "-DINTERLEAVE=N".
+ * \return N, or 0 if the macro isn't there
+ */
+static cl_uint find_interleave_macro(const char *defines)
+{
+	for (const char *macro = strstr(defines, "INTERLEAVE="); macro != NULL; macro = strstr(macro + 1, "INTERLEAVE=")) {
+		size_t start = macro - defines;
+		// Not the end of another name, e.g. MY_INTERLEAVE
+		if ((start >= 2 && strncmp(macro - 2, "-D", 2) == 0) || (start >= 3 && strncmp(macro - 3, "-D ", 3) == 0))
+			return (cl_uint) strtoul(macro + strlen("INTERLEAVE="), NULL, 10);
+	}
+	return 0;
+}
+
+/**
+ * Chooses how many blocks the T-table kernels process together on the device,
+ * unless the kernel macros already do (see \ref find_interleave_macro).
+ * GPUs already hide the latency of the lookups by running many work items,
+ * so more blocks per work item would mostly raise the register pressure;
+ * CPUs run few work items at a time, and their preferred vector width tells
+ * how many blocks fill their SIMD units.
+ */
+static cl_uint get_interleave_factor(cl_device_id device, const char *defines)
+{
+	cl_device_type type;
+	cl_uint width = 1;
+	if (find_interleave_macro(defines) != 0)
+		return find_interleave_macro(defines);
+	clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, sizeof(width), &width, NULL);
+	if (type & CL_DEVICE_TYPE_GPU)
+		return 2;
+	if (width >= 8)
+		return 8;
+	if (width >= 4)
+		return 4;
+	return 2;
+}
+
+//! Returns the name of the kernel that implements the specified AES engine, mode and chaining.
+static const char *get_kernel_name(aes_engine engine, aes_mode mode, aes_chaining chaining)
+{
+	static const char *kernel_name[][2] = {
+		{"kernel_aes_fused", "kernel_aes_fused"},
+		{"kernel_aes_private", "kernel_aes_private"},
+		{"kernel_aes_encrypt", "kernel_aes_decrypt"},
+		{"kernel_aes_bitslice", "kernel_aes_bitslice"}
+	};
+	if (chaining == AES_CHAINING_CTR)
+		return "kernel_aes_ctr";
+	if (chaining == AES_CHAINING_XTS)
+		return "kernel_aes_xts";
+	if (chaining == AES_CHAINING_GCM)
+		return "kernel_aes_gcm";
+	if (chaining == AES_CHAINING_CBC)
+		return mode == AES_MODE_ENCRYPT ? "kernel_aes_cbc_encrypt" : "kernel_aes_cbc_decrypt";
+	return kernel_name[engine][mode];
+}
+
+//! Tells whether the kernel of the specified AES engine takes the AES mode as argument.
+static bool kernel_has_mode(aes_engine engine)
+{
+	return engine != AES_ENGINE_TTABLE;
+}
+
+/**
+ * Converts the blocks from the linear layout to the interleaved one (see \ref AES_LAYOUT_INTERLEAVED).
+ * \param linear the blocks stored one after the other
+ * \param interleaved where the interleaved blocks will be stored
+ * \param blocks the number of blocks
+ */
+static void interleave_blocks(const cl_uchar * linear, cl_uchar * interleaved, cl_ulong blocks)
+{
+	for (cl_ulong b = 0; b < blocks; ++b)
+		for (unsigned w = 0; w < AES_STATE_SIDE; ++w)
+			memcpy(interleaved + (w * blocks + b) * AES_STATE_SIDE, linear + b * AES_BLOCK_SIZE + w * AES_STATE_SIDE, AES_STATE_SIDE);
+}
+
+//! The inverse of \ref interleave_blocks.
+static void deinterleave_blocks(const cl_uchar * interleaved, cl_uchar * linear, cl_ulong blocks)
+{
+	for (cl_ulong b = 0; b < blocks; ++b)
+		for (unsigned w = 0; w < AES_STATE_SIDE; ++w)
+			memcpy(linear + b * AES_BLOCK_SIZE + w * AES_STATE_SIDE, interleaved + (w * blocks + b) * AES_STATE_SIDE, AES_STATE_SIDE);
+}
+
+/**
+ * Splits the AES_IV_SIZE bytes initialization vector in two halves, as 64 bits big endian integers.
+ * \param iv the initialization vector
+ * \param iv_high where the most significant half will be stored
+ * \param iv_low where the least significant half will be stored
+ */
+static void split_iv(const cl_uchar * iv, cl_ulong * iv_high, cl_ulong * iv_low)
+{
+	*iv_high = *iv_low = 0;
+	for (unsigned i = 0; i < AES_IV_SIZE / 2; ++i) {
+		*iv_high = (*iv_high << 8) | iv[i];
+		*iv_low = (*iv_low << 8) | iv[AES_IV_SIZE / 2 + i];
+	}
+}
+
+void gf128_multiply(cl_ulong * x, const cl_ulong * y)
+{
+	cl_ulong z[2] = { 0, 0 }, v[2] = { y[0], y[1] };
+	for (unsigned i = 0; i < 128; ++i) {
+		if (((i < 64 ? x[0] >> (63 - i) : x[1] >> (127 - i)) & 1) != 0) {
+			z[0] ^= v[0];
+			z[1] ^= v[1];
+		}
+		cl_ulong carry = v[1] & 1;
+		v[1] = (v[1] >> 1) | (v[0] << 63);
+		v[0] = (v[0] >> 1) ^ (carry ? 0xe100000000000000ULL : 0);
+	}
+	x[0] = z[0];
+	x[1] = z[1];
+}
+
+void gcm_tag(const cl_ulong * ghash_partial, size_t groups, const cl_ulong * ghash_table, size_t size, cl_uchar * tag)
+{
+	// There's no additional authenticated data, so its length is 0
+	cl_ulong hash[2] = { 0, (cl_ulong) size * 8 };
+	for (size_t g = 0; g < groups; ++g) {
+		hash[0] ^= ghash_partial[2 * g];
+		hash[1] ^= ghash_partial[2 * g + 1];
+	}
+	gf128_multiply(hash, ghash_table + 2 * GCM_TABLE_H);
+	hash[0] ^= ghash_table[2 * GCM_TABLE_TAG_MASK];
+	hash[1] ^= ghash_table[2 * GCM_TABLE_TAG_MASK + 1];
+
+	for (unsigned i = 0; i < 8; ++i) {
+		tag[i] = (cl_uchar) (hash[0] >> (56 - 8 * i));
+		tag[8 + i] = (cl_uchar) (hash[1] >> (56 - 8 * i));
+	}
 }
 
 static double execution_time_msecs(cl_event event)
 {
 	cl_ulong start, end;
+	if (event == NULL)
+		return 0;
 	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
 	clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
 	return (end - start) * 1.0E-6;
 }
 
-int apply_aes(cl_uchar * buffer, size_t size, opencl_device device, aes_mode mode, cl_uchar * key, unsigned key_size_bits)
+/**
+ * Creates the specified directory together with its missing parents; the
+ * errors are ignored, since they show up anyway when the files are written.
+ */
+static void create_directories(char *path)
 {
-	/* All these variables are defined here, getting NULL if they're pointers,
-	   to avoid error in case of a premature jump to the cleanup label. */
-	unsigned char *source = NULL;
-	cl_uint num_platforms;
-	cl_platform_id *platforms = NULL;
+	for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(path, S_IRWXU);
+		*slash = '/';
+	}
+	mkdir(path, S_IRWXU);
+}
+
+/**
+ * Finds the cache file of a program, or the profile of a device. Its name is the SHA256 of the
+ * device name, the driver version, the build options and the embedded source code, so that a
+ * change of any of them leads to a different file.
+ * \param device the device the program is built for; NULL for the crossover of \ref OPENCL_DEVICE_AUTO,
+ *        that is read before OpenCL starts, so only the source code is hashed
+ * \param options the build options; NULL for the profile, that doesn't depend on them
+ * \param extension the file extension, e.g. ".bin"
+ * \param file_name where the cache file name will be written
+ * \param file_name_size the size of file_name
+ * \return false if the cache is disabled, true otherwise
+ */
+static bool get_cache_file(cl_device_id device, const char *options, const char *extension, char *file_name, size_t file_name_size)
+{
+	char directory[1024], device_name[1024] = "", driver_version[1024] = "";
+	const char *variable = getenv(PROGRAM_CACHE_VARIABLE), *home = getenv("HOME");
+	int length;
+	if (variable != NULL)
+		length = snprintf(directory, sizeof(directory), "%s", variable);
+	else if (home != NULL)
+		length = snprintf(directory, sizeof(directory), "%s/%s", home, PROGRAM_CACHE_HOME_DIRECTORY);
+	else
+		return false;
+	if (length <= 0 || (size_t) length >= sizeof(directory))
+		return false;
+	create_directories(directory);
+
+	// The strings are hashed with their terminators, so that they can't run into each other
+	SHA256_CONTEXT context;
+	if (device != NULL) {
+		clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+		clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver_version) - 1, driver_version, NULL);
+	}
+	sha256_init(&context);
+	sha256_write(&context, (unsigned char *) device_name, strlen(device_name) + 1);
+	sha256_write(&context, (unsigned char *) driver_version, strlen(driver_version) + 1);
+	if (options != NULL)
+		sha256_write(&context, (unsigned char *) options, strlen(options) + 1);
+	for (unsigned i = 0; i < paes_kernel_source_lines; ++i)
+		sha256_write(&context, (unsigned char *) paes_kernel_source[i], strlen(paes_kernel_source[i]));
+	sha256_final(&context);
+	unsigned char *hash = sha256_read(&context);
+
+	length = snprintf(file_name, file_name_size, "%s/", directory);
+	for (unsigned i = 0; i < 32 && length > 0 && (size_t) length < file_name_size; ++i)
+		length += snprintf(file_name + length, file_name_size - length, "%02x", hash[i]);
+	if (length > 0 && (size_t) length < file_name_size)
+		length += snprintf(file_name + length, file_name_size - length, "%s", extension);
+	return length > 0 && (size_t) length < file_name_size;
+}
+
+/**
+ * Loads a program from its cache file and builds it.
+ * \return the built program, or NULL if the file doesn't exist or the driver rejects it
+ */
+static cl_program load_cached_program(cl_context context, cl_device_id device, const char *options, const char *file_name)
+{
+	int fd = open(file_name, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat status_buf;
+	fstat(fd, &status_buf);
+	size_t size = (size_t) status_buf.st_size;
+	unsigned char *binary = (unsigned char *) malloc(size + 1);
+	ssize_t bytes = read(fd, binary, size);
+	close(fd);
+
+	cl_program program = NULL;
+	cl_int status, error = CL_INVALID_BINARY;
+	if (size > 0 && bytes == (ssize_t) size)
+		program = clCreateProgramWithBinary(context, 1, &device, &size, (const unsigned char **) &binary, &status, &error);
+	free(binary);
+	if (error != CL_SUCCESS)
+		return NULL;
+
+	if (clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+		clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+/**
+ * Writes the binary of a built program into its cache file. The binary is
+ * written into a temporary file first and then renamed, so that concurrent
+ * runs never see a partial file.
+ */
+static void store_cached_program(cl_program program, cl_device_id device, const char *file_name)
+{
+	cl_uint num_devices = 0;
+	if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(num_devices), &num_devices, NULL) != CL_SUCCESS || num_devices == 0)
+		return;
+
+	// The program may belong to more devices than the one it has been built for
+	cl_device_id *devices = (cl_device_id *) malloc(sizeof(cl_device_id) * num_devices);
+	size_t *sizes = (size_t *) calloc(num_devices, sizeof(size_t));
+	unsigned char **binaries = (unsigned char **) calloc(num_devices, sizeof(unsigned char *));
+	cl_int error = clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * num_devices, devices, NULL);
+	error |= clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * num_devices, sizes, NULL);
+	for (cl_uint i = 0; i < num_devices; ++i)
+		binaries[i] = (unsigned char *) malloc(sizes[i] + 1);
+	if (error == CL_SUCCESS)
+		error = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *) * num_devices, binaries, NULL);
+
+	for (cl_uint i = 0; error == CL_SUCCESS && i < num_devices; ++i) {
+		if (devices[i] != device || sizes[i] == 0)
+			continue;
+		/* The temporary file has a unique name, because other threads or
+		   processes may be storing the same program at the same time. */
+		char temporary_name[1100];
+		snprintf(temporary_name, sizeof(temporary_name), "%s.XXXXXX", file_name);
+		int fd = mkstemp(temporary_name);
+		if (fd == -1)
+			break;
+		bool written = write(fd, binaries[i], sizes[i]) == (ssize_t) sizes[i];
+		close(fd);
+		if (!written || rename(temporary_name, file_name) != 0)
+			unlink(temporary_name);
+		break;
+	}
+
+	for (cl_uint i = 0; i < num_devices; ++i)
+		free(binaries[i]);
+	free(binaries);
+	free(sizes);
+	free(devices);
+}
+
+//! The names of every kernel that an engine can run, see \ref get_kernel.
+static const char *kernel_names[] = {
+	"kernel_aes_fused", "kernel_aes_private", "kernel_aes_encrypt", "kernel_aes_decrypt", "kernel_aes_bitslice",
+	"kernel_aes_ctr", "kernel_aes_xts", "kernel_gcm_setup", "kernel_aes_gcm", "kernel_aes_cbc_encrypt", "kernel_aes_cbc_decrypt",
+	"kernel_aes_batch"
+};
+
+//! The number of kernels in \ref kernel_names.
+#define PAES_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+//! The fastest configuration of an engine on a device, as found by \ref paes_tune.
+typedef struct {
+	bool tuned;		//!< false if the profile has nothing about the engine
+	size_t global_size;
+	size_t local_size;
+	double throughput;	//!< in MB/s
+	char defines[TUNE_DEFINES_SIZE];	//!< the macros of the kernel variant, e.g. "-D BITSLICE_64"
+} engine_profile;
+
+struct paes_engine {
+	unsigned key_size_bits;	//!< the key size the program has been built for
+	cl_ulong max_buffer_size;	//!< the size of the biggest buffer that the device can allocate
+	bool zero_copy;		//!< the device shares the host memory, so the host buffers are used in place
+	const char *prefix;	//!< the start of the lines printed about the engine, see \ref create_engine
+	cl_uint compute_units;
+	size_t global_size;	//!< the global work size given by \ref paes_engine_set_work_sizes, 0 if unspecified
+	size_t local_size;	//!< the local work size given by \ref paes_engine_set_work_sizes, 0 if unspecified
+	engine_profile profile[AES_ENGINE_AUTO];	//!< the tuned configurations of the device, one per engine
 	cl_context context;
-	cl_int error, error1, error2;
-	cl_device_id *devices = NULL;
+	cl_device_id *devices;
 	cl_command_queue command_queue;
-	cl_mem cl_buffer, cl_round_key;
-	cl_event event_write, event_execute, event_read;
+	cl_command_queue job_queue;	//!< the queue of the jobs of \ref paes_submit, created by the first one
 	cl_program program;
-	cl_kernel kernel;
-	static const cl_device_type device_type[] = { CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_GPU };
-	cl_ulong blocks = size / AES_BLOCK_SIZE;
-	bool ok = 1;		// By default, everything is fine.
+	cl_kernel kernels[PAES_KERNELS];	//!< created the first time they're needed, see \ref get_kernel
+	cl_mem cl_buffer;	//!< the data buffer, it grows when a bigger one is needed
+	size_t buffer_capacity;
+	cl_mem cl_input;	//!< the input buffer of the CBC decryption, it grows as cl_buffer
+	size_t input_capacity;
+	cl_mem cl_round_key;	//!< the encryption and decryption round keys
+	cl_mem cl_tweak_round_key;	//!< the round keys of the XTS tweak key
+	cl_mem cl_ghash_table;	//!< the GCM table prepared by kernel_gcm_setup
+};
 
-	printf("Loading OpenCL source code...\n");
-	size_t source_size = read_file(OPENCL_SOURCE, &source);
+/**
+ * Returns the kernel with the specified name, creating it the first time.
+ * \param paes the engine
+ * \param name one of the \ref kernel_names
+ * \param error where the OpenCL error code will be stored
+ * \return the kernel, or NULL if it couldn't be created
+ */
+static cl_kernel get_kernel(paes_engine * paes, const char *name, cl_int * error)
+{
+	*error = CL_SUCCESS;
+	for (size_t i = 0; i < PAES_KERNELS; ++i) {
+		if (strcmp(kernel_names[i], name) == 0) {
+			if (paes->kernels[i] == NULL)
+				paes->kernels[i] = clCreateKernel(paes->program, name, error);
+			return paes->kernels[i];
+		}
+	}
+	*error = CL_INVALID_KERNEL_NAME;
+	return NULL;
+}
 
-	error = clGetPlatformIDs(0, NULL, &num_platforms);
-	if (error != CL_SUCCESS) {
-		fprintf(stderr, "ERROR: clGetPlatformIDs (num_platforms), error code %d\n", error);
-		ok = 0;
-		goto cleanup;
+/**
+ * Makes sure that the device buffer can hold at least size bytes, replacing it with a bigger one if needed.
+ * \param paes the engine
+ * \param buffer the device buffer
+ * \param capacity the device buffer's size
+ * \param flags the flags of the device buffer
+ * \param size the needed size; the buffer is never smaller than a block, so that empty data are fine too
+ * \return the OpenCL error code
+ */
+static cl_int reserve_buffer(paes_engine * paes, cl_mem * buffer, size_t * capacity, cl_mem_flags flags, size_t size)
+{
+	cl_int error = CL_SUCCESS;
+	if (size < AES_BLOCK_SIZE)
+		size = AES_BLOCK_SIZE;
+	if (*buffer != NULL && *capacity >= size)
+		return CL_SUCCESS;
+	if (*buffer != NULL)
+		clReleaseMemObject(*buffer);
+	*buffer = clCreateBuffer(paes->context, flags, sizeof(cl_uchar) * size, NULL, &error);
+	*capacity = error == CL_SUCCESS ? size : 0;
+	if (error != CL_SUCCESS)
+		*buffer = NULL;
+	return error;
+}
+
+/**
+ * Finds the file name of the profile of a device for a key size: each key size has its own
+ * profile, since the number of rounds changes the speed of the engines and the crossover.
+ * \return false if there's no cache, true otherwise
+ */
+static bool get_profile_file(cl_device_id device, unsigned key_size_bits, char *file_name, size_t file_name_size)
+{
+	char extension[32];
+	snprintf(extension, sizeof(extension), ".%u.profile", key_size_bits);
+	return get_cache_file(device, NULL, extension, file_name, file_name_size);
+}
+
+/**
+ * Reads the profile written by \ref paes_tune for a device and a key size, if there's one. Each line of the
+ * profile is an engine name, the global and local work sizes, the throughput in MB/s and the
+ * macros of the kernel variant, if any; the line "crossover BYTES" is the size below which
+ * the native engine is faster than the device (see \ref OPENCL_DEVICE_AUTO).
+ * \param device the device
+ * \param key_size_bits the key size in bits
+ * \param profile where the configurations of the engines will be stored, AES_ENGINE_AUTO of them;
+ *        the engines that aren't in the profile are left as they are
+ * \param crossover where the crossover will be stored; it's left as it is if it isn't in the profile
+ * \param file_name where the profile file name will be written
+ * \param file_name_size the size of file_name
+ * \return false if there's no profile, true otherwise
+ */
+static bool read_profile(cl_device_id device, unsigned key_size_bits, engine_profile * profile, size_t * crossover, char *file_name, size_t file_name_size)
+{
+	char line[256];
+	if (!get_profile_file(device, key_size_bits, file_name, file_name_size))
+		return false;
+	FILE *file = fopen(file_name, "r");
+	if (file == NULL)
+		return false;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char name[16];
+		long unsigned global_size, local_size, bytes;
+		double throughput;
+		int defines_start;
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "crossover %lu", &bytes) == 1) {
+			*crossover = bytes;
+			continue;
+		}
+		if (line[0] == '#' || sscanf(line, "%15s %lu %lu %lf %n", name, &global_size, &local_size, &throughput, &defines_start) != 4 || local_size == 0)
+			continue;
+		for (aes_engine engine = 0; engine < AES_ENGINE_AUTO; ++engine) {
+			if (strcmp(name, get_aes_engine_name(engine)) != 0)
+				continue;
+			if (!are_valid_defines(line + defines_start)) {
+				fprintf(stderr, "ERROR: wrong macros '%s' for %s in the profile '%s', the entry is ignored.\n", line + defines_start, name, file_name);
+				continue;
+			}
+			profile[engine].tuned = true;
+			profile[engine].global_size = global_size;
+			profile[engine].local_size = local_size;
+			profile[engine].throughput = throughput;
+			snprintf(profile[engine].defines, sizeof(profile[engine].defines), "%s", line + defines_start);
+		}
 	}
+	fclose(file);
+	return true;
+}
 
-	platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * num_platforms);
-	error = clGetPlatformIDs(num_platforms, platforms, NULL);
-	if (error != CL_SUCCESS) {
-		fprintf(stderr, "ERROR: clGetPlatformIDs (platforms), error code %d\n", error);
-		ok = 0;
-		goto cleanup;
+//! Loads the profile of the engine's device, see \ref read_profile; prefix starts the line it prints.
+static void load_profile(paes_engine * paes, const char *prefix)
+{
+	char file_name[1024];
+	size_t crossover;
+	if (read_profile(paes->devices[0], paes->key_size_bits, paes->profile, &crossover, file_name, sizeof(file_name)))
+		printf("%sProfile loaded from %s\n", prefix, file_name);
+}
+
+/**
+ * Writes the profile of the device, see \ref read_profile.
+ * \return false if it couldn't be written, true otherwise
+ */
+static bool store_profile(cl_device_id device, unsigned key_size_bits, const engine_profile * profile, size_t crossover)
+{
+	char file_name[1024], device_name[1024] = "";
+	if (!get_profile_file(device, key_size_bits, file_name, sizeof(file_name))) {
+		fprintf(stderr, "ERROR: the profile needs the cache, set $%s or $HOME.\n", PROGRAM_CACHE_VARIABLE);
+		return false;
+	}
+	FILE *file = fopen(file_name, "w");
+	if (file == NULL) {
+		fprintf(stderr, "ERROR: unable to write the profile '%s'.\n", file_name);
+		return false;
+	}
+
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+	fprintf(file, "# PAES profile of %s with %u bits keys: engine, global work size, local work size, MB/s, macros\n", device_name, key_size_bits);
+	for (aes_engine engine = 0; engine < AES_ENGINE_AUTO; ++engine)
+		if (profile[engine].tuned)
+			fprintf(file, "%s %lu %lu %.3f%s%s\n", get_aes_engine_name(engine), (long unsigned) profile[engine].global_size, (long unsigned) profile[engine].local_size, profile[engine].throughput, profile[engine].defines[0] != '\0' ? " " : "", profile[engine].defines);
+	fprintf(file, "# Below the crossover, in bytes, the native engine is faster: it's measured encrypting with ECB only, at sizes growing\n");
+	fprintf(file, "# from a block, and the times in between are assumed linear, so it's an estimate for the other chainings and the decryption\n");
+	fprintf(file, "crossover %lu\n", (long unsigned) crossover);
+	fclose(file);
+	printf("Profile written to %s\n", file_name);
+	return true;
+}
+
+/**
+ * Finds the file name of the crossover of \ref OPENCL_DEVICE_AUTO for a key size: it's a copy of
+ * the crossover of the device that OPENCL_DEVICE_AUTO picks, kept apart from its profile so that
+ * the small inputs go to the native engine without starting OpenCL to find the device.
+ * \return false if there's no cache, true otherwise
+ */
+static bool get_crossover_file(unsigned key_size_bits, char *file_name, size_t file_name_size)
+{
+	char extension[32];
+	snprintf(extension, sizeof(extension), ".%u.crossover", key_size_bits);
+	return get_cache_file(NULL, NULL, extension, file_name, file_name_size);
+}
+
+/**
+ * Reads the crossover of \ref OPENCL_DEVICE_AUTO, see \ref get_crossover_file.
+ * \param crossover where the crossover in bytes will be stored
+ * \return false if it hasn't been stored yet, true otherwise
+ */
+static bool read_crossover(unsigned key_size_bits, size_t * crossover)
+{
+	char file_name[1024], line[256];
+	long unsigned bytes;
+	bool found = false;
+	if (!get_crossover_file(key_size_bits, file_name, sizeof(file_name)))
+		return false;
+	FILE *file = fopen(file_name, "r");
+	if (file == NULL)
+		return false;
+	while (!found && fgets(line, sizeof(line), file) != NULL)
+		found = sscanf(line, "crossover %lu", &bytes) == 1;
+	fclose(file);
+	if (found)
+		*crossover = bytes;
+	return found;
+}
+
+/**
+ * Writes the crossover of \ref OPENCL_DEVICE_AUTO, see \ref get_crossover_file; nothing happens without the cache.
+ * \param device the device that OPENCL_DEVICE_AUTO picks
+ */
+static void store_crossover(cl_device_id device, unsigned key_size_bits, size_t crossover)
+{
+	char file_name[1024], device_name[1024] = "";
+	if (!get_crossover_file(key_size_bits, file_name, sizeof(file_name)))
+		return;
+	FILE *file = fopen(file_name, "w");
+	if (file == NULL) {
+		fprintf(stderr, "ERROR: unable to write the crossover '%s'.\n", file_name);
+		return;
 	}
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+	fprintf(file, "# PAES crossover of %s with %u bits keys, for the device auto: remove this file when the devices change\n", device_name, key_size_bits);
+	fprintf(file, "crossover %lu\n", (long unsigned) crossover);
+	fclose(file);
+}
+
+//! Removes the crossover of \ref OPENCL_DEVICE_AUTO, so that it's taken again from the profile of its device.
+static void remove_crossover(unsigned key_size_bits)
+{
+	char file_name[1024];
+	if (get_crossover_file(key_size_bits, file_name, sizeof(file_name)))
+		unlink(file_name);
+}
 
-	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[0], 0 };
-	cl_context_properties *cprops = (NULL == platforms[0]) ? NULL : cps;
-	context = clCreateContextFromType(cprops, device_type[device], NULL, NULL, &error);
-	printf("clCreateContextFromType...\n");
+/**
+ * Creates an engine for a device of a platform; the parameters are the ones of \ref paes_engine_create.
+ * \param use_profile whether the profile of the device is loaded; without it the engine
+ *        runs as if the device had never been tuned
+ * \param prefix the start of every line printed, e.g. the device with OPENCL_DEVICE_ALL, whose
+ *        engines are created at the same time by their threads; "" otherwise
+ * \return the engine, to be released by \ref paes_engine_destroy, or NULL if something went wrong
+ */
+static paes_engine *create_engine(cl_platform_id platform, cl_device_id device, unsigned key_size_bits, const char *defines, bool use_profile, const char *prefix)
+{
+	char *build_options = NULL, *variants = NULL;
+	cl_int error, error1, error2;
+	bool ok = 1;		// By default, everything is fine.
+
+	// Every handle is NULL, so a premature jump to the cleanup label is fine
+	paes_engine *paes = (paes_engine *) calloc(1, sizeof(paes_engine));
+	paes->key_size_bits = key_size_bits;
+	paes->prefix = prefix;
+
+	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform, 0 };
+	cl_context_properties *cprops = (NULL == platform) ? NULL : cps;
+	paes->context = clCreateContext(cprops, 1, &device, NULL, NULL, &error);
+	printf("%sclCreateContext...\n", prefix);
 	if (error != CL_SUCCESS) {
-		fprintf(stderr, "ERROR: clCreateContextFromType, error code %d\n", error);
+		fprintf(stderr, "ERROR: clCreateContext, error code %d\n", error);
+		paes->context = NULL;
 		ok = 0;
 		goto cleanup;
 	}
 
 	size_t context_information_size;
-	error = clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &context_information_size);
-	devices = (cl_device_id *) malloc(context_information_size);
-	error |= clGetContextInfo(context, CL_CONTEXT_DEVICES, context_information_size, devices, NULL);
-	printf("clGetContextInfo...\n");
+	error = clGetContextInfo(paes->context, CL_CONTEXT_DEVICES, 0, NULL, &context_information_size);
+	paes->devices = (cl_device_id *) malloc(context_information_size);
+	error |= clGetContextInfo(paes->context, CL_CONTEXT_DEVICES, context_information_size, paes->devices, NULL);
+	printf("%sclGetContextInfo...\n", prefix);
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clGetContextInfo, error code %d\n", error);
 		ok = 0;
 		goto cleanup;
 	}
-	print_device_informations(devices[0]);
+	print_device_informations(paes->devices[0], prefix);
+	clGetDeviceInfo(paes->devices[0], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(paes->max_buffer_size), &paes->max_buffer_size, NULL);
+	clGetDeviceInfo(paes->devices[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(paes->compute_units), &paes->compute_units, NULL);
+	if (paes->compute_units == 0)
+		paes->compute_units = 1;
+	if (use_profile)
+		load_profile(paes, prefix);
+
+	/* The CPUs and the integrated GPUs share the host memory, so copying the
+	   data into device buffers and back would be a waste of time; the host
+	   buffers are used in place instead. Before OpenCL 1.1 there's no way to
+	   ask, but the CPUs surely share it. */
+	cl_bool unified_memory = CL_FALSE;
+#ifdef CL_DEVICE_HOST_UNIFIED_MEMORY
+	clGetDeviceInfo(paes->devices[0], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified_memory), &unified_memory, NULL);
+#else
+	cl_device_type type;
+	clGetDeviceInfo(paes->devices[0], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+	unified_memory = (type & CL_DEVICE_TYPE_CPU) != 0;
+#endif
+	paes->zero_copy = unified_memory == CL_TRUE;
+	printf("%sZero-copy buffers are %s\n", prefix, paes->zero_copy ? "enabled" : "disabled");
 
-	command_queue = clCreateCommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE, &error);
-	printf("clCreateCommandQueue...\n");
+	paes->command_queue = clCreateCommandQueue(paes->context, paes->devices[0], CL_QUEUE_PROFILING_ENABLE, &error);
+	printf("%sclCreateCommandQueue...\n", prefix);
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clCreateCommandQueue, error code %d\n", error);
+		paes->command_queue = NULL;
 		ok = 0;
 		goto cleanup;
 	}
 
-/* 	if (global_size == OPENCL_DEFAULT_GLOBAL_SIZE) {
-		size_t global_work_size[3];
-		clGetDeviceInfo(devices[0], CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t) * 3, &global_work_size, NULL);
-		global_size = global_work_size[0];
-	} */
-	size_t global_size, local_size;
-#ifdef PAES_DYNAMIC_SIZE
-	global_size = blocks;
-	if (global_size > 4194304)
-		global_size = 4194304;
-
-	local_size = global_size / 8;
-	if (local_size < 1)
-		local_size = 1;
-	else if (local_size > PAES_MAX_LOCAL_SIZE)
-		local_size = PAES_LOCAL_SIZE;
-#elif defined(PAES_STATIC_SIZE)
-	global_size = PAES_GLOBAL_SIZE;
-	local_size = PAES_LOCAL_SIZE;
-#endif
-
-	printf("Global work size is %lu\n", (long unsigned) global_size);
-	printf("Local work size is %lu\n", (long unsigned) local_size);
-
-	cl_uint round_key_size = get_round_key_size(key_size_bits);
-	cl_uchar *round_key = key_expansion(key, key_size_bits);
-	printf("Generating the round keys...\n");
-
-	cl_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * size, NULL, &error);
-	error1 = clEnqueueWriteBuffer(command_queue, cl_buffer, CL_TRUE, 0, sizeof(cl_uchar) * size, (void *) buffer, 0, NULL, &event_write);
-	cl_round_key = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(cl_uchar) * round_key_size, round_key, &error2);
+	paes->cl_round_key = clCreateBuffer(paes->context, CL_MEM_READ_ONLY, sizeof(cl_uchar) * 2 * ROUND_KEY_SIZE, NULL, &error);
+	paes->cl_tweak_round_key = clCreateBuffer(paes->context, CL_MEM_READ_ONLY, sizeof(cl_uchar) * ROUND_KEY_SIZE, NULL, &error1);
+	paes->cl_ghash_table = clCreateBuffer(paes->context, CL_MEM_READ_WRITE, sizeof(cl_ulong) * 2 * GCM_TABLE_SIZE, NULL, &error2);
 	error |= error1 |= error2;
-	printf("clCreateBuffer & co...\n");
+	printf("%sclCreateBuffer & co...\n", prefix);
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clCreateBuffer, error code %d\n", error);
 		ok = 0;
 		goto cleanup;
 	}
 
-	program = clCreateProgramWithSource(context, 1, (const char **) &source, &source_size, &error);
-	printf("clCreateProgramWithSource...\n");
+	/* The kernels are specialized for the key size and for the device: the
+	   number of rounds and of blocks processed together are compile time
+	   constants, so that the compiler can unroll them all. */
+	if (defines == NULL)
+		defines = "";
+	/* Unless the user chose the kernel variants, the tuned ones are built;
+	   each engine has its own macros, so they don't get in each other's way. */
+	variants = (char *) malloc(sizeof(char) * (strlen(defines) + AES_ENGINE_AUTO * (TUNE_DEFINES_SIZE + 1) + 1));
+	strcpy(variants, defines);
+	for (aes_engine engine = 0; engine < AES_ENGINE_AUTO && defines[0] == '\0'; ++engine) {
+		if (paes->profile[engine].tuned && paes->profile[engine].defines[0] != '\0') {
+			if (variants[0] != '\0')
+				strcat(variants, " ");
+			strcat(variants, paes->profile[engine].defines);
+		}
+	}
+	// INTERLEAVE is defined once: by the variants, if they have it, or here
+	cl_uint interleave = get_interleave_factor(paes->devices[0], variants);
+	build_options = (char *) malloc(sizeof(char) * (strlen(variants) + 80));
+	sprintf(build_options, "-DNR=%u -DINTERLEAVE_VECTOR=uint%u", (unsigned) get_rounds_number(key_size_bits), (unsigned) (interleave <= 2 ? 8 : 16));
+	if (find_interleave_macro(variants) == 0)
+		sprintf(build_options + strlen(build_options), " -DINTERLEAVE=%u", (unsigned) interleave);
+	if (variants[0] != '\0')
+		sprintf(build_options + strlen(build_options), " %s", variants);
+	printf("%sInterleave factor is %u\n", prefix, (unsigned) interleave);
+	printf("%sBuild options are %s\n", prefix, build_options);
+
+	/* Building the program takes much longer than the encryption of small
+	   files, so the binary is cached; when the driver rejects the cached
+	   binary the program is built from the source code as usual. */
+	char cache_file_name[1024];
+	bool cache = get_cache_file(paes->devices[0], build_options, ".bin", cache_file_name, sizeof(cache_file_name));
+	if (cache)
+		paes->program = load_cached_program(paes->context, paes->devices[0], build_options, cache_file_name);
+	if (paes->program != NULL) {
+		printf("%sProgram loaded from the cache...\n", prefix);
+		goto built;
+	}
+
+	paes->program = clCreateProgramWithSource(paes->context, paes_kernel_source_lines, paes_kernel_source, NULL, &error);
+	printf("%sclCreateProgramWithSource...\n", prefix);
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clCreateProgramWithSource, error code %d\n", error);
+		paes->program = NULL;
 		ok = 0;
 		goto cleanup;
 	}
 
-	error = clBuildProgram(program, 1, devices, 0, NULL, NULL);
-	printf("clBuildProgram...\n");
+	error = clBuildProgram(paes->program, 1, paes->devices, build_options, NULL, NULL);
+	printf("%sclBuildProgram...\n", prefix);
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clBuildProgram, error code %d\n", error);
 		ok = 0;
 		char *build_log = NULL;
 		size_t build_log_size = 0;
-		clGetProgramBuildInfo (program, devices[0], CL_PROGRAM_BUILD_LOG, build_log_size, build_log, &build_log_size);
-		build_log = (char *)malloc(build_log_size);
-		clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, build_log_size, build_log, NULL);
-		printf("\nBuild log:\n%s\n", build_log);
+		clGetProgramBuildInfo(paes->program, paes->devices[0], CL_PROGRAM_BUILD_LOG, build_log_size, build_log, &build_log_size);
+		build_log = (char *) malloc(build_log_size);
+		clGetProgramBuildInfo(paes->program, paes->devices[0], CL_PROGRAM_BUILD_LOG, build_log_size, build_log, NULL);
+		printf("\n%sBuild log:\n%s\n", prefix, build_log);
+		free(build_log);
 		goto cleanup;
 	}
+	if (cache)
+		store_cached_program(paes->program, paes->devices[0], cache_file_name);
+
+      built:
 	clUnloadCompiler();
 
-	kernel = clCreateKernel(program, "kernel_aes", &error);
-	printf("clCreateKernel...\n");
+      cleanup:
+	if (build_options)
+		free(build_options);
+	free(variants);
+
+	if (!ok) {
+		paes_engine_destroy(paes);
+		return NULL;
+	} else {
+		return paes;
+	}
+}
+
+/**
+ * Finds the first device of the specified type of the first platform; OPENCL_DEVICE_ALL means the
+ * first device of any type, and OPENCL_DEVICE_AUTO the first GPU or, if there are none, the first CPU.
+ * \param device the OpenCL device type (see \ref opencl_device)
+ * \param platform where the platform of the device will be stored
+ * \param device_id where the device will be stored
+ * \return false if there's no such device, true otherwise
+ */
+static bool find_device(opencl_device device, cl_platform_id * platform, cl_device_id * device_id)
+{
+	cl_uint num_platforms;
+	cl_platform_id *platforms = NULL;
+	cl_int error;
+	static const cl_device_type device_type[] = { CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL };
+
+	if (device == OPENCL_DEVICE_NATIVE) {
+		fprintf(stderr, "ERROR: the %s engine doesn't use OpenCL.\n", get_opencl_device_name(device));
+		return false;
+	}
+
+	error = clGetPlatformIDs(0, NULL, &num_platforms);
+	if (error != CL_SUCCESS || num_platforms == 0) {
+		fprintf(stderr, "ERROR: clGetPlatformIDs (num_platforms), error code %d\n", error);
+		return false;
+	}
+
+	platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * num_platforms);
+	error = clGetPlatformIDs(num_platforms, platforms, NULL);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clGetPlatformIDs (platforms), error code %d\n", error);
+		free(platforms);
+		return false;
+	}
+
+	// The first device of the requested type of the first platform
+	if (device == OPENCL_DEVICE_AUTO) {
+		error = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 1, device_id, NULL);
+		if (error != CL_SUCCESS)
+			error = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_CPU, 1, device_id, NULL);
+	} else {
+		error = clGetDeviceIDs(platforms[0], device_type[device], 1, device_id, NULL);
+	}
+	printf("clGetDeviceIDs...\n");
+	*platform = platforms[0];
+	free(platforms);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clGetDeviceIDs, error code %d\n", error);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Creates an engine for the first device of the specified type; see \ref paes_engine_create, \ref find_device and \ref create_engine.
+ */
+static paes_engine *create_engine_of_type(opencl_device device, unsigned key_size_bits, const char *defines, bool use_profile)
+{
+	cl_platform_id platform;
+	cl_device_id device_id;
+
+	if (!find_device(device, &platform, &device_id))
+		return NULL;
+	return create_engine(platform, device_id, key_size_bits, defines, use_profile, "");
+}
+
+paes_engine *paes_engine_create(opencl_device device, unsigned key_size_bits, const char *defines)
+{
+	return create_engine_of_type(device, key_size_bits, defines, true);
+}
+
+void paes_engine_set_work_sizes(paes_engine * paes, size_t global_size, size_t local_size)
+{
+	paes->global_size = global_size;
+	paes->local_size = local_size;
+}
+
+/**
+ * Checks if the device can process the data with the specified engine, distribution, layout and chaining,
+ * explaining why to the user if it can't.
+ * \return true if everything is fine, false otherwise
+ */
+static bool check_run(size_t size, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uint sector_size)
+{
+	if (engine == AES_ENGINE_GLOBAL && layout != AES_LAYOUT_LINEAR) {
+		fprintf(stderr, "ERROR: the %s engine supports only the %s layout.\n", get_aes_engine_name(engine), get_aes_layout_name(AES_LAYOUT_LINEAR));
+		return false;
+	}
+	if (chaining != AES_CHAINING_ECB && ((engine != AES_ENGINE_PRIVATE && engine != AES_ENGINE_AUTO) || layout != AES_LAYOUT_LINEAR)) {
+		fprintf(stderr, "ERROR: the %s chaining is supported only by the %s engine with the %s layout.\n", get_aes_chaining_name(chaining), get_aes_engine_name(AES_ENGINE_PRIVATE), get_aes_layout_name(AES_LAYOUT_LINEAR));
+		return false;
+	}
+	if (chaining == AES_CHAINING_XTS && (sector_size == 0 || sector_size % AES_BLOCK_SIZE != 0)) {
+		fprintf(stderr, "ERROR: the sector size must be a multiple of %u bytes.\n", (unsigned) AES_BLOCK_SIZE);
+		return false;
+	}
+	if (chaining == AES_CHAINING_CBC && (size % AES_BLOCK_SIZE != 0 || sector_size % AES_BLOCK_SIZE != 0)) {
+		fprintf(stderr, "ERROR: the %s chaining needs whole blocks, both in the data and in the segments.\n", get_aes_chaining_name(chaining));
+		return false;
+	}
+	if (chaining == AES_CHAINING_GCM && distribution != AES_DISTRIBUTION_CONTIGUOUS) {
+		fprintf(stderr, "ERROR: the %s chaining supports only the %s distribution.\n", get_aes_chaining_name(chaining), get_aes_distribution_name(AES_DISTRIBUTION_CONTIGUOUS));
+		return false;
+	}
+	// The 32 bits counter starts from 2 and mustn't wrap around
+	if (chaining == AES_CHAINING_GCM && (size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE > 0xfffffffeULL) {
+		fprintf(stderr, "ERROR: the %s chaining can't process more than %llu bytes.\n", get_aes_chaining_name(chaining), 0xfffffffeULL * AES_BLOCK_SIZE);
+		return false;
+	}
+	if (chaining == AES_CHAINING_XTS && size > 0 && size < AES_BLOCK_SIZE) {
+		fprintf(stderr, "ERROR: the %s chaining needs at least %u bytes of data.\n", get_aes_chaining_name(chaining), (unsigned) AES_BLOCK_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Chooses the OpenCL global and local work sizes for the specified number of blocks: the ones given
+ * by \ref paes_engine_set_work_sizes come first, then the ones of the device profile, and then the
+ * ones of paes_size.h. The global work size is always a multiple of the local one.
+ */
+static void get_work_sizes(paes_engine * paes, aes_engine engine, cl_ulong blocks, size_t * global_size, size_t * local_size)
+{
+#ifdef PAES_DYNAMIC_SIZE
+	// Enough work groups to keep every compute unit busy, but not one work item per block
+	cl_ulong max_global_size = (cl_ulong) paes->compute_units * PAES_MAX_LOCAL_SIZE * PAES_GLOBAL_LOCAL_RATIO;
+	*global_size = blocks < max_global_size ? blocks : max_global_size;
+
+	*local_size = *global_size / PAES_GLOBAL_LOCAL_RATIO;
+	if (*local_size < 1)
+		*local_size = 1;
+	else if (*local_size > PAES_MAX_LOCAL_SIZE)
+		*local_size = PAES_MAX_LOCAL_SIZE;
+#elif defined(PAES_STATIC_SIZE)
+	(void) blocks;
+	*global_size = PAES_GLOBAL_SIZE;
+	*local_size = PAES_LOCAL_SIZE;
+#endif
+
+	if (paes->profile[engine].tuned) {
+		*global_size = paes->profile[engine].global_size;
+		*local_size = paes->profile[engine].local_size;
+	}
+	if (paes->global_size != 0)
+		*global_size = paes->global_size;
+	if (paes->local_size != 0)
+		*local_size = paes->local_size;
+
+	if (*global_size < *local_size)
+		*global_size = *local_size;
+	*global_size = (*global_size + *local_size - 1) / *local_size * *local_size;
+}
+
+/**
+ * Chooses the engine that AES_ENGINE_AUTO stands for: the fastest one of the device profile that
+ * supports the layout and the chaining, or AES_ENGINE_PRIVATE.
+ * \return the engine itself, if it isn't AES_ENGINE_AUTO
+ */
+static aes_engine resolve_engine(paes_engine * paes, aes_engine engine, aes_layout layout, aes_chaining chaining)
+{
+	if (engine != AES_ENGINE_AUTO)
+		return engine;
+	if (chaining != AES_CHAINING_ECB)
+		return AES_ENGINE_PRIVATE;
+
+	engine = AES_ENGINE_PRIVATE;
+	double throughput = 0;
+	for (aes_engine candidate = 0; candidate < AES_ENGINE_AUTO; ++candidate) {
+		if (!paes->profile[candidate].tuned || (candidate == AES_ENGINE_GLOBAL && layout != AES_LAYOUT_LINEAR))
+			continue;
+		if (paes->profile[candidate].throughput > throughput) {
+			engine = candidate;
+			throughput = paes->profile[candidate].throughput;
+		}
+	}
+	return engine;
+}
+
+/**
+ * Expands the keys and copies the round keys into the device; the tweak key is expanded only for AES_CHAINING_XTS.
+ * \return the OpenCL error code
+ */
+static cl_int write_round_keys(paes_engine * paes, cl_uchar * key, cl_uchar * tweak_key, aes_chaining chaining)
+{
+	cl_uint round_key_size = get_round_key_size(paes->key_size_bits);
+	cl_uchar *round_key = key_expansion(key, paes->key_size_bits, chaining);
+	cl_int error = clEnqueueWriteBuffer(paes->command_queue, paes->cl_round_key, CL_TRUE, 0, sizeof(cl_uchar) * 2 * round_key_size, round_key, 0, NULL, NULL);
+	free(round_key);
+	if (chaining == AES_CHAINING_XTS) {
+		cl_uchar *tweak_round_key = key_expansion(tweak_key, paes->key_size_bits, chaining);
+		error |= clEnqueueWriteBuffer(paes->command_queue, paes->cl_tweak_round_key, CL_TRUE, 0, sizeof(cl_uchar) * round_key_size, tweak_round_key, 0, NULL, NULL);
+		free(tweak_round_key);
+	}
+	return error;
+}
+
+/**
+ * Sets the arguments of the kernel that applies the chaining, and of the GCM setup kernel too.
+ * \param paes the engine
+ * \param kernel the kernel that processes the data
+ * \param gcm_setup_kernel the kernel that prepares the GHASH table; it's used only by AES_CHAINING_GCM
+ * \param input the buffer with the encrypted blocks of the CBC decryption, NULL for the other kernels
+ * \param output the buffer that holds the data
+ * \param round_key the buffer of the round keys, e.g. the one of the engine
+ * \param tweak_round_key the buffer of the round keys of the XTS tweak key
+ * \param size the data size, in bytes
+ * \param first_block the index of the first block of the data; the CTR counters start from it
+ * \param local_size the OpenCL local work size
+ * \param ghash_partial the buffer of the partial GHASH values; it's used only by AES_CHAINING_GCM
+ * \return the OpenCL error code
+ */
+static cl_int set_kernel_arguments(paes_engine * paes, cl_kernel kernel, cl_kernel gcm_setup_kernel, cl_mem input, cl_mem output, cl_mem round_key, cl_mem tweak_round_key, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_ulong first_block, cl_uint sector_size, cl_ulong first_sector, size_t local_size, cl_mem ghash_partial)
+{
+	cl_int error = CL_SUCCESS;
+	cl_ulong blocks = size / AES_BLOCK_SIZE;
+	cl_uint arg = 0;
+	if (input != NULL)
+		error = clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &input);
+	error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &output);
+	if (chaining == AES_CHAINING_CTR) {
+		/* The counter blocks are the initialization vector plus the block
+		   index, as a 128 bits big endian integer split in two halves. */
+		cl_ulong bytes = size, iv_high, iv_low;
+		split_iv(iv, &iv_high, &iv_low);
+		iv_low += first_block;
+		if (iv_low < first_block)
+			++iv_high;
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &bytes);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &round_key);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &iv_high);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &iv_low);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &distribution);
+	} else if (chaining == AES_CHAINING_GCM) {
+		/* The counter blocks are the 96 bits initialization vector followed
+		   by a 32 bits counter, split in two halves as for CTR. */
+		cl_ulong bytes = size, iv_high = 0, iv_low = 0;
+		for (unsigned i = 0; i < 8; ++i)
+			iv_high = (iv_high << 8) | iv[i];
+		for (unsigned i = 8; i < GCM_IV_SIZE; ++i)
+			iv_low = (iv_low << 8) | iv[i];
+		iv_low <<= 32;
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &bytes);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &mode);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &round_key);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &paes->cl_ghash_table);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &iv_high);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &iv_low);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong) * 2 * local_size, NULL);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &ghash_partial);
+
+		error |= clSetKernelArg(gcm_setup_kernel, 0, sizeof(cl_mem), (void *) &round_key);
+		error |= clSetKernelArg(gcm_setup_kernel, 1, sizeof(cl_mem), (void *) &paes->cl_ghash_table);
+		error |= clSetKernelArg(gcm_setup_kernel, 2, sizeof(cl_ulong), (void *) &iv_high);
+		error |= clSetKernelArg(gcm_setup_kernel, 3, sizeof(cl_ulong), (void *) &iv_low);
+	} else if (chaining == AES_CHAINING_CBC) {
+		// Without a segment size the whole buffer is a single stream
+		cl_ulong iv_high, iv_low, segment_blocks = sector_size != 0 ? sector_size / AES_BLOCK_SIZE : blocks;
+		if (segment_blocks == 0)
+			segment_blocks = 1;
+		split_iv(iv, &iv_high, &iv_low);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &blocks);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &round_key);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &iv_high);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &iv_low);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &segment_blocks);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &distribution);
+	} else if (chaining == AES_CHAINING_XTS) {
+		cl_ulong bytes = size;
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &bytes);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &mode);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &round_key);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &tweak_round_key);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &sector_size);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &first_sector);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &distribution);
+	} else {
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), (void *) &blocks);
+		if (kernel_has_mode(engine))
+			error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &mode);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *) &round_key);
+		error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &distribution);
+		if (engine != AES_ENGINE_GLOBAL)
+			error |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), (void *) &layout);
+	}
+
+	return error;
+}
+
+/**
+ * Settles the GCM authentication tag: when encrypting the computed tag is given back, when
+ * decrypting it's compared with the expected one, looking at every byte.
+ * \return false if the tags are different, true otherwise
+ */
+static bool check_gcm_tag(aes_mode mode, const cl_uchar * computed_tag, cl_uchar * tag)
+{
+	if (mode == AES_MODE_ENCRYPT) {
+		memcpy(tag, computed_tag, GCM_TAG_SIZE);
+		return true;
+	}
+
+	cl_uchar difference = 0;
+	for (unsigned i = 0; i < GCM_TAG_SIZE; ++i)
+		difference |= computed_tag[i] ^ tag[i];
+	if (difference != 0) {
+		fprintf(stderr, "ERROR: wrong authentication tag, the data is corrupted or the password is wrong.\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Encrypts or decrypts data with an engine, as \ref paes_engine_run does.
+ * \param first_block the index of the first block of the data; the CTR counters start from it
+ * \param times if it isn't NULL the encrypt, write and read times in milliseconds are added to it,
+ *        and neither they nor the progress messages are printed
+ * \return -1 if something went wrong (including a wrong GCM tag), 0 otherwise
+ */
+static int run_engine(paes_engine * paes, cl_uchar * buffer, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_block, cl_ulong first_sector, cl_uchar * tag, double *times)
+{
+	/* All these variables are defined here, getting NULL if they're pointers,
+	   to avoid error in case of a premature jump to the cleanup label. */
+	cl_uchar *device_data = buffer;
+	cl_int error, error1;
+	cl_mem cl_ghash_partial = NULL, cl_host_buffer = NULL;
+	cl_event event_write = NULL, event_execute = NULL, event_read = NULL;
+	cl_kernel kernel, gcm_setup_kernel = NULL;
+	cl_ulong ghash_table[2 * GCM_TABLE_SIZE], *ghash_partial = NULL;
+	cl_ulong blocks = size / AES_BLOCK_SIZE;
+	bool ok = 1;		// By default, everything is fine.
+
+	engine = resolve_engine(paes, engine, layout, chaining);
+	if (times == NULL)
+		printf("Engine is %s\n", get_aes_engine_name(engine));
+	if (!check_run(size, engine, distribution, layout, chaining, sector_size))
+		return -1;
+	if (size > paes->max_buffer_size) {
+		fprintf(stderr, "ERROR: the device can't hold more than %llu bytes at once, use the streaming mode.\n", (unsigned long long) paes->max_buffer_size);
+		return -1;
+	}
+
+	size_t global_size, local_size;
+	get_work_sizes(paes, engine, blocks, &global_size, &local_size);
+	if (times == NULL) {
+		printf("Global work size is %lu\n", (long unsigned) global_size);
+		printf("Local work size is %lu\n", (long unsigned) local_size);
+	}
+
+	/* The interleaved blocks are prepared in a separate host buffer; the
+	   trailing bytes that don't make a whole block are just copied. */
+	if (layout == AES_LAYOUT_INTERLEAVED) {
+		device_data = (cl_uchar *) malloc(sizeof(cl_uchar) * size);
+		interleave_blocks(buffer, device_data, blocks);
+		memcpy(device_data + blocks * AES_BLOCK_SIZE, buffer + blocks * AES_BLOCK_SIZE, size - blocks * AES_BLOCK_SIZE);
+	}
+
+	/* The CBC decryption reads the encrypted blocks from a separate input
+	   buffer, because each of them is needed to decrypt the next one too. */
+	bool separate_input = chaining == AES_CHAINING_CBC && mode == AES_MODE_DECRYPT;
+	/* The host data is used in place only if it starts at a page, as the
+	   runtimes want; e.g. the data of a mapped file to encrypt, after the room
+	   for the initialization vector, doesn't, so it's copied to the device
+	   buffer as usual. With a separate input, the host data is that input,
+	   and only the results are copied back. */
+	bool zero_copy = paes->zero_copy && size > 0 && (uintptr_t) device_data % get_page_size() == 0;
+	if (zero_copy) {
+		cl_host_buffer = clCreateBuffer(paes->context, (separate_input ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE) | CL_MEM_USE_HOST_PTR, sizeof(cl_uchar) * size, device_data, &error);
+		if (separate_input)
+			error |= reserve_buffer(paes, &paes->cl_buffer, &paes->buffer_capacity, CL_MEM_READ_WRITE, size);
+	} else {
+		error = reserve_buffer(paes, &paes->cl_buffer, &paes->buffer_capacity, CL_MEM_READ_WRITE, size);
+		if (separate_input)
+			error |= reserve_buffer(paes, &paes->cl_input, &paes->input_capacity, CL_MEM_READ_ONLY, size);
+		if (error == CL_SUCCESS && size > 0)
+			error = clEnqueueWriteBuffer(paes->command_queue, separate_input ? paes->cl_input : paes->cl_buffer, CL_TRUE, 0, sizeof(cl_uchar) * size, (void *) device_data, 0, NULL, &event_write);
+	}
+	cl_mem cl_buffer = zero_copy && !separate_input ? cl_host_buffer : paes->cl_buffer;
+	cl_mem cl_input = separate_input ? (zero_copy ? cl_host_buffer : paes->cl_input) : NULL;
+	error |= write_round_keys(paes, key, tweak_key, chaining);
+	size_t groups = (global_size + local_size - 1) / local_size;
+	if (chaining == AES_CHAINING_GCM) {
+		ghash_partial = (cl_ulong *) malloc(sizeof(cl_ulong) * 2 * groups);
+		cl_ghash_partial = clCreateBuffer(paes->context, CL_MEM_WRITE_ONLY, sizeof(cl_ulong) * 2 * groups, NULL, &error1);
+		error |= error1;
+	}
+	if (times == NULL)
+		printf("clCreateBuffer & co...\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clCreateBuffer, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
+
+	kernel = get_kernel(paes, get_kernel_name(engine, mode, chaining), &error);
+	if (chaining == AES_CHAINING_GCM) {
+		gcm_setup_kernel = get_kernel(paes, "kernel_gcm_setup", &error1);
+		error |= error1;
+	}
+	if (times == NULL)
+		printf("clCreateKernel...\n");
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clCreateKernel, error code %d\n", error);
 		ok = 0;
 		goto cleanup;
 	}
 
-	error = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &cl_buffer);
-	error |= clSetKernelArg(kernel, 1, sizeof(cl_ulong), (void *) &blocks);
-	error |= clSetKernelArg(kernel, 2, sizeof(cl_uint), (void *) &mode);
-	error |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &cl_round_key);
-	cl_uint rounds = get_rounds_number(key_size_bits);
-	error |= clSetKernelArg(kernel, 4, sizeof(cl_uint), (void *) &rounds);
+	error = set_kernel_arguments(paes, kernel, gcm_setup_kernel, cl_input, cl_buffer, paes->cl_round_key, paes->cl_tweak_round_key, size, mode, engine, distribution, layout, chaining, iv, first_block, sector_size, first_sector, local_size, cl_ghash_partial);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clSetKernelArg, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
 
-	cl_uint round = 0;
-	double execution_time = 0;
-	while (round <= rounds) {
-		printf("Round %u...\n", (unsigned) round);
-		error |= clSetKernelArg(kernel, 5, sizeof(cl_uint), (void *) &round);
+	// The GHASH table is prepared by a single work item, before the data are processed
+	if (gcm_setup_kernel) {
+		size_t one = 1;
+		error = clEnqueueNDRangeKernel(paes->command_queue, gcm_setup_kernel, 1, NULL, &one, &one, 0, NULL, NULL);
 		if (error != CL_SUCCESS) {
-			fprintf(stderr, "ERROR: clSetKernelArg, error code %d\n", error);
+			fprintf(stderr, "ERROR: clEnqueueNDRangeKernel, error code %d\n", error);
 			ok = 0;
 			goto cleanup;
 		}
+	}
+
+	/* Every round is done by the kernel itself, so it's enqueued just once;
+	   the blocking read below waits for it on the in-order command queue. */
+	error = clEnqueueNDRangeKernel(paes->command_queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, &event_execute);
+	if (times == NULL)
+		printf("clEnqueueNDRangeKernel...\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clEnqueueNDRangeKernel, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
+
+	/* Mapping a buffer made of host memory just makes sure that the host
+	   sees the results, and then the buffer can be unmapped right away. */
+	if (zero_copy && !separate_input) {
+		void *mapped = clEnqueueMapBuffer(paes->command_queue, cl_host_buffer, CL_TRUE, CL_MAP_READ, 0, sizeof(cl_uchar) * size, 0, NULL, &event_read, &error);
+		if (error == CL_SUCCESS)
+			error = clEnqueueUnmapMemObject(paes->command_queue, cl_host_buffer, mapped, 0, NULL, NULL);
+		error |= clFinish(paes->command_queue);
+	} else if (size > 0) {
+		error = clEnqueueReadBuffer(paes->command_queue, paes->cl_buffer, CL_TRUE, 0, sizeof(cl_uchar) * size, device_data, 0, NULL, &event_read);
+	} else {
+		error = clFinish(paes->command_queue);
+	}
+	if (times == NULL)
+		printf("clEnqueueReadBuffer...\n\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clEnqueueReadBuffer, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
 
-		error = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, &event_execute);
+	if (chaining == AES_CHAINING_GCM) {
+		cl_uchar computed_tag[GCM_TAG_SIZE];
+		error = clEnqueueReadBuffer(paes->command_queue, paes->cl_ghash_table, CL_TRUE, 0, sizeof(cl_ulong) * 2 * GCM_TABLE_SIZE, ghash_table, 0, NULL, NULL);
+		error |= clEnqueueReadBuffer(paes->command_queue, cl_ghash_partial, CL_TRUE, 0, sizeof(cl_ulong) * 2 * groups, ghash_partial, 0, NULL, NULL);
 		if (error != CL_SUCCESS) {
-			fprintf(stderr, "ERROR: clEnqueueNDRangeKernel, error code %d\n", error);
+			fprintf(stderr, "ERROR: clEnqueueReadBuffer, error code %d\n", error);
+			ok = 0;
+			goto cleanup;
+		}
+		gcm_tag(ghash_partial, groups, ghash_table, size, computed_tag);
+		if (!check_gcm_tag(mode, computed_tag, tag)) {
+			ok = 0;
+			goto cleanup;
+		}
+	}
+
+	if (layout == AES_LAYOUT_INTERLEAVED) {
+		deinterleave_blocks(device_data, buffer, blocks);
+		memcpy(buffer + blocks * AES_BLOCK_SIZE, device_data + blocks * AES_BLOCK_SIZE, size - blocks * AES_BLOCK_SIZE);
+	}
+
+	if (times != NULL) {
+		times[0] += execution_time_msecs(event_execute);
+		times[1] += execution_time_msecs(event_write);
+		times[2] += execution_time_msecs(event_read);
+	} else {
+		printf("Encrypt time:\t%.3f ms\n", execution_time_msecs(event_execute));
+		printf("Write time:\t%.3f ms\n", execution_time_msecs(event_write));
+		printf("Read time:\t%.3f ms\n", execution_time_msecs(event_read));
+	}
+
+      cleanup:
+	if (event_write)
+		clReleaseEvent(event_write);
+	if (event_execute)
+		clReleaseEvent(event_execute);
+	if (event_read)
+		clReleaseEvent(event_read);
+	if (cl_ghash_partial)
+		clReleaseMemObject(cl_ghash_partial);
+	if (cl_host_buffer)
+		clReleaseMemObject(cl_host_buffer);
+	if (ghash_partial)
+		free(ghash_partial);
+	if (device_data != buffer)
+		free(device_data);
+
+	if (!ok) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+int paes_engine_run(paes_engine * paes, cl_uchar * buffer, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag)
+{
+	return run_engine(paes, buffer, size, mode, engine, distribution, layout, chaining, iv, key, tweak_key, sector_size, 0, first_sector, tag, NULL);
+}
+
+/**
+ * Returns the number of units of a segment of a batch, as kernel_aes_batch counts them: the whole
+ * blocks for ECB, the blocks including the last partial one for CTR, the sectors for XTS.
+ */
+static cl_ulong get_segment_units(size_t length, aes_chaining chaining, cl_uint sector_size)
+{
+	if (chaining == AES_CHAINING_CTR)
+		return (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+	if (chaining == AES_CHAINING_XTS) {
+		if (length == 0)
+			return 0;
+		cl_ulong sectors = length / sector_size;
+		return length % sector_size >= AES_BLOCK_SIZE || sectors == 0 ? sectors + 1 : sectors;
+	}
+	return length / AES_BLOCK_SIZE;
+}
+
+/**
+ * Expands the keys of a batch all at once into a key table, as kernel_aes_batch reads it: the
+ * encryption round keys of each key, followed by the ones of its tweak key for AES_CHAINING_XTS.
+ * \param keys the keys, as given to \ref paes_engine_run_batch
+ * \param key_count the number of keys
+ * \param size where the size of the key table will be stored
+ * \return the key table, to be released by free()
+ */
+static cl_uchar *expand_batch_keys(cl_uchar * keys, size_t key_count, unsigned key_size_bits, aes_chaining chaining, size_t * size)
+{
+	unsigned parts = chaining == AES_CHAINING_XTS ? 2 : 1;
+	cl_uint round_key_size = get_round_key_size(key_size_bits);
+	cl_uchar *table = (cl_uchar *) malloc(sizeof(cl_uchar) * parts * round_key_size * (key_count > 0 ? key_count : 1));
+
+	for (size_t i = 0; i < key_count * parts; ++i) {
+		cl_uchar *round_key = key_expansion(keys + i * (key_size_bits / 8), key_size_bits, chaining);
+		memcpy(table + i * round_key_size, round_key, round_key_size);
+		free(round_key);
+	}
+	*size = parts * round_key_size * key_count;
+	return table;
+}
+
+int paes_engine_run_batch(paes_engine * paes, cl_uchar * buffer, size_t size, const paes_segment * segments, size_t count, cl_uchar * keys, size_t key_count, aes_mode mode, aes_distribution distribution, aes_chaining chaining, cl_uint sector_size)
+{
+	/* All these variables are defined here, getting NULL if they're pointers,
+	   to avoid error in case of a premature jump to the cleanup label. */
+	cl_int error, error1;
+	cl_mem cl_segments = NULL, cl_round_keys = NULL;
+	cl_event event_write = NULL, event_execute = NULL, event_read = NULL;
+	cl_ulong *table = NULL, units = 0;
+	cl_uchar *round_keys = NULL;
+	size_t round_keys_size;
+	bool ok = 1;		// By default, everything is fine.
+
+	if (chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) {
+		fprintf(stderr, "ERROR: the %s chaining isn't supported by the batch mode.\n", get_aes_chaining_name(chaining));
+		return -1;
+	}
+	if (!check_run(AES_BLOCK_SIZE, AES_ENGINE_PRIVATE, distribution, AES_LAYOUT_LINEAR, chaining, sector_size))
+		return -1;
+	if (size > paes->max_buffer_size) {
+		fprintf(stderr, "ERROR: the device can't hold more than %llu bytes at once.\n", (unsigned long long) paes->max_buffer_size);
+		return -1;
+	}
+
+	// The segment table, see BATCH_SEGMENT_WORDS
+	table = (cl_ulong *) malloc(sizeof(cl_ulong) * BATCH_SEGMENT_WORDS * (count > 0 ? count : 1));
+	for (size_t i = 0; i < count; ++i) {
+		cl_ulong *segment = table + i * BATCH_SEGMENT_WORDS;
+		if (chaining == AES_CHAINING_XTS && segments[i].length > 0 && segments[i].length < AES_BLOCK_SIZE) {
+			fprintf(stderr, "ERROR: the xts chaining needs at least %u bytes, segment %lu has %lu.\n", (unsigned) AES_BLOCK_SIZE, (long unsigned) i, (long unsigned) segments[i].length);
 			ok = 0;
 			goto cleanup;
 		}
-		clFinish(command_queue);
+		if (segments[i].key >= key_count) {
+			fprintf(stderr, "ERROR: segment %lu has the key %u, but there are %lu keys.\n", (long unsigned) i, (unsigned) segments[i].key, (long unsigned) key_count);
+			ok = 0;
+			goto cleanup;
+		}
+		segment[BATCH_SEGMENT_FIRST_UNIT] = units;
+		segment[BATCH_SEGMENT_OFFSET] = segments[i].offset;
+		segment[BATCH_SEGMENT_LENGTH] = segments[i].length;
+		split_iv(segments[i].iv, &segment[BATCH_SEGMENT_IV_HIGH], &segment[BATCH_SEGMENT_IV_LOW]);
+		if (chaining == AES_CHAINING_XTS)
+			segment[BATCH_SEGMENT_IV_LOW] = segments[i].first_sector;
+		segment[BATCH_SEGMENT_KEY] = segments[i].key;
+		units += get_segment_units(segments[i].length, chaining, sector_size);
+	}
+	printf("Engine is batch\n");
+	printf("Segments are %lu, keys are %lu, units are %lu\n", (long unsigned) count, (long unsigned) key_count, (long unsigned) units);
+	if (units == 0)
+		goto cleanup;
+
+	size_t global_size, local_size;
+	get_work_sizes(paes, AES_ENGINE_PRIVATE, units, &global_size, &local_size);
+	printf("Global work size is %lu\n", (long unsigned) global_size);
+	printf("Local work size is %lu\n", (long unsigned) local_size);
+
+	error = reserve_buffer(paes, &paes->cl_buffer, &paes->buffer_capacity, CL_MEM_READ_WRITE, size);
+	if (error == CL_SUCCESS)
+		error = clEnqueueWriteBuffer(paes->command_queue, paes->cl_buffer, CL_TRUE, 0, sizeof(cl_uchar) * size, (void *) buffer, 0, NULL, &event_write);
+	cl_segments = clCreateBuffer(paes->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_ulong) * BATCH_SEGMENT_WORDS * count, table, &error1);
+	error |= error1;
+	round_keys = expand_batch_keys(keys, key_count, paes->key_size_bits, chaining, &round_keys_size);
+	cl_round_keys = clCreateBuffer(paes->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uchar) * round_keys_size, round_keys, &error1);
+	error |= error1;
+	printf("clCreateBuffer & co...\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clCreateBuffer, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
+
+	cl_kernel kernel = get_kernel(paes, "kernel_aes_batch", &error);
+	printf("clCreateKernel...\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clCreateKernel, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
+
+	cl_uint segment_count = (cl_uint) count;
+	error = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &paes->cl_buffer);
+	error |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &cl_segments);
+	error |= clSetKernelArg(kernel, 2, sizeof(cl_uint), (void *) &segment_count);
+	error |= clSetKernelArg(kernel, 3, sizeof(cl_ulong), (void *) &units);
+	error |= clSetKernelArg(kernel, 4, sizeof(cl_uint), (void *) &mode);
+	error |= clSetKernelArg(kernel, 5, sizeof(cl_uint), (void *) &chaining);
+	error |= clSetKernelArg(kernel, 6, sizeof(cl_mem), (void *) &cl_round_keys);
+	error |= clSetKernelArg(kernel, 7, sizeof(cl_uint), (void *) &sector_size);
+	error |= clSetKernelArg(kernel, 8, sizeof(cl_uint), (void *) &distribution);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clSetKernelArg, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
 
-		execution_time += execution_time_msecs(event_execute);
-		++round;
+	error = clEnqueueNDRangeKernel(paes->command_queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, &event_execute);
+	printf("clEnqueueNDRangeKernel...\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clEnqueueNDRangeKernel, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
 	}
 
-	error = clEnqueueReadBuffer(command_queue, cl_buffer, CL_TRUE, 0, sizeof(cl_uchar) * size, buffer, 0, NULL, &event_read);
+	error = clEnqueueReadBuffer(paes->command_queue, paes->cl_buffer, CL_TRUE, 0, sizeof(cl_uchar) * size, buffer, 0, NULL, &event_read);
 	printf("clEnqueueReadBuffer...\n\n");
 	if (error != CL_SUCCESS) {
 		fprintf(stderr, "ERROR: clEnqueueReadBuffer, error code %d\n", error);
@@ -352,39 +1808,1051 @@ int apply_aes(cl_uchar * buffer, size_t size, opencl_device device, aes_mode mod
 		goto cleanup;
 	}
 
-	printf("Encrypt time:\t%.3f ms\n", execution_time);
+	printf("Encrypt time:\t%.3f ms\n", execution_time_msecs(event_execute));
 	printf("Write time:\t%.3f ms\n", execution_time_msecs(event_write));
 	printf("Read time:\t%.3f ms\n", execution_time_msecs(event_read));
 
       cleanup:
-	printf("Cleanup... \n");
-
 	if (event_write)
 		clReleaseEvent(event_write);
 	if (event_execute)
 		clReleaseEvent(event_execute);
 	if (event_read)
 		clReleaseEvent(event_read);
-	if (cl_round_key)
-		clReleaseMemObject(cl_round_key);
-	if (cl_buffer)
-		clReleaseMemObject(cl_buffer);
-	if (kernel)
-		clReleaseKernel(kernel);
-	if (program)
-		clReleaseProgram(program);
-	if (command_queue)
-		clReleaseCommandQueue(command_queue);
-	if (context)
-		clReleaseContext(context);
-	if (platforms)
-		free(platforms);
-	if (round_key)
-		free(round_key);
-	if (source)
-		free(source);
-	if (devices)
-		free(devices);
+	if (cl_segments)
+		clReleaseMemObject(cl_segments);
+	if (cl_round_keys)
+		clReleaseMemObject(cl_round_keys);
+	if (table)
+		free(table);
+	if (round_keys)
+		free(round_keys);
+
+	if (!ok) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+//! A chunk in flight in the streaming mode, see \ref paes_engine_stream.
+typedef struct {
+	cl_command_queue command_queue;	//!< every chunk has its own queue, so that the chunks overlap
+	cl_mem cl_buffer;
+	cl_uchar *data;		//!< the host copy of the chunk, or the chunk itself with the zero-copy buffers
+	void *mapped;		//!< the host pointer of the mapped zero-copy buffer, NULL if it isn't mapped
+	size_t size;		//!< the chunk size, 0 if the slot is free
+	cl_event event_write, event_execute, event_read;
+} stream_slot;
+
+int paes_engine_stream(paes_engine * paes, int input, int output, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_sector, size_t chunk_size, unsigned depth)
+{
+	/* All these variables are defined here, getting NULL if they're pointers,
+	   to avoid error in case of a premature jump to the cleanup label. */
+	stream_slot *slots = NULL;
+	cl_kernel kernel;
+	cl_int error, error1;
+	double write_time = 0, execute_time = 0, read_time = 0;
+	bool ok = 1;		// By default, everything is fine.
+
+	engine = resolve_engine(paes, engine, layout, chaining);
+	printf("Engine is %s\n", get_aes_engine_name(engine));
+	if (!check_run(size, engine, distribution, layout, chaining, sector_size))
+		return -1;
+	if ((chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) || layout != AES_LAYOUT_LINEAR || depth == 0) {
+		fprintf(stderr, "ERROR: the streaming mode supports only the %s, %s and %s chainings, with the %s layout.\n", get_aes_chaining_name(AES_CHAINING_ECB), get_aes_chaining_name(AES_CHAINING_CTR), get_aes_chaining_name(AES_CHAINING_XTS), get_aes_layout_name(AES_LAYOUT_LINEAR));
+		return -1;
+	}
+
+	/* The chunks are made of whole XTS sectors, or of whole blocks for the
+	   other chainings, so that every chunk can be processed on its own; the
+	   remainder that's too short for a chunk of its own goes with the last
+	   chunk, since e.g. an XTS sector can't be shorter than a block. */
+	size_t granularity = chaining == AES_CHAINING_XTS ? sector_size : AES_BLOCK_SIZE;
+	if (chunk_size + granularity > paes->max_buffer_size)
+		chunk_size = (size_t) paes->max_buffer_size - granularity;
+	chunk_size -= chunk_size % granularity;
+	if (chunk_size == 0)
+		chunk_size = granularity;
+	printf("Chunk size is %lu bytes, with %u chunks in flight\n", (long unsigned) chunk_size, depth);
+
+	/* With the zero-copy buffers the host fills a chunk while its buffer is
+	   mapped, and gets the results by mapping it again after the kernel. */
+	error = write_round_keys(paes, key, tweak_key, chaining);
+	kernel = get_kernel(paes, get_kernel_name(engine, mode, chaining), &error1);
+	error |= error1;
+	slots = (stream_slot *) calloc(depth, sizeof(stream_slot));
+	for (unsigned i = 0; i < depth && error == CL_SUCCESS; ++i) {
+		size_t capacity = sizeof(cl_uchar) * (chunk_size + granularity);
+		slots[i].data = allocate_buffer(capacity);
+		slots[i].command_queue = clCreateCommandQueue(paes->context, paes->devices[0], CL_QUEUE_PROFILING_ENABLE, &error);
+		if (error == CL_SUCCESS && paes->zero_copy) {
+			slots[i].cl_buffer = clCreateBuffer(paes->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, capacity, slots[i].data, &error);
+			if (error == CL_SUCCESS)
+				slots[i].mapped = clEnqueueMapBuffer(slots[i].command_queue, slots[i].cl_buffer, CL_TRUE, CL_MAP_WRITE, 0, capacity, 0, NULL, NULL, &error);
+		} else if (error == CL_SUCCESS) {
+			slots[i].cl_buffer = clCreateBuffer(paes->context, CL_MEM_READ_WRITE, capacity, NULL, &error);
+		}
+	}
+	printf("clCreateBuffer & co...\n");
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clCreateBuffer, error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
+
+	/* The slots are used in turn: the oldest chunk is waited for and written
+	   while the newer ones are still being copied or processed by the device,
+	   then its slot gets the next chunk read from the input file. */
+	size_t offset = 0;
+	unsigned in_flight = 0;
+	for (unsigned i = 0; offset < size || in_flight > 0; i = (i + 1) % depth) {
+		stream_slot *slot = &slots[i];
+		if (slot->size > 0) {
+			error = clWaitForEvents(1, &slot->event_read);
+			if (error != CL_SUCCESS) {
+				fprintf(stderr, "ERROR: clWaitForEvents, error code %d\n", error);
+				ok = 0;
+				goto cleanup;
+			}
+			write_time += execution_time_msecs(slot->event_write);
+			execute_time += execution_time_msecs(slot->event_execute);
+			read_time += execution_time_msecs(slot->event_read);
+			if (slot->event_write)
+				clReleaseEvent(slot->event_write);
+			clReleaseEvent(slot->event_execute);
+			clReleaseEvent(slot->event_read);
+			slot->event_write = slot->event_execute = slot->event_read = NULL;
+			if (!write_fully(output, slot->data, slot->size)) {
+				fprintf(stderr, "ERROR: unable to write to the output file.\n");
+				ok = 0;
+				goto cleanup;
+			}
+			slot->size = 0;
+			--in_flight;
+		}
+		if (offset == size)
+			continue;
+
+		size_t length = size - offset;
+		if (length >= chunk_size + granularity)
+			length = chunk_size;
+		if (!read_fully(input, slot->data, length)) {
+			fprintf(stderr, "ERROR: unable to read from the input file.\n");
+			ok = 0;
+			goto cleanup;
+		}
+
+		size_t global_size, local_size;
+		get_work_sizes(paes, engine, length / AES_BLOCK_SIZE, &global_size, &local_size);
+		cl_ulong chunk_first_sector = chaining == AES_CHAINING_XTS ? first_sector + offset / sector_size : first_sector;
+		error = set_kernel_arguments(paes, kernel, NULL, NULL, slot->cl_buffer, paes->cl_round_key, paes->cl_tweak_round_key, length, mode, engine, distribution, layout, chaining, iv, offset / AES_BLOCK_SIZE, sector_size, chunk_first_sector, local_size, NULL);
+		if (slot->mapped) {
+			error |= clEnqueueUnmapMemObject(slot->command_queue, slot->cl_buffer, slot->mapped, 0, NULL, NULL);
+			slot->mapped = NULL;
+		} else {
+			error |= clEnqueueWriteBuffer(slot->command_queue, slot->cl_buffer, CL_FALSE, 0, sizeof(cl_uchar) * length, slot->data, 0, NULL, &slot->event_write);
+		}
+		error |= clEnqueueNDRangeKernel(slot->command_queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, &slot->event_execute);
+		if (paes->zero_copy)
+			slot->mapped = clEnqueueMapBuffer(slot->command_queue, slot->cl_buffer, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(cl_uchar) * (chunk_size + granularity), 0, NULL, &slot->event_read, &error1);
+		else
+			error1 = clEnqueueReadBuffer(slot->command_queue, slot->cl_buffer, CL_FALSE, 0, sizeof(cl_uchar) * length, slot->data, 0, NULL, &slot->event_read);
+		error |= error1;
+		error |= clFlush(slot->command_queue);
+		if (error != CL_SUCCESS) {
+			fprintf(stderr, "ERROR: clEnqueueNDRangeKernel, error code %d\n", error);
+			ok = 0;
+			goto cleanup;
+		}
+		slot->size = length;
+		offset += length;
+		++in_flight;
+	}
+
+	printf("Encrypt time:\t%.3f ms\n", execute_time);
+	printf("Write time:\t%.3f ms\n", write_time);
+	printf("Read time:\t%.3f ms\n", read_time);
+
+      cleanup:
+	for (unsigned i = 0; slots != NULL && i < depth; ++i) {
+		if (slots[i].mapped)
+			clEnqueueUnmapMemObject(slots[i].command_queue, slots[i].cl_buffer, slots[i].mapped, 0, NULL, NULL);
+		if (slots[i].command_queue)
+			clFinish(slots[i].command_queue);
+		if (slots[i].event_write)
+			clReleaseEvent(slots[i].event_write);
+		if (slots[i].event_execute)
+			clReleaseEvent(slots[i].event_execute);
+		if (slots[i].event_read)
+			clReleaseEvent(slots[i].event_read);
+		if (slots[i].cl_buffer)
+			clReleaseMemObject(slots[i].cl_buffer);
+		if (slots[i].command_queue)
+			clReleaseCommandQueue(slots[i].command_queue);
+		free(slots[i].data);
+	}
+	free(slots);
+
+	if (!ok) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+//! An asynchronous job, see \ref paes_submit.
+struct paes_job {
+	paes_engine *paes;
+	cl_mem cl_buffer;
+	cl_mem cl_round_key;	//!< every job has its own keys, so that the jobs in flight can have different ones
+	cl_mem cl_tweak_round_key;
+	cl_event event_write, event_execute, event_read;
+	paes_job_callback callback;
+	void *user_data;
+	pthread_mutex_t mutex;
+	pthread_cond_t finished;
+	bool done;		//!< whether the data is back in the host buffer and the callback has returned
+	int result;		//!< -1 if something went wrong, 0 otherwise; it's meaningful only when done
+};
+
+/**
+ * Marks a job as done, after calling its callback; it's called by the OpenCL runtime, on a thread
+ * of its own, when the data has been read back.
+ * \param event the read event of the job
+ * \param status CL_COMPLETE, or a negative error code if a command of the job failed
+ * \param user_data the job
+ */
+static void CL_CALLBACK finish_job(cl_event event, cl_int status, void *user_data)
+{
+	paes_job *job = (paes_job *) user_data;
+	int result = status == CL_COMPLETE ? 0 : -1;
+	(void) event;
+
+	if (job->callback)
+		job->callback(job, result, job->user_data);
+	pthread_mutex_lock(&job->mutex);
+	job->result = result;
+	job->done = true;
+	pthread_cond_broadcast(&job->finished);
+	pthread_mutex_unlock(&job->mutex);
+}
+
+/**
+ * Releases every OpenCL object of a job, and the job itself, after its commands are over.
+ */
+static void release_job(paes_job * job)
+{
+	cl_event events[3];
+	cl_uint count = 0;
+	if (job->event_write)
+		events[count++] = job->event_write;
+	if (job->event_execute)
+		events[count++] = job->event_execute;
+	if (job->event_read)
+		events[count++] = job->event_read;
+	if (count > 0)
+		clWaitForEvents(count, events);
+	for (cl_uint i = 0; i < count; ++i)
+		clReleaseEvent(events[i]);
+	if (job->cl_buffer)
+		clReleaseMemObject(job->cl_buffer);
+	if (job->cl_round_key)
+		clReleaseMemObject(job->cl_round_key);
+	if (job->cl_tweak_round_key)
+		clReleaseMemObject(job->cl_tweak_round_key);
+	pthread_cond_destroy(&job->finished);
+	pthread_mutex_destroy(&job->mutex);
+	free(job);
+}
+
+paes_job *paes_submit(paes_engine * paes, cl_uchar * buffer, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_sector, paes_job_callback callback, void *user_data)
+{
+	cl_int error, error1;
+	cl_kernel kernel;
+
+	engine = resolve_engine(paes, engine, layout, chaining);
+	if (!check_run(size, engine, distribution, layout, chaining, sector_size))
+		return NULL;
+	if ((chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) || layout != AES_LAYOUT_LINEAR) {
+		fprintf(stderr, "ERROR: the asynchronous jobs support only the %s, %s and %s chainings, with the %s layout.\n", get_aes_chaining_name(AES_CHAINING_ECB), get_aes_chaining_name(AES_CHAINING_CTR), get_aes_chaining_name(AES_CHAINING_XTS), get_aes_layout_name(AES_LAYOUT_LINEAR));
+		return NULL;
+	}
+	if (size > paes->max_buffer_size) {
+		fprintf(stderr, "ERROR: the device can't hold more than %llu bytes at once.\n", (unsigned long long) paes->max_buffer_size);
+		return NULL;
+	}
+
+	/* The jobs have a queue of their own, out of order if the device allows
+	   it: each job orders its own commands with the events, so that many jobs
+	   can run at once. */
+	if (paes->job_queue == NULL) {
+		cl_command_queue_properties properties = 0;
+		clGetDeviceInfo(paes->devices[0], CL_DEVICE_QUEUE_PROPERTIES, sizeof(properties), &properties, NULL);
+		paes->job_queue = clCreateCommandQueue(paes->context, paes->devices[0], CL_QUEUE_PROFILING_ENABLE | (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE), &error);
+		if (error != CL_SUCCESS) {
+			fprintf(stderr, "ERROR: clCreateCommandQueue, error code %d\n", error);
+			paes->job_queue = NULL;
+			return NULL;
+		}
+	}
+
+	paes_job *job = (paes_job *) calloc(1, sizeof(paes_job));
+	job->paes = paes;
+	job->callback = callback;
+	job->user_data = user_data;
+	pthread_mutex_init(&job->mutex, NULL);
+	pthread_cond_init(&job->finished, NULL);
+
+	// There's nothing to do, but the callback is called anyway
+	if (size == 0) {
+		finish_job(NULL, CL_COMPLETE, job);
+		return job;
+	}
+
+	// The host buffers of the keys can be released as soon as they're copied
+	cl_uint round_key_size = get_round_key_size(paes->key_size_bits);
+	cl_uchar *round_key = key_expansion(key, paes->key_size_bits, chaining);
+	job->cl_round_key = clCreateBuffer(paes->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uchar) * 2 * round_key_size, round_key, &error);
+	free(round_key);
+	if (chaining == AES_CHAINING_XTS) {
+		cl_uchar *tweak_round_key = key_expansion(tweak_key, paes->key_size_bits, chaining);
+		job->cl_tweak_round_key = clCreateBuffer(paes->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uchar) * round_key_size, tweak_round_key, &error1);
+		free(tweak_round_key);
+		error |= error1;
+	}
+	job->cl_buffer = clCreateBuffer(paes->context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * size, NULL, &error1);
+	error |= error1;
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clCreateBuffer, error code %d\n", error);
+		goto failure;
+	}
+
+	size_t global_size, local_size;
+	get_work_sizes(paes, engine, size / AES_BLOCK_SIZE, &global_size, &local_size);
+	kernel = get_kernel(paes, get_kernel_name(engine, mode, chaining), &error);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clCreateKernel, error code %d\n", error);
+		goto failure;
+	}
+
+	error = set_kernel_arguments(paes, kernel, NULL, NULL, job->cl_buffer, job->cl_round_key, job->cl_tweak_round_key, size, mode, engine, distribution, layout, chaining, iv, 0, sector_size, first_sector, local_size, NULL);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clSetKernelArg, error code %d\n", error);
+		goto failure;
+	}
+
+	error = clEnqueueWriteBuffer(paes->job_queue, job->cl_buffer, CL_FALSE, 0, sizeof(cl_uchar) * size, buffer, 0, NULL, &job->event_write);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clEnqueueWriteBuffer, error code %d\n", error);
+		goto failure;
+	}
+
+	error = clEnqueueNDRangeKernel(paes->job_queue, kernel, 1, NULL, &global_size, &local_size, 1, &job->event_write, &job->event_execute);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clEnqueueNDRangeKernel, error code %d\n", error);
+		goto failure;
+	}
+
+	error = clEnqueueReadBuffer(paes->job_queue, job->cl_buffer, CL_FALSE, 0, sizeof(cl_uchar) * size, buffer, 1, &job->event_execute, &job->event_read);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clEnqueueReadBuffer, error code %d\n", error);
+		goto failure;
+	}
+
+	error = clFlush(paes->job_queue);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clFlush, error code %d\n", error);
+		goto failure;
+	}
+
+	// The callback is the last thing, since it could be called at once
+	error = clSetEventCallback(job->event_read, CL_COMPLETE, finish_job, job);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clSetEventCallback, error code %d\n", error);
+		goto failure;
+	}
+
+	return job;
+
+      failure:
+	release_job(job);
+	return NULL;
+}
+
+bool paes_poll(paes_job * job)
+{
+	pthread_mutex_lock(&job->mutex);
+	bool done = job->done;
+	pthread_mutex_unlock(&job->mutex);
+	return done;
+}
+
+int paes_wait(paes_job * job)
+{
+	pthread_mutex_lock(&job->mutex);
+	while (!job->done)
+		pthread_cond_wait(&job->finished, &job->mutex);
+	int result = job->result;
+	pthread_mutex_unlock(&job->mutex);
+
+	release_job(job);
+	return result;
+}
+
+void paes_engine_destroy(paes_engine * paes)
+{
+	printf("%sCleanup... \n", paes->prefix);
+
+	for (size_t i = 0; i < PAES_KERNELS; ++i)
+		if (paes->kernels[i])
+			clReleaseKernel(paes->kernels[i]);
+	if (paes->cl_buffer)
+		clReleaseMemObject(paes->cl_buffer);
+	if (paes->cl_input)
+		clReleaseMemObject(paes->cl_input);
+	if (paes->cl_round_key)
+		clReleaseMemObject(paes->cl_round_key);
+	if (paes->cl_tweak_round_key)
+		clReleaseMemObject(paes->cl_tweak_round_key);
+	if (paes->cl_ghash_table)
+		clReleaseMemObject(paes->cl_ghash_table);
+	if (paes->program)
+		clReleaseProgram(paes->program);
+	if (paes->command_queue)
+		clReleaseCommandQueue(paes->command_queue);
+	if (paes->job_queue)
+		clReleaseCommandQueue(paes->job_queue);
+	if (paes->context)
+		clReleaseContext(paes->context);
+	if (paes->devices)
+		free(paes->devices);
+	free(paes);
+}
+
+//! The work shared by the devices with OPENCL_DEVICE_ALL, see \ref apply_aes_on_all_devices.
+typedef struct {
+	pthread_mutex_t mutex;	//!< it protects next and failed
+	size_t next;		//!< the offset of the first byte that no device has taken yet
+	bool failed;		//!< a device failed, so the others stop taking chunks too
+	size_t chunk_size;	//!< a multiple of granularity
+	size_t granularity;	//!< the chunks are made of whole blocks, or whole sectors for XTS
+	cl_uchar *buffer;
+	size_t size;
+	aes_mode mode;
+	aes_engine engine;
+	aes_distribution distribution;
+	aes_layout layout;
+	aes_chaining chaining;
+	cl_uchar *iv, *key, *tweak_key;
+	unsigned key_size_bits;
+	cl_uint sector_size;
+	cl_ulong first_sector;
+	const char *defines;
+	size_t global_size, local_size;
+} shared_work;
+
+//! A device that takes its chunks from a \ref shared_work, in its own thread.
+typedef struct {
+	shared_work *work;
+	cl_platform_id platform;
+	cl_device_id device;
+	pthread_t thread;
+	bool started;		//!< the thread has been created, so it must be joined
+	bool ready;		//!< the engine has been created
+	char prefix[16];	//!< the start of the lines printed while creating the engine, e.g. "[1] "
+	unsigned chunks;	//!< how many chunks the device has processed
+	size_t bytes;		//!< how many bytes the device has processed
+	double busy_msecs;	//!< how long the device has been processing its chunks, copies included
+	double times[3];	//!< the encrypt, write and read times, as measured by the OpenCL events
+} device_worker;
+
+//! Returns the current time, in milliseconds.
+static double now_msecs(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1.0E3 + now.tv_usec * 1.0E-3;
+}
+
+/**
+ * The thread of a \ref device_worker: it builds the program for its device, and then takes a chunk
+ * after the other from the shared work until there are none left. If the engine can't be created
+ * the thread just quits, and the other devices process its share.
+ */
+static void *device_worker_thread(void *argument)
+{
+	device_worker *worker = (device_worker *) argument;
+	shared_work *work = worker->work;
+
+	paes_engine *paes = create_engine(worker->platform, worker->device, work->key_size_bits, work->defines, true, worker->prefix);
+	if (paes == NULL)
+		return NULL;
+	paes_engine_set_work_sizes(paes, work->global_size, work->local_size);
+	worker->ready = true;
+
+	// A device with less memory takes smaller chunks, still made of whole sectors
+	size_t chunk_size = work->chunk_size;
+	if (chunk_size > paes->max_buffer_size)
+		chunk_size = (size_t) paes->max_buffer_size / work->granularity * work->granularity;
+
+	for (;;) {
+		pthread_mutex_lock(&work->mutex);
+		size_t offset = work->next;
+		size_t length = work->size - offset < chunk_size ? work->size - offset : chunk_size;
+		// A remainder shorter than a sector goes with the last chunk
+		if (work->size - offset - length < work->granularity)
+			length = work->size - offset;
+		if (work->failed)
+			length = 0;
+		work->next += length;
+		pthread_mutex_unlock(&work->mutex);
+		if (length == 0)
+			break;
+
+		double start = now_msecs();
+		int result = run_engine(paes, work->buffer + offset, length, work->mode, work->engine, work->distribution, work->layout, work->chaining, work->iv, work->key, work->tweak_key, work->sector_size, offset / AES_BLOCK_SIZE,
+					work->chaining == AES_CHAINING_XTS ? work->first_sector + offset / work->sector_size : work->first_sector, NULL, worker->times);
+		worker->busy_msecs += now_msecs() - start;
+		if (result == -1) {
+			pthread_mutex_lock(&work->mutex);
+			work->failed = true;
+			pthread_mutex_unlock(&work->mutex);
+			break;
+		}
+		++worker->chunks;
+		worker->bytes += length;
+	}
+
+	paes_engine_destroy(paes);
+	return NULL;
+}
+
+/**
+ * Encrypts or decrypts data with every device of every OpenCL platform at the same time: the data
+ * are split in chunks, and each device takes a new one as soon as it's done with the previous one,
+ * so that the faster devices process more of them. Only AES_CHAINING_ECB, AES_CHAINING_CTR and
+ * AES_CHAINING_XTS are supported, since the chunks are independent of each other; the parameters are
+ * the ones of \ref apply_aes.
+ * \return -1 if something went wrong, 0 otherwise
+ */
+static int apply_aes_on_all_devices(cl_uchar * buffer, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, unsigned key_size_bits, cl_uint sector_size, cl_ulong first_sector, const char *defines, size_t global_size, size_t local_size)
+{
+	cl_uint num_platforms, num_devices = 0;
+	cl_platform_id *platforms = NULL;
+	device_worker *workers = NULL;
+	cl_int error;
+	bool ok = 1;		// By default, everything is fine.
+
+	if (!check_run(size, engine, distribution, layout, chaining, sector_size))
+		return -1;
+	if (chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) {
+		fprintf(stderr, "ERROR: the %s chaining can't be shared among the devices.\n", get_aes_chaining_name(chaining));
+		return -1;
+	}
+
+	shared_work work = { PTHREAD_MUTEX_INITIALIZER, 0, false, 0, chaining == AES_CHAINING_XTS ? sector_size : AES_BLOCK_SIZE, buffer, size, mode, engine, distribution, layout, chaining,
+		iv, key, tweak_key, key_size_bits, sector_size, first_sector, defines, global_size, local_size
+	};
+
+	error = clGetPlatformIDs(0, NULL, &num_platforms);
+	if (error != CL_SUCCESS || num_platforms == 0) {
+		fprintf(stderr, "ERROR: clGetPlatformIDs (num_platforms), error code %d\n", error);
+		return -1;
+	}
+	platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * num_platforms);
+	error = clGetPlatformIDs(num_platforms, platforms, NULL);
+	if (error != CL_SUCCESS) {
+		fprintf(stderr, "ERROR: clGetPlatformIDs (platforms), error code %d\n", error);
+		ok = 0;
+		goto cleanup;
+	}
+
+	// Every device of every platform gets a worker; a platform without devices is fine
+	for (cl_uint i = 0; i < num_platforms; ++i) {
+		cl_uint platform_devices = 0;
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &platform_devices) != CL_SUCCESS || platform_devices == 0)
+			continue;
+		cl_device_id *devices = (cl_device_id *) malloc(sizeof(cl_device_id) * platform_devices);
+		clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, platform_devices, devices, NULL);
+		workers = (device_worker *) realloc(workers, sizeof(device_worker) * (num_devices + platform_devices));
+		for (cl_uint j = 0; j < platform_devices; ++j) {
+			memset(&workers[num_devices], 0, sizeof(device_worker));
+			workers[num_devices].work = &work;
+			workers[num_devices].platform = platforms[i];
+			workers[num_devices].device = devices[j];
+			// The numbers of the devices in the summary below
+			snprintf(workers[num_devices].prefix, sizeof(workers[num_devices].prefix), "[%u] ", (unsigned) num_devices);
+			++num_devices;
+		}
+		free(devices);
+	}
+	printf("clGetDeviceIDs...\n");
+	if (num_devices == 0) {
+		fprintf(stderr, "ERROR: there are no OpenCL devices.\n");
+		ok = 0;
+		goto cleanup;
+	}
+
+	/* Many chunks per device let the faster devices take more of them, but
+	   each chunk costs a launch and the copies, so they can't be too small. */
+	work.chunk_size = size / (num_devices * MULTI_DEVICE_CHUNKS_PER_DEVICE);
+	if (work.chunk_size < MULTI_DEVICE_MIN_CHUNK_SIZE)
+		work.chunk_size = MULTI_DEVICE_MIN_CHUNK_SIZE;
+	work.chunk_size = (work.chunk_size + work.granularity - 1) / work.granularity * work.granularity;
+	printf("Chunk size is %lu\n", (long unsigned) work.chunk_size);
+
+	double start = now_msecs();
+	for (cl_uint i = 0; i < num_devices; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, device_worker_thread, &workers[i]) == 0)
+			workers[i].started = true;
+		else
+			fprintf(stderr, "ERROR: unable to start the thread of device %u.\n", (unsigned) i);
+	}
+	for (cl_uint i = 0; i < num_devices; ++i)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	double elapsed = now_msecs() - start;
+
+	// When no engine could be created nobody took the data
+	if (work.failed || work.next < size) {
+		fprintf(stderr, "ERROR: the devices couldn't process the whole data.\n");
+		ok = 0;
+		goto cleanup;
+	}
+
+	double times[3] = { 0, 0, 0 };
+	printf("\nDevices:\n");
+	for (cl_uint i = 0; i < num_devices; ++i) {
+		char device_string[1024];
+		clGetDeviceInfo(workers[i].device, CL_DEVICE_NAME, sizeof(device_string), &device_string, NULL);
+		if (!workers[i].ready) {
+			printf("   %u. %s: unavailable\n", (unsigned) i, device_string);
+			continue;
+		}
+		printf("   %u. %s: %u chunks, %lu bytes, %.3f MB/s\n", (unsigned) i, device_string, workers[i].chunks, (long unsigned) workers[i].bytes, workers[i].busy_msecs > 0 ? workers[i].bytes / workers[i].busy_msecs * 1.0E-3 : 0.0);
+		for (unsigned j = 0; j < 3; ++j)
+			times[j] += workers[i].times[j];
+	}
+	printf("   Total: %lu bytes in %.3f ms, %.3f MB/s\n\n", (long unsigned) size, elapsed, elapsed > 0 ? size / elapsed * 1.0E-3 : 0.0);
+
+	// The times are summed over the devices, as in the streaming mode
+	printf("Encrypt time:\t%.3f ms\n", times[0]);
+	printf("Write time:\t%.3f ms\n", times[1]);
+	printf("Read time:\t%.3f ms\n", times[2]);
+
+      cleanup:
+	if (platforms)
+		free(platforms);
+	if (workers)
+		free(workers);
+
+	if (!ok) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * Encrypts or decrypts data with the native engine (see paes_native.h), with the same round keys
+ * of the OpenCL engines; the parameters are the ones of \ref apply_aes.
+ * \return -1 if something went wrong (including a wrong GCM tag), 0 otherwise
+ */
+static int apply_aes_natively(cl_uchar * buffer, size_t size, aes_mode mode, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, unsigned key_size_bits, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag)
+{
+	cl_uchar computed_tag[GCM_TAG_SIZE];
+
+	if (!check_run(size, AES_ENGINE_AUTO, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, chaining, sector_size))
+		return -1;
+	printf("Engine is %s %s\n", get_opencl_device_name(OPENCL_DEVICE_NATIVE), native_implementation_name());
+
+	cl_uchar *round_key = key_expansion(key, key_size_bits, chaining);
+	cl_uchar *tweak_round_key = chaining == AES_CHAINING_XTS ? key_expansion(tweak_key, key_size_bits, chaining) : NULL;
+	double start = now_msecs();
+	unsigned threads = native_aes(buffer, size, mode, chaining, round_key, tweak_round_key, key_size_bits, iv, sector_size, first_sector, computed_tag);
+	double elapsed = now_msecs() - start;
+	free(round_key);
+	if (tweak_round_key)
+		free(tweak_round_key);
+	printf("Threads are %u\n\n", threads);
+
+	if (chaining == AES_CHAINING_GCM && !check_gcm_tag(mode, computed_tag, tag))
+		return -1;
+
+	// There are no copies to and from a device
+	printf("Encrypt time:\t%.3f ms\n", elapsed);
+	printf("Write time:\t%.3f ms\n", 0.0);
+	printf("Read time:\t%.3f ms\n", 0.0);
+	return 0;
+}
+
+/**
+ * Measures how long the native engine and a device take to encrypt a block, and sizes growing by
+ * TUNE_CROSSOVER_STEP up to size bytes, each time from the creation of the engine to its destruction,
+ * so that the setup of the device counts too, and finds the crossover of \ref OPENCL_DEVICE_AUTO: the
+ * difference of the two times is taken as linear between two sizes, and the crossover is where it
+ * crosses zero, so that a curve, e.g. when the data stops fitting in the caches, is followed; past
+ * the biggest size the line of the last two goes on. Only the ECB encryption is measured, so the
+ * crossover is an estimate for the other chainings, and for the decryption, which are assumed to
+ * scale the same way on both sides.
+ * \param engine the engine run by the device, with its profile
+ * \param buffer the data, at least size bytes
+ * \param crossover where the crossover in bytes will be stored: 0 if the device is always faster,
+ *        (size_t) -1 if it never is
+ * \return false if the device couldn't run, true otherwise
+ */
+static bool measure_crossover(cl_platform_id platform, cl_device_id device, unsigned key_size_bits, aes_engine engine, const engine_profile * profile, cl_uchar * buffer, size_t size, cl_uchar * key, cl_uchar * iv, size_t * crossover)
+{
+	size_t sizes[TUNE_CROSSOVER_SIZES];
+	double native_msecs[TUNE_CROSSOVER_SIZES], device_msecs[TUNE_CROSSOVER_SIZES];
+	cl_uchar tag[GCM_TAG_SIZE];
+	unsigned count = 0;
+
+	for (size_t bytes = AES_BLOCK_SIZE; count < TUNE_CROSSOVER_SIZES - 1 && bytes < size; bytes *= TUNE_CROSSOVER_STEP)
+		sizes[count++] = bytes;
+	sizes[count++] = size;
+
+	cl_uchar *round_key = key_expansion(key, key_size_bits, AES_CHAINING_ECB);
+	for (unsigned i = 0; i < count; ++i) {
+		for (unsigned run = 0; run < TUNE_RUNS; ++run) {
+			double start = now_msecs();
+			native_aes(buffer, sizes[i], AES_MODE_ENCRYPT, AES_CHAINING_ECB, round_key, NULL, key_size_bits, iv, 0, 0, tag);
+			double elapsed = now_msecs() - start;
+			if (run == 0 || elapsed < native_msecs[i])
+				native_msecs[i] = elapsed;
+
+			double times[3] = { 0, 0, 0 };
+			start = now_msecs();
+			paes_engine *paes = create_engine(platform, device, key_size_bits, profile->defines, false, "");
+			if (paes == NULL) {
+				free(round_key);
+				return false;
+			}
+			paes_engine_set_work_sizes(paes, profile->global_size, profile->local_size);
+			int result = run_engine(paes, buffer, sizes[i], AES_MODE_ENCRYPT, engine, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, AES_CHAINING_ECB, iv, key, key, 0, 0, 0, NULL, times);
+			paes_engine_destroy(paes);
+			elapsed = now_msecs() - start;
+			if (result == -1) {
+				free(round_key);
+				return false;
+			}
+			if (run == 0 || elapsed < device_msecs[i])
+				device_msecs[i] = elapsed;
+		}
+		printf("%10lu bytes: %s %s %.3f ms, %s %s %.3f ms with the setup\n", (long unsigned) sizes[i], get_opencl_device_name(OPENCL_DEVICE_NATIVE), native_implementation_name(), native_msecs[i], get_aes_engine_name(engine), profile->defines, device_msecs[i]);
+	}
+	free(round_key);
+
+	// How many milliseconds the device loses, at the first size where it doesn't, and at the one before
+	unsigned i = 1;
+	while (i < count - 1 && device_msecs[i] - native_msecs[i] > 0)
+		++i;
+	double lost = device_msecs[0] - native_msecs[0];
+	if (count == 1 || lost <= 0) {
+		*crossover = lost <= 0 ? 0 : (size_t) -1;
+		return true;
+	}
+	double before = device_msecs[i - 1] - native_msecs[i - 1], after = device_msecs[i] - native_msecs[i];
+	double meet = after < before ? (double) sizes[i - 1] + before * (double) (sizes[i] - sizes[i - 1]) / (before - after) : 0;
+	if (after >= before || meet >= (double) ((size_t) -1))
+		*crossover = (size_t) -1;
+	else
+		*crossover = (size_t) meet;
+	return true;
+}
+
+/**
+ * Finds the crossover of the device picked by \ref OPENCL_DEVICE_AUTO and stores it for the next
+ * runs (see \ref get_crossover_file): it's the one of the device profile, if the device has been
+ * tuned, otherwise it's measured now, once, with the default configuration of AES_ENGINE_PRIVATE.
+ * Without the cache nothing can be stored, so DISPATCH_DEFAULT_CROSSOVER is taken instead of
+ * measuring at every run; it's taken as well if the measure fails.
+ * \return the crossover in bytes
+ */
+static size_t find_crossover(cl_platform_id platform, cl_device_id device, unsigned key_size_bits)
+{
+	engine_profile profile[AES_ENGINE_AUTO];
+	size_t crossover = DISPATCH_DEFAULT_CROSSOVER;
+	char file_name[1024];
+	cl_uchar key[32], iv[AES_IV_SIZE];
+
+	if (!get_crossover_file(key_size_bits, file_name, sizeof(file_name)))
+		return crossover;
+	memset(profile, 0, sizeof(profile));
+	if (!read_profile(device, key_size_bits, profile, &crossover, file_name, sizeof(file_name))) {
+		// As much data as the tuner encrypts, if the device can take it
+		cl_ulong max_buffer_size = 0;
+		clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_buffer_size), &max_buffer_size, NULL);
+		size_t size = max_buffer_size >= TUNE_DEFAULT_SIZE ? TUNE_DEFAULT_SIZE : (size_t) (max_buffer_size - max_buffer_size % AES_BLOCK_SIZE);
+		if (size == 0)
+			return crossover;
+
+		printf("Measuring the crossover, once\n");
+		memset(key, 0x5a, sizeof(key));
+		memset(iv, 0, sizeof(iv));
+		cl_uchar *buffer = allocate_buffer(size);
+		for (size_t i = 0; i < size; ++i)
+			buffer[i] = (cl_uchar) (i * 31);
+		bool measured = measure_crossover(platform, device, key_size_bits, AES_ENGINE_PRIVATE, &profile[AES_ENGINE_PRIVATE], buffer, size, key, iv, &crossover);
+		free(buffer);
+		if (!measured)
+			return DISPATCH_DEFAULT_CROSSOVER;
+	}
+	store_crossover(device, key_size_bits, crossover);
+	return crossover;
+}
+
+/**
+ * Decides where \ref OPENCL_DEVICE_AUTO runs: the inputs smaller than the crossover (see \ref find_crossover)
+ * go to the native engine, which doesn't pay for the context, the program and the copies. Once the
+ * crossover is stored, OpenCL isn't touched for them at all. The data go to the device anyway if
+ * the user chose something that only the kernels have: an engine, the distribution, the layout,
+ * the kernel variants or the work sizes. Without an OpenCL device, every input goes to the native
+ * engine, unless the user chose one of those. The other parameters are the ones of \ref apply_aes.
+ * \param platform where the platform of the device will be stored, if it's looked for
+ * \param device_id where the device will be stored, if it's looked for
+ * \param found where true will be stored if the device has been found, false if it's missing or it hasn't been looked for
+ * \return true if the native engine should run, false if the device should
+ */
+static bool dispatch_natively(unsigned key_size_bits, size_t size, aes_engine engine, aes_distribution distribution, aes_layout layout, const char *defines, size_t global_size, size_t local_size, cl_platform_id * platform, cl_device_id * device_id, bool * found)
+{
+	size_t crossover;
+
+	*found = false;
+	if (engine != AES_ENGINE_AUTO || distribution != AES_DISTRIBUTION_CONTIGUOUS || layout != AES_LAYOUT_LINEAR || (defines != NULL && defines[0] != '\0') || global_size != 0 || local_size != 0)
+		return false;
+	if (!read_crossover(key_size_bits, &crossover)) {
+		*found = find_device(OPENCL_DEVICE_AUTO, platform, device_id);
+		if (!*found) {
+			printf("There's no OpenCL device, so the native engine runs\n");
+			return true;
+		}
+		crossover = find_crossover(*platform, *device_id, key_size_bits);
+	}
+	printf("Crossover is %lu bytes\n", (long unsigned) crossover);
+	return size < crossover;
+}
+
+int apply_aes(cl_uchar * buffer, size_t size, opencl_device device, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, unsigned key_size_bits, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag, const char *defines, size_t global_size, size_t local_size)
+{
+	cl_platform_id platform;
+	cl_device_id device_id;
+
+	if (device == OPENCL_DEVICE_NATIVE)
+		return apply_aes_natively(buffer, size, mode, chaining, iv, key, tweak_key, key_size_bits, sector_size, first_sector, tag);
+	if (device == OPENCL_DEVICE_ALL)
+		return apply_aes_on_all_devices(buffer, size, mode, engine, distribution, layout, chaining, iv, key, tweak_key, key_size_bits, sector_size, first_sector, defines, global_size, local_size);
+
+	bool found = false;
+	if (device == OPENCL_DEVICE_AUTO && dispatch_natively(key_size_bits, size, engine, distribution, layout, defines, global_size, local_size, &platform, &device_id, &found))
+		return apply_aes_natively(buffer, size, mode, chaining, iv, key, tweak_key, key_size_bits, sector_size, first_sector, tag);
+	if (!found && !find_device(device, &platform, &device_id))
+		return -1;
+
+	paes_engine *paes = create_engine(platform, device_id, key_size_bits, defines, true, "");
+	if (paes == NULL)
+		return -1;
+	paes_engine_set_work_sizes(paes, global_size, local_size);
+
+	int result = paes_engine_run(paes, buffer, size, mode, engine, distribution, layout, chaining, iv, key, tweak_key, sector_size, first_sector, tag);
+	paes_engine_destroy(paes);
+
+	return result;
+}
+
+int apply_aes_batch(cl_uchar * buffer, size_t size, const paes_segment * segments, size_t count, cl_uchar * keys, size_t key_count, opencl_device device, aes_mode mode, aes_distribution distribution, aes_chaining chaining, unsigned key_size_bits, cl_uint sector_size, const char *defines, size_t global_size, size_t local_size)
+{
+	cl_platform_id platform;
+	cl_device_id device_id;
+	cl_uchar tag[GCM_TAG_SIZE];
+
+	if (device == OPENCL_DEVICE_ALL) {
+		fprintf(stderr, "ERROR: the batch mode needs a single device.\n");
+		return -1;
+	}
+	if (device != OPENCL_DEVICE_NATIVE) {
+		bool found = false;
+		if (device != OPENCL_DEVICE_AUTO || !dispatch_natively(key_size_bits, size, AES_ENGINE_AUTO, distribution, AES_LAYOUT_LINEAR, defines, global_size, local_size, &platform, &device_id, &found)) {
+			if (!found && !find_device(device, &platform, &device_id))
+				return -1;
+			paes_engine *paes = create_engine(platform, device_id, key_size_bits, defines, true, "");
+			if (paes == NULL)
+				return -1;
+			paes_engine_set_work_sizes(paes, global_size, local_size);
+			int result = paes_engine_run_batch(paes, buffer, size, segments, count, keys, key_count, mode, distribution, chaining, sector_size);
+			paes_engine_destroy(paes);
+			return result;
+		}
+	}
+
+	// The native engine has no launches to save, so it takes a segment at a time
+	if (chaining != AES_CHAINING_ECB && chaining != AES_CHAINING_CTR && chaining != AES_CHAINING_XTS) {
+		fprintf(stderr, "ERROR: the %s chaining isn't supported by the batch mode.\n", get_aes_chaining_name(chaining));
+		return -1;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (!check_run(segments[i].length, AES_ENGINE_AUTO, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, chaining, sector_size))
+			return -1;
+		if (segments[i].key >= key_count) {
+			fprintf(stderr, "ERROR: segment %lu has the key %u, but there are %lu keys.\n", (long unsigned) i, (unsigned) segments[i].key, (long unsigned) key_count);
+			return -1;
+		}
+	}
+	printf("Engine is %s %s\n", get_opencl_device_name(OPENCL_DEVICE_NATIVE), native_implementation_name());
+	printf("Segments are %lu, keys are %lu\n\n", (long unsigned) count, (long unsigned) key_count);
+
+	// As in kernel_aes_batch, the keys are expanded again only when they change
+	size_t key_size = (chaining == AES_CHAINING_XTS ? 2 : 1) * key_size_bits / 8;
+	cl_uchar *round_key = NULL, *tweak_round_key = NULL;
+	double start = now_msecs();
+	for (size_t i = 0; i < count; ++i) {
+		if (round_key == NULL || segments[i].key != segments[i - 1].key) {
+			free(round_key);
+			free(tweak_round_key);
+			round_key = key_expansion(keys + segments[i].key * key_size, key_size_bits, chaining);
+			tweak_round_key = chaining == AES_CHAINING_XTS ? key_expansion(keys + segments[i].key * key_size + key_size_bits / 8, key_size_bits, chaining) : NULL;
+		}
+		native_aes(buffer + segments[i].offset, segments[i].length, mode, chaining, round_key, tweak_round_key, key_size_bits, segments[i].iv, sector_size, segments[i].first_sector, tag);
+	}
+	double elapsed = now_msecs() - start;
+	free(round_key);
+	free(tweak_round_key);
+
+	printf("Encrypt time:\t%.3f ms\n", elapsed);
+	printf("Write time:\t%.3f ms\n", 0.0);
+	printf("Read time:\t%.3f ms\n", 0.0);
+	return 0;
+}
+
+int paes_tune(opencl_device device, unsigned key_size_bits, size_t size)
+{
+	/* The kernel variants: each engine, also with the macros that change its
+	   speed; the T-table one with every interleave factor, so that the
+	   profile keeps the fastest one instead of the guess of the host. */
+	static const struct {
+		aes_engine engine;
+		const char *defines;
+	} variants[] = {
+		{AES_ENGINE_GLOBAL, ""}, {AES_ENGINE_PRIVATE, ""},
+		{AES_ENGINE_TTABLE, "-D INTERLEAVE=2"}, {AES_ENGINE_TTABLE, "-D INTERLEAVE=4"}, {AES_ENGINE_TTABLE, "-D INTERLEAVE=8"},
+		{AES_ENGINE_TTABLE, "-D INTERLEAVE=2 -D T_TABLE_COPIES=2"}, {AES_ENGINE_TTABLE, "-D INTERLEAVE=4 -D T_TABLE_COPIES=2"}, {AES_ENGINE_TTABLE, "-D INTERLEAVE=8 -D T_TABLE_COPIES=2"},
+		{AES_ENGINE_TTABLE, "-D INTERLEAVE=2 -D T_TABLE_COPIES=4"}, {AES_ENGINE_TTABLE, "-D INTERLEAVE=4 -D T_TABLE_COPIES=4"}, {AES_ENGINE_TTABLE, "-D INTERLEAVE=8 -D T_TABLE_COPIES=4"},
+		{AES_ENGINE_BITSLICE, ""}, {AES_ENGINE_BITSLICE, "-D BITSLICE_64"}
+	};
+	engine_profile best[AES_ENGINE_AUTO];
+	cl_uchar key[32], iv[AES_IV_SIZE];
+	cl_device_id device_id = NULL;
+	bool ok = 1;		// By default, everything is fine.
+
+	memset(best, 0, sizeof(best));
+	memset(key, 0x5a, sizeof(key));
+	memset(iv, 0, sizeof(iv));
+	size -= size % AES_BLOCK_SIZE;
+	if (size == 0)
+		size = AES_BLOCK_SIZE;
+	cl_ulong blocks = size / AES_BLOCK_SIZE;
+	cl_uchar *buffer = allocate_buffer(size);
+	for (size_t i = 0; i < size; ++i)
+		buffer[i] = (cl_uchar) (i * 31);
+
+	for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]) && ok; ++v) {
+		aes_engine engine = variants[v].engine;
+		// Without the profile, so that the old one doesn't change what's measured
+		paes_engine *paes = create_engine_of_type(device, key_size_bits, variants[v].defines, false);
+		if (paes == NULL) {
+			ok = 0;
+			break;
+		}
+		device_id = paes->devices[0];
+		if (size > paes->max_buffer_size) {
+			size = (size_t) paes->max_buffer_size - paes->max_buffer_size % AES_BLOCK_SIZE;
+			blocks = size / AES_BLOCK_SIZE;
+		}
+
+		/* The local work sizes are multiples of the one preferred by the
+		   kernel, up to the biggest that it can run with; the global ones
+		   give each compute unit more and more work groups. */
+		cl_int error;
+		size_t multiple = 1, max_local_size = 1;
+		cl_kernel kernel = get_kernel(paes, get_kernel_name(engine, AES_MODE_ENCRYPT, AES_CHAINING_ECB), &error);
+		if (error == CL_SUCCESS) {
+			clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_local_size), &max_local_size, NULL);
+#ifdef CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE
+			clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+#endif
+		}
+		if (multiple == 0)
+			multiple = 1;
+		if (max_local_size > TUNE_MAX_LOCAL_SIZE)
+			max_local_size = TUNE_MAX_LOCAL_SIZE;
+
+		for (size_t local_size = multiple; local_size <= max_local_size; local_size *= 2) {
+			for (size_t groups = 1; groups <= TUNE_MAX_GROUPS_PER_UNIT; groups *= 4) {
+				size_t global_size = paes->compute_units * groups * local_size;
+				// More work items than blocks would just idle
+				if (global_size > blocks && groups > 1)
+					break;
+
+				double fastest = 0;
+				paes_engine_set_work_sizes(paes, global_size, local_size);
+				for (unsigned run = 0; run < TUNE_RUNS; ++run) {
+					double times[3] = { 0, 0, 0 };
+					if (run_engine(paes, buffer, size, AES_MODE_ENCRYPT, engine, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, AES_CHAINING_ECB, iv, key, key, 0, 0, 0, NULL, times) == -1) {
+						fastest = 0;
+						break;
+					}
+					if (fastest == 0 || times[0] < fastest)
+						fastest = times[0];
+				}
+				if (fastest == 0) {
+					printf("%-8s %-36s global %7lu local %4lu: skipped\n", get_aes_engine_name(engine), variants[v].defines, (long unsigned) global_size, (long unsigned) local_size);
+					continue;
+				}
+
+				double throughput = size / fastest * 1.0E-3;
+				printf("%-8s %-36s global %7lu local %4lu: %.3f MB/s\n", get_aes_engine_name(engine), variants[v].defines, (long unsigned) global_size, (long unsigned) local_size, throughput);
+				if (throughput > best[engine].throughput) {
+					best[engine].tuned = true;
+					best[engine].global_size = global_size;
+					best[engine].local_size = local_size;
+					best[engine].throughput = throughput;
+					snprintf(best[engine].defines, sizeof(best[engine].defines), "%s", variants[v].defines);
+				}
+			}
+		}
+		paes_engine_destroy(paes);
+	}
+
+	/* The crossover of OPENCL_DEVICE_AUTO is measured with the fastest
+	   engine, the one that AES_ENGINE_AUTO picks from the new profile. */
+	size_t crossover = DISPATCH_DEFAULT_CROSSOVER;
+	if (ok) {
+		aes_engine fastest = AES_ENGINE_PRIVATE;
+		for (aes_engine engine = 0; engine < AES_ENGINE_AUTO; ++engine)
+			if (best[engine].tuned && best[engine].throughput > best[fastest].throughput)
+				fastest = engine;
+		cl_platform_id platform;
+		ok = find_device(device, &platform, &device_id);
+		ok = ok && measure_crossover(platform, device_id, key_size_bits, fastest, &best[fastest], buffer, size, key, iv, &crossover);
+	}
+
+	if (ok) {
+		printf("\nThe fastest configurations:\n");
+		for (aes_engine engine = 0; engine < AES_ENGINE_AUTO; ++engine)
+			if (best[engine].tuned)
+				printf("   %-8s %-36s global %7lu local %4lu: %.3f MB/s\n", get_aes_engine_name(engine), best[engine].defines, (long unsigned) best[engine].global_size, (long unsigned) best[engine].local_size, best[engine].throughput);
+		if (crossover == (size_t) -1)
+			printf("   The native engine is always faster\n");
+		else
+			printf("   The native engine is faster below %lu bytes\n", (long unsigned) crossover);
+		printf("\n");
+		ok = store_profile(device_id, key_size_bits, best, crossover);
+	}
+	// The crossover of OPENCL_DEVICE_AUTO is taken again from the new profile of its device
+	if (ok)
+		remove_crossover(key_size_bits);
+	free(buffer);
 
 	if (!ok) {
 		return -1;
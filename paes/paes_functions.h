@@ -26,11 +26,38 @@
  * necessarily tied with the user interface.
  */
 
+#include <stdbool.h>
 #include <CL/cl.h>
 #include "paes_constants_and_datatypes.h"
 
 /**************************** MISCELLANEOUS FUNCTIONS ****************************/
 
+/**
+ * Allocates a page aligned buffer, that the devices sharing the host memory can use in place.
+ * It exits the program if there isn't enough memory.
+ * \param size the buffer size
+ * \return the buffer, to be released by free()
+ */
+cl_uchar *allocate_buffer(size_t size);
+
+/**
+ * Reads exactly size bytes from the file, going on after the short reads.
+ * \param fd the file descriptor
+ * \param buffer the buffer that will contain the data
+ * \param size the number of bytes to read
+ * \return true if everything has been read, false otherwise
+ */
+bool read_fully(int fd, cl_uchar * buffer, size_t size);
+
+/**
+ * Writes exactly size bytes into the file, going on after the short writes.
+ * \param fd the file descriptor
+ * \param buffer the data to write
+ * \param size the number of bytes to write
+ * \return true if everything has been written, false otherwise
+ */
+bool write_fully(int fd, const cl_uchar * buffer, size_t size);
+
 /** 
  * Allocates enough space for the buffer and puts the file's content into it.
  * \param file_name the name of the file to read
@@ -39,13 +66,56 @@
  */
 size_t read_file(char *file_name, unsigned char **buffer);
 
+/**
+ * Reads the header of a file, e.g. the initialization vector, on its own, and puts the rest of
+ * the file into a buffer allocated as \ref read_file does, so that the data starts at a page
+ * and the devices that share the host memory can use it in place.
+ * \param file_name the name of the file to read
+ * \param header where the first header_size bytes of the file will be stored
+ * \param header_size the size of the header; the file must be at least that long
+ * \param buffer the pointer to the buffer that will contain the rest of the file
+ * \return the size of the rest of the file
+ */
+size_t read_file_after_header(char *file_name, cl_uchar * header, size_t header_size, cl_uchar ** buffer);
+
 /** 
- * Writes the buffer content into the specified file.
+ * Writes the header, followed by the buffer content and by the trailer, into the specified file.
  * \param file_name the name of the file that will be written
+ * \param header the data that will be written before the buffer (e.g. the initialization vector)
+ * \param header_size the header's size; if it's 0 no header is written
  * \param buffer the buffer that contains the data that will be written to the file
  * \param size the buffer's size
+ * \param trailer the data that will be written after the buffer (e.g. the authentication tag)
+ * \param trailer_size the trailer's size; if it's 0 no trailer is written
+ */
+void write_file(char *file_name, unsigned char *header, size_t header_size, unsigned char *buffer, size_t size, unsigned char *trailer, size_t trailer_size);
+
+/**
+ * Maps the file in memory, read only, so that its content is read straight from the page cache.
+ * \param file_name the name of the file to map
+ * \param size the pointer to the file size
+ * \return the file's content, to be released by \ref unmap_file; NULL if the file is empty
+ */
+cl_uchar *map_input_file(char *file_name, size_t * size);
+
+/**
+ * Creates a file of the specified size and maps it in memory, so that whatever is written into
+ * the mapping ends up in the file without any further copy.
+ * \param file_name the name of the file that will be written
+ * \param size the file size
+ * \return the file's content, to be released by \ref unmap_file; NULL if the size is 0
+ */
+cl_uchar *map_output_file(char *file_name, size_t size);
+
+/**
+ * Releases a file mapped by \ref map_input_file or by \ref map_output_file.
+ * \param file_name the name of the mapped file
+ * \param buffer the mapped file's content
+ * \param mapped_size the size of the mapping
+ * \param size the final file size; if it's less than the mapping size the file is truncated
+ * \return -1 if the file can't be truncated, 0 otherwise
  */
-void write_file(char *file_name, unsigned char *buffer, size_t size);
+int unmap_file(char *file_name, cl_uchar * buffer, size_t mapped_size, size_t size);
 
 /**************************** AES HOST FUNCTIONS ****************************/
 
@@ -56,6 +126,34 @@ void write_file(char *file_name, unsigned char *buffer, size_t size);
  */
 char *get_aes_mode_name(aes_mode mode);
 
+/**
+ * Returns the string describing the specified chaining.
+ * \param chaining one of the chainings (see \ref aes_chaining)
+ * \return a string describing the specified chaining
+ */
+char *get_aes_chaining_name(aes_chaining chaining);
+
+/**
+ * Returns the string describing the specified AES engine.
+ * \param engine one of the AES engines (see \ref aes_engine)
+ * \return a string describing the specified AES engine
+ */
+char *get_aes_engine_name(aes_engine engine);
+
+/**
+ * Returns the string describing the specified blocks distribution.
+ * \param distribution one of the blocks distributions (see \ref aes_distribution)
+ * \return a string describing the specified blocks distribution
+ */
+char *get_aes_distribution_name(aes_distribution distribution);
+
+/**
+ * Returns the string describing the specified buffer layout.
+ * \param layout one of the buffer layouts (see \ref aes_layout)
+ * \return a string describing the specified buffer layout
+ */
+char *get_aes_layout_name(aes_layout layout);
+
 /**
  * Returns the string describing the specified OpenCL device.
  * \param device one of the possible OpenCL devices (see \ref opencl_device)
@@ -63,17 +161,232 @@ char *get_aes_mode_name(aes_mode mode);
  */
 char *get_opencl_device_name(opencl_device device);
 
+/**
+ * Tells whether a chaining runs standard AES (FIPS-197), whose blocks fill the state by columns, rather
+ * than the row-major state of the PAES engines, that ECB keeps; its round keys are transposed.
+ * \param chaining one of the chainings (see \ref aes_chaining)
+ * \return true if the chaining runs standard AES
+ */
+bool is_standard_chaining(aes_chaining chaining);
+
+/**
+ * Tells whether a kernel macro is NAME or NAME=VALUE, with letters, digits, '_' and '.' only: the
+ * macros end up among the build options, so they mustn't smuggle other options.
+ * \param macro the macro, without the "-D"
+ * \return true if the macro is fine
+ */
+bool is_valid_macro(const char *macro);
+
+/**
+ * Multiplies two GHASH elements (see block_to_ghash in paes.cl) bit by bit.
+ * \param x the first factor, where the product will be stored
+ * \param y the second factor
+ */
+void gf128_multiply(cl_ulong * x, const cl_ulong * y);
+
+/**
+ * Combines the partial hashes of the work groups into the GCM authentication tag:
+ * they're XORed together, then the lengths block is hashed and the result is masked.
+ * \param ghash_partial the partial hashes, already aligned to the end of the data
+ * \param groups the number of partial hashes
+ * \param ghash_table the GHASH table prepared by the device (see \ref GCM_TABLE_SIZE)
+ * \param size the data size, in bytes
+ * \param tag where the GCM_TAG_SIZE bytes tag will be stored
+ */
+void gcm_tag(const cl_ulong * ghash_partial, size_t groups, const cl_ulong * ghash_table, size_t size, cl_uchar * tag);
+
+/**
+ * An AES engine bound to an OpenCL device: it keeps the context, the command queue, the built
+ * program and the kernels, so that many buffers can be processed paying the setup only once.
+ * An engine must be used by one thread at a time.
+ */
+typedef struct paes_engine paes_engine;
+
+/**
+ * Creates an engine, building the OpenCL program for the specified device and key size.
+ * \param device the OpenCL device type (see \ref opencl_device); the first device of that type of the
+ *        first platform is used, OPENCL_DEVICE_ALL means the first device of any type and
+ *        OPENCL_DEVICE_AUTO the first GPU, or the first CPU if there are no GPUs;
+ *        OPENCL_DEVICE_NATIVE isn't an OpenCL device, so it can't have an engine
+ * \param key_size_bits the encryption key size in bits (128, 192 or 256) of every run
+ * \param defines the macros that select the variants of the kernels, as clBuildProgram options
+ *        (e.g. "-D SHIFT_ROWS -D T_TABLE_COPIES=4"); if it's NULL or empty the variants of the
+ *        device profile written by \ref paes_tune for the key size are used
+ * \return the engine, to be released by \ref paes_engine_destroy, or NULL if something went wrong
+ */
+paes_engine *paes_engine_create(opencl_device device, unsigned key_size_bits, const char *defines);
+
+/**
+ * Sets the OpenCL work sizes of the next runs of an engine; by default they're the ones of the
+ * device profile written by \ref paes_tune, or the ones of paes_size.h if the device hasn't been tuned.
+ * The global work size is rounded up to a multiple of the local one.
+ * \param paes the engine made by \ref paes_engine_create
+ * \param global_size the global work size, 0 to keep the default one
+ * \param local_size the local work size, 0 to keep the default one
+ */
+void paes_engine_set_work_sizes(paes_engine * paes, size_t global_size, size_t local_size);
+
+/**
+ * Encrypts or decrypts data with an engine; the parameters are the ones of \ref apply_aes
+ * except the device, the key size and the defines, that are fixed when the engine is created.
+ * The device buffers are kept between runs and grown when needed.
+ * \param paes the engine made by \ref paes_engine_create
+ * \return -1 if something went wrong (including a wrong GCM tag), 0 otherwise
+ */
+int paes_engine_run(paes_engine * paes, cl_uchar * buffer, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag);
+
+/**
+ * Encrypts or decrypts a file of any size with an engine, a chunk at a time: while the oldest chunk
+ * is written to the output file the newer ones are being copied to the device, processed or copied
+ * back, each one in its own command queue. Only AES_CHAINING_ECB, AES_CHAINING_CTR and
+ * AES_CHAINING_XTS are supported, with AES_LAYOUT_LINEAR; the other parameters are the ones of
+ * \ref paes_engine_run.
+ * \param paes the engine made by \ref paes_engine_create
+ * \param input the file descriptor where the data are read from, starting from its current position
+ * \param output the file descriptor where the results are written to, starting from its current position
+ * \param size how many bytes are read from the input file
+ * \param chunk_size the chunk size in bytes; it's rounded down to whole blocks (whole sectors for XTS)
+ *        and to the biggest buffer that the device can allocate
+ * \param depth how many chunks are in flight at the same time
+ * \return -1 if something went wrong, 0 otherwise
+ */
+int paes_engine_stream(paes_engine * paes, int input, int output, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_sector, size_t chunk_size, unsigned depth);
+
+/**
+ * A piece of the data of \ref paes_engine_run_batch, e.g. a file, processed as if it were on its own.
+ */
+typedef struct {
+	size_t offset;		//!< where the segment begins in the buffer, a multiple of AES_BLOCK_SIZE
+	size_t length;		//!< the segment length, in bytes
+	cl_uchar iv[AES_IV_SIZE];	//!< the initialization vector; it's used only by AES_CHAINING_CTR
+	cl_ulong first_sector;	//!< the number of the first XTS sector; it's used only by AES_CHAINING_XTS
+	cl_uint key;		//!< the index of the key of the segment, among the keys of the batch
+} paes_segment;
+
+/**
+ * Encrypts or decrypts many segments of a buffer with an engine, all of them with a single launch of
+ * the batch kernel, so that many small files keep the device as busy as a big one, even if each one
+ * has its own key: the keys are expanded all at once on the host, into a key table. Only
+ * AES_CHAINING_ECB, AES_CHAINING_CTR and AES_CHAINING_XTS are supported, and AES_CHAINING_XTS needs
+ * segments of at least AES_BLOCK_SIZE bytes, or empty ones; the other parameters are the ones of
+ * \ref paes_engine_run.
+ * \param paes the engine made by \ref paes_engine_create
+ * \param buffer the data; every segment is followed by room up to the next multiple of AES_BLOCK_SIZE,
+ *        whose content is lost
+ * \param size the buffer size, a multiple of AES_BLOCK_SIZE
+ * \param segments the segments, in the order of their offsets
+ * \param count the number of segments
+ * \param keys the keys, one after the other; for AES_CHAINING_XTS each key is followed by its tweak key
+ * \param key_count the number of keys
+ * \return -1 if something went wrong, 0 otherwise
+ */
+int paes_engine_run_batch(paes_engine * paes, cl_uchar * buffer, size_t size, const paes_segment * segments, size_t count, cl_uchar * keys, size_t key_count, aes_mode mode, aes_distribution distribution, aes_chaining chaining, cl_uint sector_size);
+
+/**
+ * An asynchronous job, made by \ref paes_submit and released by \ref paes_wait.
+ */
+typedef struct paes_job paes_job;
+
+/**
+ * The function called when an asynchronous job is over, on a thread of the OpenCL runtime;
+ * it mustn't call \ref paes_wait on its own job.
+ * \param job the job
+ * \param result -1 if something went wrong, 0 otherwise
+ * \param user_data the pointer given to \ref paes_submit
+ */
+typedef void (*paes_job_callback) (paes_job * job, int result, void *user_data);
+
+/**
+ * Encrypts or decrypts data with an engine without waiting for it: the job is enqueued and this
+ * function returns at once, so that the caller can do something else in the meantime (e.g. its
+ * own I/O) or submit more jobs, that can run at the same time on an out of order command queue.
+ * Only AES_CHAINING_ECB, AES_CHAINING_CTR and AES_CHAINING_XTS with the linear layout are supported;
+ * the parameters are the ones of \ref paes_engine_run. The keys are copied before returning, but
+ * the buffer must stay untouched until the job is over. The engine must be used by one thread at
+ * a time, and every job must be waited for before destroying it.
+ * \param callback the function called when the job is over, NULL if there's none
+ * \param user_data the pointer given to the callback
+ * \return the job, to be released by \ref paes_wait; NULL if it couldn't be enqueued
+ */
+paes_job *paes_submit(paes_engine * paes, cl_uchar * buffer, size_t size, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, cl_uint sector_size, cl_ulong first_sector, paes_job_callback callback, void *user_data);
+
+/**
+ * Tells whether an asynchronous job is over, that is, its data is back in the buffer and its
+ * callback has returned; it doesn't block.
+ * \param job the job made by \ref paes_submit
+ * \return true if the job is over, false otherwise
+ */
+bool paes_poll(paes_job * job);
+
+/**
+ * Waits for an asynchronous job to be over, and releases it.
+ * \param job the job made by \ref paes_submit
+ * \return -1 if something went wrong, 0 otherwise
+ */
+int paes_wait(paes_job * job);
+
+/**
+ * Releases every OpenCL object of an engine, and the engine itself.
+ * \param paes the engine made by \ref paes_engine_create
+ */
+void paes_engine_destroy(paes_engine * paes);
+
 /** 
- * Encrypts or decrypts data using AES via OpenCL.
+ * Encrypts or decrypts data using AES via OpenCL, with an engine that lives just for this call.
  * \param buffer the data that will be encrypted
- * \param device the OpenCL device type (see \ref opencl_device)
+ * \param device the OpenCL device type (see \ref opencl_device); OPENCL_DEVICE_ALL shares the data among
+ *        every device of every platform, one thread per device, and supports only AES_CHAINING_ECB,
+ *        AES_CHAINING_CTR and AES_CHAINING_XTS; OPENCL_DEVICE_NATIVE runs the native engine of paes_native.h,
+ *        that ignores the engine, the distribution, the layout, the defines and the work sizes;
+ *        OPENCL_DEVICE_AUTO runs the native engine when the data are smaller than the crossover of the
+ *        device profile and none of those is chosen, and the device of \ref paes_engine_create otherwise
  * \param mode the AES mode (see \ref aes_mode)
+ * \param engine the AES implementation run by the device (see \ref aes_engine); AES_ENGINE_AUTO is the
+ *        fastest one of the device profile
+ * \param distribution how the blocks are distributed among the work items (see \ref aes_distribution)
+ * \param layout how the blocks are stored in the device buffer (see \ref aes_layout); the
+ *        global engine supports only AES_LAYOUT_LINEAR
+ * \param chaining how the blocks are chained (see \ref aes_chaining); anything but
+ *        AES_CHAINING_ECB requires AES_ENGINE_PRIVATE and AES_LAYOUT_LINEAR; AES_CHAINING_CBC
+ *        also requires a size that's a multiple of AES_BLOCK_SIZE
+ * \param iv the initialization vector, AES_IV_SIZE bytes for AES_CHAINING_CTR and AES_CHAINING_CBC, GCM_IV_SIZE
+ *        bytes for AES_CHAINING_GCM; it's ignored by the other chainings
  * \param key the AES encryption key
+ * \param tweak_key the AES key that encrypts the sector numbers; it's used only by AES_CHAINING_XTS
+ * \param key_size_bits the encryption key size in bits (128, 192 or 256), the same for both keys
+ * \param sector_size the XTS sector size or the CBC segment size in bytes, a multiple of AES_BLOCK_SIZE;
+ *        for AES_CHAINING_CBC 0 means a single segment, the other chainings ignore it
+ * \param first_sector the number of the XTS sector at the beginning of the buffer; it's used only by AES_CHAINING_XTS
+ * \param tag the GCM_TAG_SIZE bytes authentication tag, computed when encrypting and verified when
+ *        decrypting; it's used only by AES_CHAINING_GCM, which also requires AES_DISTRIBUTION_CONTIGUOUS
+ * \param defines the macros that select the variants of the kernels (see \ref paes_engine_create); it may be NULL
+ * \param global_size the OpenCL global work size, 0 for the default one (see \ref paes_engine_set_work_sizes)
+ * \param local_size the OpenCL local work size, 0 for the default one
+ * \return -1 if something went wrong (including a wrong GCM tag), 0 otherwise
+ */
+int apply_aes(cl_uchar * buffer, size_t size, opencl_device device, aes_mode mode, aes_engine engine, aes_distribution distribution, aes_layout layout, aes_chaining chaining, cl_uchar * iv, cl_uchar * key, cl_uchar * tweak_key, unsigned key_size_bits, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag, const char *defines, size_t global_size, size_t local_size);
+
+/**
+ * Encrypts or decrypts many segments of a buffer (see \ref paes_engine_run_batch) with an engine that
+ * lives just for this call; the parameters are the ones of \ref apply_aes and \ref paes_engine_run_batch.
+ * OPENCL_DEVICE_ALL isn't supported; OPENCL_DEVICE_NATIVE processes the segments one after the other,
+ * and OPENCL_DEVICE_AUTO does the same when the whole buffer is smaller than the crossover.
+ * \return -1 if something went wrong, 0 otherwise
+ */
+int apply_aes_batch(cl_uchar * buffer, size_t size, const paes_segment * segments, size_t count, cl_uchar * keys, size_t key_count, opencl_device device, aes_mode mode, aes_distribution distribution, aes_chaining chaining, unsigned key_size_bits, cl_uint sector_size, const char *defines, size_t global_size, size_t local_size);
+
+/**
+ * Finds the fastest configuration of every engine on a device, trying the kernel variants and many
+ * work sizes, and writes it into the device profile of the key size, next to the cached programs. From
+ * then on the engines created for the device with that key size use it by default, and AES_ENGINE_AUTO
+ * is the fastest engine; each key size is tuned on its own, since the rounds change the speeds. The
+ * profile also gets the crossover of OPENCL_DEVICE_AUTO: the size below which the native engine is
+ * faster than the fastest engine, setting up the device included.
+ * \param device the OpenCL device type (see \ref opencl_device); OPENCL_DEVICE_ALL tunes the first device
  * \param key_size_bits the encryption key size in bits (128, 192 or 256)
- * \param global_size the OpenCL global work size; if it's OPENCL_DEFAULT_GLOBAL_SIZE is decided by the framework
- * \param local_size the OpenCL local work size
+ * \param size how many bytes are encrypted with each configuration
  * \return -1 if something went wrong, 0 otherwise
  */
-int apply_aes(cl_uchar * buffer, size_t size, opencl_device device, aes_mode mode, cl_uchar * key, unsigned key_size_bits);
+int paes_tune(opencl_device device, unsigned key_size_bits, size_t size);
 
 #endif
@@ -0,0 +1,37 @@
+/*
+    PAES - Parallel AES for CPUs and GPUs
+    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PAES_KERNEL_SOURCE_H__
+#define __PAES_KERNEL_SOURCE_H__ 1
+
+/**
+ * \file paes_kernel_source.h
+ *
+ * The OpenCL source code of PAES, embedded in the executable so that it
+ * doesn't need to be read at runtime. paes_kernel_source.c is generated by the
+ * Makefile from paes_constants_and_datatypes.h and paes.cl, with a string for
+ * each line; the ISO C99 compilers aren't required to support longer strings.
+ */
+
+//! The lines of the OpenCL source code, each one with its trailing newline.
+extern const char *paes_kernel_source[];
+
+//! The number of lines in \ref paes_kernel_source.
+extern const unsigned paes_kernel_source_lines;
+
+#endif
@@ -0,0 +1,775 @@
+/*
+    PAES - Parallel AES for CPUs and GPUs
+    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// sysconf() and the threads aren't part of C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "paes_native.h"
+#include "paes_functions.h"
+
+// The AES instructions are used only where GCC can tell whether the processor has them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NATIVE_X86 1
+#include <immintrin.h>
+#endif
+
+//! The largest number of round keys, the ones of a 256 bits key.
+#define MAX_ROUND_KEYS (ROUND_KEY_SIZE / AES_BLOCK_SIZE)
+
+/**
+ * The round keys of a key, in the formats of every implementation. The first index is the AES mode:
+ * the decryption round keys are the ones of the equivalent inverse cipher, made by key_expansion.
+ */
+typedef struct {
+	unsigned rounds;
+	//! The blocks fill the state by columns, as in standard AES, rather than by rows as in PAES (see is_standard_chaining)
+	bool standard;
+	//! The round keys transposed, since the AES instructions store the state by columns and PAES by rows
+	cl_uchar transposed[2][MAX_ROUND_KEYS][AES_BLOCK_SIZE];
+	//! The round keys as columns, for the T-tables (see block_to_columns in paes.cl)
+	uint32_t columns[2][MAX_ROUND_KEYS][AES_STATE_SIDE];
+} native_key;
+
+/**
+ * Encrypts or decrypts whole blocks, each one on its own; the input and the output may be the same.
+ * \param key the round keys
+ * \param mode one between AES_MODE_ENCRYPT and AES_MODE_DECRYPT
+ * \param input the blocks
+ * \param output where the processed blocks will be stored
+ * \param blocks the number of blocks
+ */
+typedef void (*blocks_function)(const native_key * key, aes_mode mode, const cl_uchar * input, cl_uchar * output, size_t blocks);
+
+/**************************** IMPLEMENTATIONS ****************************/
+
+static const cl_uchar sbox_encrypt[AES_SBOX_SIZE] = AES_SBOX_ENCRYPT;
+static const cl_uchar sbox_decrypt[AES_SBOX_SIZE] = AES_SBOX_DECRYPT;
+
+//! The 4 encryption and decryption T-tables, as the ones of paes.cl.
+static uint32_t te[AES_STATE_SIDE][AES_SBOX_SIZE], td[AES_STATE_SIDE][AES_SBOX_SIZE];
+
+//! Multiplies by 2 each of the 4 bytes of a column in the AES field.
+static uint32_t xtime_column(uint32_t column)
+{
+	return ((column & 0x7f7f7f7fu) << 1) ^ (((column >> 7) & 0x01010101u) * 0x1bu);
+}
+
+static uint32_t rotate_column(uint32_t column, unsigned bits)
+{
+	return bits == 0 ? column : (column << bits) | (column >> (32 - bits));
+}
+
+static void init_t_tables(void)
+{
+	for (unsigned i = 0; i < AES_SBOX_SIZE; ++i) {
+		uint32_t s = sbox_encrypt[i];
+		uint32_t s2 = xtime_column(s);
+		uint32_t e = s2 | (s << 8) | (s << 16) | ((s2 ^ s) << 24);
+		s = sbox_decrypt[i];
+		s2 = xtime_column(s);
+		uint32_t s4 = xtime_column(s2);
+		uint32_t s8 = xtime_column(s4);
+		uint32_t d = (s8 ^ s4 ^ s2) | ((s8 ^ s) << 8) | ((s8 ^ s4 ^ s) << 16) | ((s8 ^ s2 ^ s) << 24);
+		for (unsigned table = 0; table < AES_STATE_SIDE; ++table) {
+			te[table][i] = rotate_column(e, table * 8);
+			td[table][i] = rotate_column(d, table * 8);
+		}
+	}
+}
+
+//! Encrypts a block as columns with the T-tables (see encrypt_columns in paes.cl).
+static void encrypt_columns(uint32_t * s, const uint32_t(*key)[AES_STATE_SIDE], unsigned rounds)
+{
+	uint32_t t[AES_STATE_SIDE];
+	for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+		s[c] ^= key[0][c];
+	for (unsigned round = 1; round < rounds; ++round) {
+		for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+			t[c] = te[0][s[c] & 0xff] ^ te[1][(s[(c + 1) % 4] >> 8) & 0xff] ^ te[2][(s[(c + 2) % 4] >> 16) & 0xff] ^ te[3][s[(c + 3) % 4] >> 24] ^ key[round][c];
+		memcpy(s, t, sizeof(t));
+	}
+	for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+		t[c] = (sbox_encrypt[s[c] & 0xff] | (sbox_encrypt[(s[(c + 1) % 4] >> 8) & 0xff] << 8) | (sbox_encrypt[(s[(c + 2) % 4] >> 16) & 0xff] << 16) | ((uint32_t) sbox_encrypt[s[(c + 3) % 4] >> 24] << 24)) ^ key[rounds][c];
+	memcpy(s, t, sizeof(t));
+}
+
+//! Decrypts a block as columns with the T-tables (see decrypt_columns in paes.cl).
+static void decrypt_columns(uint32_t * s, const uint32_t(*key)[AES_STATE_SIDE], unsigned rounds)
+{
+	uint32_t t[AES_STATE_SIDE];
+	for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+		s[c] ^= key[0][c];
+	for (unsigned round = 1; round < rounds; ++round) {
+		for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+			t[c] = td[0][s[c] & 0xff] ^ td[1][(s[(c + 3) % 4] >> 8) & 0xff] ^ td[2][(s[(c + 2) % 4] >> 16) & 0xff] ^ td[3][s[(c + 1) % 4] >> 24] ^ key[round][c];
+		memcpy(s, t, sizeof(t));
+	}
+	for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+		t[c] = (sbox_decrypt[s[c] & 0xff] | (sbox_decrypt[(s[(c + 3) % 4] >> 8) & 0xff] << 8) | (sbox_decrypt[(s[(c + 2) % 4] >> 16) & 0xff] << 16) | ((uint32_t) sbox_decrypt[s[(c + 1) % 4] >> 24] << 24)) ^ key[rounds][c];
+	memcpy(s, t, sizeof(t));
+}
+
+//! The portable implementation, with the T-tables.
+static void table_blocks(const native_key * key, aes_mode mode, const cl_uchar * input, cl_uchar * output, size_t blocks)
+{
+	// The distance between the bytes of two consecutive rows, and of two consecutive columns
+	const unsigned row_step = key->standard ? 1 : AES_STATE_SIDE, column_step = key->standard ? AES_STATE_SIDE : 1;
+	for (size_t b = 0; b < blocks; ++b, input += AES_BLOCK_SIZE, output += AES_BLOCK_SIZE) {
+		uint32_t s[AES_STATE_SIDE];
+		for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+			s[c] = input[c * column_step] | (input[row_step + c * column_step] << 8) | (input[2 * row_step + c * column_step] << 16) | ((uint32_t) input[3 * row_step + c * column_step] << 24);
+		if (mode == AES_MODE_ENCRYPT)
+			encrypt_columns(s, key->columns[mode], key->rounds);
+		else
+			decrypt_columns(s, key->columns[mode], key->rounds);
+		for (unsigned r = 0; r < AES_STATE_SIDE; ++r)
+			for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+				output[r * row_step + c * column_step] = (cl_uchar) (s[c] >> (8 * r));
+	}
+}
+
+#ifdef NATIVE_X86
+
+//! How many blocks go through the AES-NI rounds together, so that the latency of the instructions overlaps.
+#define AESNI_LANES 8
+
+//! How many 512 bits registers, of 4 blocks each, go through the VAES rounds together.
+#define VAES_LANES 4
+
+//! The shuffle that transposes a block between the row-major order of PAES and the column-major one of the AES instructions.
+#define TRANSPOSE_BYTES 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15
+
+//! The shuffle that leaves a block as it is, for the standard AES blocks.
+#define IDENTITY_BYTES 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+
+/**
+ * The AES-NI implementation: the PAES blocks are transposed, so that the instructions do the same
+ * rounds of the other engines, and processed AESNI_LANES at a time.
+ */
+__attribute__ ((target("aes,ssse3")))
+static void aesni_blocks(const native_key * key, aes_mode mode, const cl_uchar * input, cl_uchar * output, size_t blocks)
+{
+	const __m128i transpose = key->standard ? _mm_setr_epi8(IDENTITY_BYTES) : _mm_setr_epi8(TRANSPOSE_BYTES);
+	const unsigned rounds = key->rounds;
+	__m128i k[MAX_ROUND_KEYS], s[AESNI_LANES];
+	for (unsigned r = 0; r <= rounds; ++r)
+		k[r] = _mm_loadu_si128((const __m128i *) key->transposed[mode][r]);
+
+	while (blocks > 0) {
+		unsigned lanes = blocks < AESNI_LANES ? (unsigned) blocks : AESNI_LANES;
+		for (unsigned i = 0; i < lanes; ++i)
+			s[i] = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) input + i), transpose), k[0]);
+		if (mode == AES_MODE_ENCRYPT) {
+			for (unsigned r = 1; r < rounds; ++r)
+				for (unsigned i = 0; i < lanes; ++i)
+					s[i] = _mm_aesenc_si128(s[i], k[r]);
+			for (unsigned i = 0; i < lanes; ++i)
+				s[i] = _mm_aesenclast_si128(s[i], k[rounds]);
+		} else {
+			for (unsigned r = 1; r < rounds; ++r)
+				for (unsigned i = 0; i < lanes; ++i)
+					s[i] = _mm_aesdec_si128(s[i], k[r]);
+			for (unsigned i = 0; i < lanes; ++i)
+				s[i] = _mm_aesdeclast_si128(s[i], k[rounds]);
+		}
+		for (unsigned i = 0; i < lanes; ++i)
+			_mm_storeu_si128((__m128i *) output + i, _mm_shuffle_epi8(s[i], transpose));
+		input += lanes * AES_BLOCK_SIZE;
+		output += lanes * AES_BLOCK_SIZE;
+		blocks -= lanes;
+	}
+}
+
+/**
+ * The VAES implementation: as the AES-NI one, but with 4 blocks in each 512 bits register; the
+ * blocks that don't fill the registers are left to the AES-NI implementation.
+ */
+__attribute__ ((target("aes,ssse3,vaes,avx512f,avx512bw")))
+static void vaes_blocks(const native_key * key, aes_mode mode, const cl_uchar * input, cl_uchar * output, size_t blocks)
+{
+	const __m512i transpose = _mm512_broadcast_i32x4(key->standard ? _mm_setr_epi8(IDENTITY_BYTES) : _mm_setr_epi8(TRANSPOSE_BYTES));
+	const unsigned rounds = key->rounds;
+	__m512i k[MAX_ROUND_KEYS], s[VAES_LANES];
+	for (unsigned r = 0; r <= rounds; ++r)
+		k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) key->transposed[mode][r]));
+
+	for (; blocks >= 4 * VAES_LANES; blocks -= 4 * VAES_LANES) {
+		for (unsigned i = 0; i < VAES_LANES; ++i)
+			s[i] = _mm512_xor_si512(_mm512_shuffle_epi8(_mm512_loadu_si512((const void *) (input + i * 4 * AES_BLOCK_SIZE)), transpose), k[0]);
+		if (mode == AES_MODE_ENCRYPT) {
+			for (unsigned r = 1; r < rounds; ++r)
+				for (unsigned i = 0; i < VAES_LANES; ++i)
+					s[i] = _mm512_aesenc_epi128(s[i], k[r]);
+			for (unsigned i = 0; i < VAES_LANES; ++i)
+				s[i] = _mm512_aesenclast_epi128(s[i], k[rounds]);
+		} else {
+			for (unsigned r = 1; r < rounds; ++r)
+				for (unsigned i = 0; i < VAES_LANES; ++i)
+					s[i] = _mm512_aesdec_epi128(s[i], k[r]);
+			for (unsigned i = 0; i < VAES_LANES; ++i)
+				s[i] = _mm512_aesdeclast_epi128(s[i], k[rounds]);
+		}
+		for (unsigned i = 0; i < VAES_LANES; ++i)
+			_mm512_storeu_si512((void *) (output + i * 4 * AES_BLOCK_SIZE), _mm512_shuffle_epi8(s[i], transpose));
+		input += 4 * VAES_LANES * AES_BLOCK_SIZE;
+		output += 4 * VAES_LANES * AES_BLOCK_SIZE;
+	}
+	if (blocks > 0)
+		aesni_blocks(key, mode, input, output, blocks);
+}
+
+#endif
+
+//! The implementations, from the slowest to the fastest.
+static const struct {
+	const char *name;
+	blocks_function process;
+} implementations[] = {
+	{"table", table_blocks},
+#ifdef NATIVE_X86
+	{"aes-ni", aesni_blocks},
+	{"vaes", vaes_blocks},
+#endif
+};
+
+//! The index in \ref implementations of the one that's used.
+static unsigned implementation;
+static pthread_once_t implementation_once = PTHREAD_ONCE_INIT;
+
+//! Tells whether the processor can run an implementation.
+static bool is_supported(unsigned index)
+{
+#ifdef NATIVE_X86
+	__builtin_cpu_init();
+	if (index >= 1 && !(__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3")))
+		return false;
+	if (index >= 2 && !(__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")))
+		return false;
+#endif
+	return index < sizeof(implementations) / sizeof(implementations[0]);
+}
+
+/**
+ * Chooses the fastest implementation that the processor supports, or the one named by
+ * NATIVE_IMPLEMENTATION_VARIABLE if the processor supports it too; otherwise it warns that
+ * the fastest one runs instead.
+ */
+static void choose_implementation(void)
+{
+	init_t_tables();
+	const char *requested = getenv(NATIVE_IMPLEMENTATION_VARIABLE);
+	bool found = false;
+	while (is_supported(implementation + 1))
+		++implementation;
+	for (unsigned i = 0; requested != NULL && is_supported(i); ++i)
+		if (strcmp(requested, implementations[i].name) == 0) {
+			implementation = i;
+			found = true;
+		}
+	if (requested != NULL && requested[0] != '\0' && !found)
+		fprintf(stderr, "WARNING: the native implementation '%s' is unknown or unsupported by the processor, %s runs instead.\n", requested, implementations[implementation].name);
+}
+
+const char *native_implementation_name(void)
+{
+	pthread_once(&implementation_once, choose_implementation);
+	return implementations[implementation].name;
+}
+
+/**************************** CHAININGS ****************************/
+
+//! Everything the threads need to process their part of the data.
+typedef struct {
+	cl_uchar *buffer;
+	size_t size;
+	aes_mode mode;
+	aes_chaining chaining;
+	blocks_function process;
+	native_key key;
+	native_key tweak_key;
+	cl_ulong iv_high, iv_low;	//!< the initialization vector, split as in paes_functions.c
+	size_t segment_blocks;	//!< the blocks of a CBC segment
+	size_t sector_size;
+	size_t sectors;		//!< the XTS sectors, the last one possibly longer
+	cl_ulong first_sector;
+	cl_ulong ghash_table[2 * GCM_TABLE_SIZE];	//!< the GHASH table, as the one of kernel_gcm_setup in paes.cl
+} native_job;
+
+//! A thread of the native engine, with its share of the data.
+typedef struct {
+	const native_job *job;
+	size_t from, to;	//!< the blocks, the sectors or the segments of the thread
+	bool last;		//!< the thread also processes the bytes that don't make a whole block
+	cl_uchar previous[AES_BLOCK_SIZE];	//!< the CBC encrypted block before the first one of the thread
+	cl_ulong ghash[2];	//!< the GCM partial hash of the thread, aligned to the end of the data
+	pthread_t thread;
+} native_worker;
+
+/**
+ * Converts the round keys made by key_expansion into the formats of the implementations.
+ * \param standard true if the chaining runs standard AES, whose round keys key_expansion transposes
+ */
+static void prepare_key(native_key * key, const cl_uchar * round_key, unsigned key_size_bits, bool standard)
+{
+	key->rounds = key_size_bits / 32 + 6;
+	key->standard = standard;
+	for (unsigned mode = 0; mode < 2; ++mode) {
+		const cl_uchar *k = round_key + mode * (key->rounds + 1) * AES_BLOCK_SIZE;
+		for (unsigned r = 0; r <= key->rounds; ++r, k += AES_BLOCK_SIZE) {
+			for (unsigned i = 0; i < AES_BLOCK_SIZE; ++i)
+				key->transposed[mode][r][i] = k[(i % AES_STATE_SIDE) * AES_STATE_SIDE + i / AES_STATE_SIDE];
+			for (unsigned c = 0; c < AES_STATE_SIDE; ++c)
+				key->columns[mode][r][c] = k[c] | (k[4 + c] << 8) | (k[8 + c] << 16) | ((uint32_t) k[12 + c] << 24);
+		}
+	}
+}
+
+//! XORs other into data, 8 bytes at a time while it can.
+static void xor_bytes(cl_uchar * data, const cl_uchar * other, size_t size)
+{
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t a, b;
+		memcpy(&a, data + i, sizeof(a));
+		memcpy(&b, other + i, sizeof(b));
+		a ^= b;
+		memcpy(data + i, &a, sizeof(a));
+	}
+	for (; i < size; ++i)
+		data[i] ^= other[i];
+}
+
+//! Stores the 128 bits big endian integer high:low into a block.
+static void store_big_endian(cl_ulong high, cl_ulong low, cl_uchar * block)
+{
+	for (unsigned i = 0; i < 8; ++i) {
+		block[i] = (cl_uchar) (high >> (56 - 8 * i));
+		block[8 + i] = (cl_uchar) (low >> (56 - 8 * i));
+	}
+}
+
+//! Makes the counter block of a block, the initialization vector plus its index (see counter_block in paes.cl).
+static void counter_block(const native_job * job, size_t index, cl_uchar * block)
+{
+	cl_ulong low = job->iv_low + index;
+	store_big_endian(job->iv_high + (low < job->iv_low), low, block);
+}
+
+//! Makes a GCM counter block (see gcm_counter_block in paes.cl).
+static void gcm_counter_block(const native_job * job, cl_uint counter, cl_uchar * block)
+{
+	store_big_endian(job->iv_high, (job->iv_low & 0xffffffff00000000ULL) | counter, block);
+}
+
+//! Converts a block to a GHASH element (see block_to_ghash in paes.cl).
+static void block_to_ghash(const cl_uchar * block, cl_ulong * element)
+{
+	element[0] = element[1] = 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		element[0] = (element[0] << 8) | block[i];
+		element[1] = (element[1] << 8) | block[8 + i];
+	}
+}
+
+//! Multiplies a GHASH element by H, 4 bits at a time (see ghash_multiply_h in paes.cl).
+static void ghash_multiply_h(cl_ulong * x, const cl_ulong * h_table)
+{
+	static const uint16_t reduction[16] = { 0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+		0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+	};
+	cl_ulong z[2] = { 0, 0 };
+	for (int i = AES_BLOCK_SIZE * 2 - 1; i >= 0; --i) {
+		unsigned nibble = (unsigned) (x[i / 16] >> (60 - 4 * (i % 16))) & 0xf;
+		unsigned rem = (unsigned) z[1] & 0xf;
+		z[1] = (z[0] << 60) | (z[1] >> 4);
+		z[0] = (z[0] >> 4) ^ ((cl_ulong) reduction[rem] << 48);
+		z[0] ^= h_table[2 * nibble];
+		z[1] ^= h_table[2 * nibble + 1];
+	}
+	x[0] = z[0];
+	x[1] = z[1];
+}
+
+//! Hashes a block into a GHASH value.
+static void ghash_block(cl_ulong * hash, const cl_uchar * block, const cl_ulong * h_table)
+{
+	cl_ulong element[2];
+	block_to_ghash(block, element);
+	hash[0] ^= element[0];
+	hash[1] ^= element[1];
+	ghash_multiply_h(hash, h_table);
+}
+
+//! Prepares the GHASH table as kernel_gcm_setup in paes.cl does.
+static void gcm_setup(native_job * job)
+{
+	cl_uchar block[AES_BLOCK_SIZE];
+	cl_ulong *table = job->ghash_table, v[2];
+
+	memset(block, 0, sizeof(block));
+	job->process(&job->key, AES_MODE_ENCRYPT, block, block, 1);
+	block_to_ghash(block, v);
+	table[0] = table[1] = 0;
+	for (unsigned i = 8; i > 0; i >>= 1) {
+		table[2 * i] = v[0];
+		table[2 * i + 1] = v[1];
+		cl_ulong carry = v[1] & 1;
+		v[1] = (v[1] >> 1) | (v[0] << 63);
+		v[0] = (v[0] >> 1) ^ (carry ? 0xe100000000000000ULL : 0);
+	}
+	for (unsigned i = 2; i < 16; i <<= 1)
+		for (unsigned j = 1; j < i; ++j) {
+			table[2 * (i + j)] = table[2 * i] ^ table[2 * j];
+			table[2 * (i + j) + 1] = table[2 * i + 1] ^ table[2 * j + 1];
+		}
+
+	v[0] = table[2 * GCM_TABLE_H];
+	v[1] = table[2 * GCM_TABLE_H + 1];
+	for (unsigned j = 0; j < GCM_TABLE_POWERS_SIZE; ++j) {
+		table[2 * (GCM_TABLE_POWERS + j)] = v[0];
+		table[2 * (GCM_TABLE_POWERS + j) + 1] = v[1];
+		gf128_multiply(v, table + 2 * (GCM_TABLE_POWERS + j));
+	}
+
+	gcm_counter_block(job, 1, block);
+	job->process(&job->key, AES_MODE_ENCRYPT, block, block, 1);
+	block_to_ghash(block, table + 2 * GCM_TABLE_TAG_MASK);
+}
+
+static void ecb_range(native_worker * worker)
+{
+	const native_job *job = worker->job;
+	cl_uchar *data = job->buffer + worker->from * AES_BLOCK_SIZE;
+	job->process(&job->key, job->mode, data, data, worker->to - worker->from);
+}
+
+/**
+ * Encrypts or decrypts the blocks of the thread with CTR or GCM, NATIVE_BATCH_BLOCKS key stream
+ * blocks at a time; GCM also hashes the encrypted blocks.
+ */
+static void counter_range(native_worker * worker)
+{
+	const native_job *job = worker->job;
+	bool gcm = job->chaining == AES_CHAINING_GCM;
+	size_t blocks = job->size / AES_BLOCK_SIZE, tail = job->size % AES_BLOCK_SIZE;
+	cl_uchar stream[NATIVE_BATCH_BLOCKS * AES_BLOCK_SIZE];
+
+	worker->ghash[0] = worker->ghash[1] = 0;
+	for (size_t b = worker->from; b < worker->to;) {
+		size_t n = worker->to - b < NATIVE_BATCH_BLOCKS ? worker->to - b : NATIVE_BATCH_BLOCKS;
+		cl_uchar *data = job->buffer + b * AES_BLOCK_SIZE;
+		for (size_t i = 0; i < n; ++i) {
+			if (gcm)
+				gcm_counter_block(job, (cl_uint) (b + i) + 2, stream + i * AES_BLOCK_SIZE);
+			else
+				counter_block(job, b + i, stream + i * AES_BLOCK_SIZE);
+		}
+		job->process(&job->key, AES_MODE_ENCRYPT, stream, stream, n);
+		if (gcm && job->mode == AES_MODE_DECRYPT)
+			for (size_t i = 0; i < n; ++i)
+				ghash_block(worker->ghash, data + i * AES_BLOCK_SIZE, job->ghash_table);
+		xor_bytes(data, stream, n * AES_BLOCK_SIZE);
+		if (gcm && job->mode == AES_MODE_ENCRYPT)
+			for (size_t i = 0; i < n; ++i)
+				ghash_block(worker->ghash, data + i * AES_BLOCK_SIZE, job->ghash_table);
+		b += n;
+	}
+	// As in kernel_aes_gcm, the partial hash is multiplied by the power of H that aligns it to the end
+	if (gcm && worker->from < worker->to)
+		for (cl_ulong j = 0, exponent = blocks + (tail != 0) - worker->to; exponent != 0; ++j, exponent >>= 1)
+			if (exponent & 1)
+				gf128_multiply(worker->ghash, job->ghash_table + 2 * (GCM_TABLE_POWERS + j));
+
+	if (!worker->last || tail == 0)
+		return;
+	cl_uchar *data = job->buffer + blocks * AES_BLOCK_SIZE, hashed[AES_BLOCK_SIZE];
+	if (gcm)
+		gcm_counter_block(job, (cl_uint) blocks + 2, stream);
+	else
+		counter_block(job, blocks, stream);
+	job->process(&job->key, AES_MODE_ENCRYPT, stream, stream, 1);
+	memset(hashed, 0, sizeof(hashed));
+	if (job->mode == AES_MODE_DECRYPT)
+		memcpy(hashed, data, tail);
+	xor_bytes(data, stream, tail);
+	if (job->mode == AES_MODE_ENCRYPT)
+		memcpy(hashed, data, tail);
+	if (gcm) {
+		cl_ulong element[2];
+		block_to_ghash(hashed, element);
+		ghash_multiply_h(element, job->ghash_table);
+		worker->ghash[0] ^= element[0];
+		worker->ghash[1] ^= element[1];
+	}
+}
+
+//! Converts a block to an XTS tweak, the first byte being the least significant one (see block_to_tweak in paes.cl).
+static void block_to_tweak(const cl_uchar * block, cl_ulong * tweak)
+{
+	tweak[0] = tweak[1] = 0;
+	for (unsigned i = 0; i < 8; ++i) {
+		tweak[0] |= (cl_ulong) block[i] << (8 * i);
+		tweak[1] |= (cl_ulong) block[8 + i] << (8 * i);
+	}
+}
+
+static void tweak_to_block(const cl_ulong * tweak, cl_uchar * block)
+{
+	for (unsigned i = 0; i < 8; ++i) {
+		block[i] = (cl_uchar) (tweak[0] >> (8 * i));
+		block[8 + i] = (cl_uchar) (tweak[1] >> (8 * i));
+	}
+}
+
+//! Multiplies the XTS tweak by x (see double_tweak in paes.cl).
+static void double_tweak(cl_ulong * tweak)
+{
+	cl_ulong carry = tweak[1] >> 63;
+	tweak[1] = (tweak[1] << 1) | (tweak[0] >> 63);
+	tweak[0] = (tweak[0] << 1) ^ (0x87 & -carry);
+}
+
+//! Encrypts or decrypts a single block with XTS.
+static void xts_block(const native_job * job, cl_uchar * block, const cl_ulong * tweak)
+{
+	cl_uchar t[AES_BLOCK_SIZE];
+	tweak_to_block(tweak, t);
+	xor_bytes(block, t, AES_BLOCK_SIZE);
+	job->process(&job->key, job->mode, block, block, 1);
+	xor_bytes(block, t, AES_BLOCK_SIZE);
+}
+
+/**
+ * Encrypts or decrypts the sectors of the thread with XTS (see xts_sector in paes.cl): the whole blocks
+ * of a sector are processed NATIVE_BATCH_BLOCKS at a time, the ciphertext stealing one by one.
+ */
+static void xts_range(native_worker * worker)
+{
+	const native_job *job = worker->job;
+	cl_uchar tweaks[NATIVE_BATCH_BLOCKS * AES_BLOCK_SIZE];
+
+	for (size_t s = worker->from; s < worker->to; ++s) {
+		cl_uchar *sector = job->buffer + s * job->sector_size;
+		size_t length = s == job->sectors - 1 ? job->size - s * job->sector_size : job->sector_size;
+		size_t blocks = length / AES_BLOCK_SIZE, tail = length % AES_BLOCK_SIZE;
+		size_t whole = tail == 0 ? blocks : blocks - 1;
+
+		cl_ulong tweak[2] = { job->first_sector + s, 0 };
+		tweak_to_block(tweak, tweaks);
+		job->process(&job->tweak_key, AES_MODE_ENCRYPT, tweaks, tweaks, 1);
+		block_to_tweak(tweaks, tweak);
+
+		for (size_t b = 0; b < whole;) {
+			size_t n = whole - b < NATIVE_BATCH_BLOCKS ? whole - b : NATIVE_BATCH_BLOCKS;
+			cl_uchar *data = sector + b * AES_BLOCK_SIZE;
+			for (size_t i = 0; i < n; ++i) {
+				tweak_to_block(tweak, tweaks + i * AES_BLOCK_SIZE);
+				double_tweak(tweak);
+			}
+			xor_bytes(data, tweaks, n * AES_BLOCK_SIZE);
+			job->process(&job->key, job->mode, data, data, n);
+			xor_bytes(data, tweaks, n * AES_BLOCK_SIZE);
+			b += n;
+		}
+		if (tail == 0)
+			continue;
+
+		cl_ulong next_tweak[2] = { tweak[0], tweak[1] };
+		double_tweak(next_tweak);
+		cl_uchar *last = sector + whole * AES_BLOCK_SIZE, stolen[AES_BLOCK_SIZE];
+		memcpy(stolen, last, AES_BLOCK_SIZE);
+		xts_block(job, stolen, job->mode == AES_MODE_ENCRYPT ? tweak : next_tweak);
+		for (size_t i = 0; i < tail; ++i) {
+			cl_uchar byte = last[AES_BLOCK_SIZE + i];
+			last[AES_BLOCK_SIZE + i] = stolen[i];
+			stolen[i] = byte;
+		}
+		xts_block(job, stolen, job->mode == AES_MODE_ENCRYPT ? next_tweak : tweak);
+		memcpy(last, stolen, AES_BLOCK_SIZE);
+	}
+}
+
+//! Encrypts the segments of the thread with CBC, each one chained block after block.
+static void cbc_encrypt_range(native_worker * worker)
+{
+	const native_job *job = worker->job;
+	size_t blocks = job->size / AES_BLOCK_SIZE;
+	cl_uchar chain[AES_BLOCK_SIZE];
+
+	for (size_t s = worker->from; s < worker->to; ++s) {
+		size_t last = (s + 1) * job->segment_blocks < blocks ? (s + 1) * job->segment_blocks : blocks;
+		counter_block(job, s, chain);
+		for (size_t b = s * job->segment_blocks; b < last; ++b) {
+			cl_uchar *data = job->buffer + b * AES_BLOCK_SIZE;
+			xor_bytes(data, chain, AES_BLOCK_SIZE);
+			job->process(&job->key, AES_MODE_ENCRYPT, data, data, 1);
+			memcpy(chain, data, AES_BLOCK_SIZE);
+		}
+	}
+}
+
+/**
+ * Decrypts the blocks of the thread with CBC, NATIVE_BATCH_BLOCKS at a time; the encrypted blocks
+ * are saved before being decrypted in place, since each of them is needed by the next one.
+ */
+static void cbc_decrypt_range(native_worker * worker)
+{
+	const native_job *job = worker->job;
+	cl_uchar saved[(NATIVE_BATCH_BLOCKS + 1) * AES_BLOCK_SIZE];
+
+	memcpy(saved, worker->previous, AES_BLOCK_SIZE);
+	for (size_t b = worker->from; b < worker->to;) {
+		size_t n = worker->to - b < NATIVE_BATCH_BLOCKS ? worker->to - b : NATIVE_BATCH_BLOCKS;
+		cl_uchar *data = job->buffer + b * AES_BLOCK_SIZE;
+		memcpy(saved + AES_BLOCK_SIZE, data, n * AES_BLOCK_SIZE);
+		job->process(&job->key, AES_MODE_DECRYPT, data, data, n);
+		for (size_t i = 0; i < n; ++i) {
+			if ((b + i) % job->segment_blocks == 0)
+				counter_block(job, (b + i) / job->segment_blocks, saved + i * AES_BLOCK_SIZE);
+			xor_bytes(data + i * AES_BLOCK_SIZE, saved + i * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		}
+		memcpy(saved, saved + n * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		b += n;
+	}
+}
+
+static void *native_worker_thread(void *argument)
+{
+	native_worker *worker = (native_worker *) argument;
+	const native_job *job = worker->job;
+
+	if (job->chaining == AES_CHAINING_CTR || job->chaining == AES_CHAINING_GCM)
+		counter_range(worker);
+	else if (job->chaining == AES_CHAINING_XTS)
+		xts_range(worker);
+	else if (job->chaining == AES_CHAINING_CBC && job->mode == AES_MODE_ENCRYPT)
+		cbc_encrypt_range(worker);
+	else if (job->chaining == AES_CHAINING_CBC)
+		cbc_decrypt_range(worker);
+	else
+		ecb_range(worker);
+	return NULL;
+}
+
+/**
+ * Chooses how many threads process the data: one per core, but each one with at least
+ * NATIVE_MIN_THREAD_SIZE bytes and at least a unit (a block, a sector or a segment).
+ */
+static unsigned count_threads(size_t size, size_t units)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = cores > 0 ? (size_t) cores : 1;
+	if (threads > size / NATIVE_MIN_THREAD_SIZE)
+		threads = size / NATIVE_MIN_THREAD_SIZE;
+	if (threads > units)
+		threads = units;
+	if (threads > NATIVE_MAX_THREADS)
+		threads = NATIVE_MAX_THREADS;
+	return threads > 0 ? (unsigned) threads : 1;
+}
+
+unsigned native_aes(cl_uchar * buffer, size_t size, aes_mode mode, aes_chaining chaining, const cl_uchar * round_key, const cl_uchar * tweak_round_key, unsigned key_size_bits, const cl_uchar * iv, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag)
+{
+	native_job job;
+	native_worker workers[NATIVE_MAX_THREADS];
+	size_t blocks = size / AES_BLOCK_SIZE, units = blocks;
+
+	pthread_once(&implementation_once, choose_implementation);
+	memset(&job, 0, sizeof(job));
+	job.buffer = buffer;
+	job.size = size;
+	job.mode = mode;
+	job.chaining = chaining;
+	job.process = implementations[implementation].process;
+	job.first_sector = first_sector;
+	prepare_key(&job.key, round_key, key_size_bits, is_standard_chaining(chaining));
+	if (chaining == AES_CHAINING_XTS)
+		prepare_key(&job.tweak_key, tweak_round_key, key_size_bits, is_standard_chaining(chaining));
+
+	if (chaining == AES_CHAINING_CTR || chaining == AES_CHAINING_CBC) {
+		for (unsigned i = 0; i < AES_IV_SIZE / 2; ++i) {
+			job.iv_high = (job.iv_high << 8) | iv[i];
+			job.iv_low = (job.iv_low << 8) | iv[AES_IV_SIZE / 2 + i];
+		}
+	} else if (chaining == AES_CHAINING_GCM) {
+		for (unsigned i = 0; i < 8; ++i)
+			job.iv_high = (job.iv_high << 8) | iv[i];
+		for (unsigned i = 8; i < GCM_IV_SIZE; ++i)
+			job.iv_low = (job.iv_low << 8) | iv[i];
+		job.iv_low <<= 32;
+		gcm_setup(&job);
+	}
+
+	// The units that the threads share, as the work items do in paes.cl
+	if (chaining == AES_CHAINING_XTS) {
+		job.sector_size = sector_size;
+		job.sectors = size / sector_size;
+		if (size % sector_size >= AES_BLOCK_SIZE || job.sectors == 0)
+			++job.sectors;
+		units = job.sectors;
+	} else if (chaining == AES_CHAINING_CBC) {
+		job.segment_blocks = sector_size != 0 ? sector_size / AES_BLOCK_SIZE : blocks;
+		if (job.segment_blocks == 0)
+			job.segment_blocks = 1;
+		if (mode == AES_MODE_ENCRYPT)
+			units = (blocks + job.segment_blocks - 1) / job.segment_blocks;
+	}
+
+	unsigned threads = count_threads(size, units);
+	for (unsigned t = 0; t < threads; ++t) {
+		memset(&workers[t], 0, sizeof(native_worker));
+		workers[t].job = &job;
+		workers[t].from = units * t / threads;
+		workers[t].to = units * (t + 1) / threads;
+		workers[t].last = t == threads - 1;
+		// The blocks are decrypted in place, so the ones before each thread's share are saved first
+		if (chaining == AES_CHAINING_CBC && workers[t].from > 0)
+			memcpy(workers[t].previous, buffer + (workers[t].from - 1) * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+	}
+
+	// The calling thread takes the first share; a thread that can't be started is replaced by it too
+	bool started[NATIVE_MAX_THREADS];
+	for (unsigned t = 1; t < threads; ++t)
+		started[t] = pthread_create(&workers[t].thread, NULL, native_worker_thread, &workers[t]) == 0;
+	native_worker_thread(&workers[0]);
+	for (unsigned t = 1; t < threads; ++t) {
+		if (started[t])
+			pthread_join(workers[t].thread, NULL);
+		else
+			native_worker_thread(&workers[t]);
+	}
+
+	if (chaining == AES_CHAINING_GCM) {
+		cl_ulong ghash_partial[2 * NATIVE_MAX_THREADS];
+		for (unsigned t = 0; t < threads; ++t) {
+			ghash_partial[2 * t] = workers[t].ghash[0];
+			ghash_partial[2 * t + 1] = workers[t].ghash[1];
+		}
+		gcm_tag(ghash_partial, threads, job.ghash_table, size, tag);
+	}
+
+	return threads;
+}
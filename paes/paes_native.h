@@ -0,0 +1,53 @@
+/*
+    PAES - Parallel AES for CPUs and GPUs
+    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PAES_NATIVE_H__
+#define __PAES_NATIVE_H__ 1
+
+/**
+ * \file paes_native.h
+ *
+ * The native engine (\ref OPENCL_DEVICE_NATIVE): AES run by the host processor
+ * itself, without OpenCL, split among a thread for each core. It uses the
+ * VAES instructions on 512 bits registers or the AES-NI ones when the
+ * processor has them, and T-tables otherwise; whatever the implementation,
+ * the results are the same of the OpenCL kernels, byte by byte.
+ */
+
+#include <CL/cl.h>
+#include "paes_constants_and_datatypes.h"
+
+/**
+ * Returns the name of the implementation chosen for this processor: "vaes", "aes-ni" or "table".
+ * \return the name of the implementation
+ */
+const char *native_implementation_name(void);
+
+/**
+ * Encrypts or decrypts data with the native engine; the parameters are the ones of \ref apply_aes,
+ * except the keys, that are already expanded.
+ * \param round_key the round keys of the data key, followed by the decryption round keys (as
+ *        made by key_expansion in paes_functions.c)
+ * \param tweak_round_key the round keys of the tweak key, in the same format; it's used only by AES_CHAINING_XTS
+ * \param tag where the GCM_TAG_SIZE bytes authentication tag computed from the encrypted data will be
+ *        stored, both when encrypting and when decrypting; it's used only by AES_CHAINING_GCM
+ * \return the number of threads that processed the data
+ */
+unsigned native_aes(cl_uchar * buffer, size_t size, aes_mode mode, aes_chaining chaining, const cl_uchar * round_key, const cl_uchar * tweak_round_key, unsigned key_size_bits, const cl_uchar * iv, cl_uint sector_size, cl_ulong first_sector, cl_uchar * tag);
+
+#endif
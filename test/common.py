@@ -52,6 +52,13 @@ class BaseTest:
 			else:
 				self.device = "gpu"
 		
+		# Selects the AES engine (global|private|ttable|bitslice); if unspecified
+		# PAES will use its own default engine
+		if len(argv) > 2:
+			self.engine = argv[2]
+		else:
+			self.engine = None
+		
 		# The test's temporary directory name depends on the test script's name
 		# e.g test_something.py   ---->    temp-test_something/
 		# The -3 is because the .py extension is 3 characters long
@@ -81,11 +88,13 @@ class BaseTest:
 		print "\n\n", "-" * 60, "\n"
 		print "####  RUNNING", self.name.replace("_", " ").upper(), " ####\n"
 		print "DEVICE   :", self.device
+		print "ENGINE   :", self.engine or "default"
 		print "HOSTNAME :", self.hostname
 		print "\n\n"
 		
 		self.echo("Test name: %s\n" % self.name.replace("_", " "))
 		self.echo("Device: %s\n" % self.device)
+		self.echo("Engine: %s\n" % (self.engine or "default"))
 		self.echo("Hostname: %s\n\n" % self.hostname)
 		self.echo("Start time %s\n\n" % str(datetime.now()))
 		
@@ -93,18 +102,28 @@ class BaseTest:
 		# avoids temporary directory's deletion
 		self.ok = True
 	
-	def compile_paes(self, operation = ""):
+	def compile_paes(self):
+		# The kernels' variants are selected at runtime (see paes()), and
+		# their source code is embedded into the executable
 		print "\n\nCompiling PAES\n\n"
 		chdir(self.paes_dir)
-		if len(operation) > 0:
-			defines = "DEFINES='-D %s'" % operation
-		else:
-			defines = ""
-		if system("make clean && make %s" % defines) != 0:
+		if system("make clean && make") != 0:
 			print "\n\nDANGER: error compiling PAES\n\n"
 			chdir(self.base_dir)
 			exit(2)
-		system("cp paes *.cl '%s'" % self.directory)
+		system("cp paes '%s'" % self.directory)
+		chdir(self.directory)
+
+	def compile_test_program(self, name):
+		# The test programs written in C are built by the PAES Makefile,
+		# with the PAES library
+		print "\n\nCompiling %s\n\n" % name
+		chdir(self.paes_dir)
+		if system("make clean && make %s" % name) != 0:
+			print "\n\nDANGER: error compiling %s\n\n" % name
+			chdir(self.base_dir)
+			exit(2)
+		system("cp %s '%s'" % (name, self.directory))
 		chdir(self.directory)
 
 	def compile_aes(self, operation = ""):
@@ -147,14 +166,25 @@ class BaseTest:
 		system("dd if=/dev/urandom of=%s bs=%d count=1 > /dev/null 2>&1" % (dummy_name, size))
 		return dummy_name
 
-	def paes(self, infile, outfile, mode, keysize, password):
+	def paes(self, infile, outfile, mode, keysize, password, chaining = None, operation = None, chunk_size = None, map_files = False, device = None, batch = False):
+		# In the batch mode infile is a directory or a file list, and outfile a directory
 		command = "./paes"
-		command += " -i %s" % infile
+		command += " %s %s" % ("-B" if batch else "-i", infile)
 		command += " -o %s" % outfile
 		command += " -m %s" % mode
 		command += " -k %d" % keysize
 		command += " -p '%s'" % password
-		command += " -d %s" % self.device
+		command += " -d %s" % (device or self.device)
+		if self.engine:
+			command += " -e %s" % self.engine
+		if chaining:
+			command += " -M %s" % chaining
+		if operation:
+			command += " -D %s" % operation
+		if chunk_size:
+			command += " -c %s" % chunk_size
+		if map_files:
+			command += " -f"
 		output = popen(command).read()
 		
 		#   --- SAMPLE OUTPUT ---
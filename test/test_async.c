@@ -0,0 +1,169 @@
+/*
+    PAES - Parallel AES for CPUs and GPUs
+    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The program of test_async.py: for each chaining supported by the
+ * asynchronous jobs it submits several jobs at once, each one with its own
+ * size, key and initialization vector, and checks that every callback is
+ * called exactly once and that every job gives the same data of
+ * paes_engine_run; then it does the same decrypting the encrypted data,
+ * that must give back the original one. It prints a line for each chaining
+ * and mode, ending with "ok" or "ko".
+ */
+
+// The threads aren't part of C99
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "paes_functions.h"
+
+#define KEY_SIZE_BITS 192
+#define SECTOR_SIZE 512
+#define JOBS 3
+
+//! The data of a job, that its callback gets as user_data.
+typedef struct {
+	cl_uchar *data;		//!< the buffer of the job
+	cl_uchar *expected;	//!< the data that the job must give
+	size_t size;
+	cl_uchar key[2 * KEY_SIZE_BITS / 8];	//!< the key, followed by the tweak key of AES_CHAINING_XTS
+	cl_uchar iv[AES_BLOCK_SIZE];
+	unsigned calls;		//!< how many times the callback has been called
+	int result;		//!< the result given to the callback
+} test_job;
+
+static pthread_mutex_t calls_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! The callback of every job: it counts its calls.
+static void count_call(paes_job * job, int result, void *user_data)
+{
+	test_job *test = (test_job *) user_data;
+	(void) job;
+
+	pthread_mutex_lock(&calls_mutex);
+	++test->calls;
+	test->result = result;
+	pthread_mutex_unlock(&calls_mutex);
+}
+
+static void fill_random(cl_uchar * buffer, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		buffer[i] = (cl_uchar) rand();
+}
+
+/**
+ * Submits the jobs, all at once, and checks them.
+ * \return true if every job is fine, false otherwise
+ */
+static bool run_jobs(paes_engine * paes, test_job * tests, aes_mode mode, aes_chaining chaining)
+{
+	paes_job *jobs[JOBS];
+	bool ok = true;
+
+	for (size_t j = 0; j < JOBS; ++j) {
+		tests[j].calls = 0;
+		tests[j].result = -1;
+		jobs[j] = paes_submit(paes, tests[j].data, tests[j].size, mode, AES_ENGINE_AUTO, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, chaining, tests[j].iv, tests[j].key, tests[j].key + KEY_SIZE_BITS / 8, SECTOR_SIZE, j, count_call, tests + j);
+		if (jobs[j] == NULL) {
+			fprintf(stderr, "ERROR: the job %lu can't be submitted.\n", (long unsigned) j);
+			ok = false;
+		}
+	}
+
+	// The first job is polled until it's over, the others are just waited for
+	if (jobs[0] != NULL)
+		while (!paes_poll(jobs[0]));
+	for (size_t j = 0; j < JOBS; ++j) {
+		if (jobs[j] == NULL)
+			continue;
+		int result = paes_wait(jobs[j]);
+		if (result != 0 || tests[j].result != 0 || tests[j].calls != 1 || memcmp(tests[j].data, tests[j].expected, tests[j].size) != 0) {
+			fprintf(stderr, "ERROR: the job %lu gave the result %d, its callback has been called %u times with the result %d, and its data is %s.\n", (long unsigned) j, result, tests[j].calls, tests[j].result, memcmp(tests[j].data, tests[j].expected, tests[j].size) == 0 ? "right" : "wrong");
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/**
+ * The main program.
+ * \param argc the number of command line arguments
+ * \param argv the command line arguments: the device (cpu|gpu)
+ */
+int main(int argc, char *argv[])
+{
+	// Each chaining has the sizes of its jobs, within the sizes it supports
+	const aes_chaining chainings[] = { AES_CHAINING_ECB, AES_CHAINING_CTR, AES_CHAINING_XTS };
+	const size_t sizes[][JOBS] = { {16, 4096, 65536 + 48}, {1, 1000, 65536 + 7}, {16, 1000, 65536 + 7} };
+	opencl_device device = OPENCL_DEVICE_NONE;
+	bool ok = true;
+
+	for (opencl_device d = 0; argc == 2 && d < OPENCL_DEVICE_NONE; ++d)
+		if (strcmp(argv[1], get_opencl_device_name(d)) == 0)
+			device = d;
+	if (device == OPENCL_DEVICE_NONE) {
+		fprintf(stderr, "Usage: %s cpu|gpu\n", argv[0]);
+		return 2;
+	}
+	paes_engine *paes = paes_engine_create(device, KEY_SIZE_BITS, "");
+	if (paes == NULL)
+		return 2;
+
+	srand(1);
+	for (size_t c = 0; c < sizeof(chainings) / sizeof(chainings[0]); ++c) {
+		test_job tests[JOBS];
+		cl_uchar *clear[JOBS];
+
+		for (size_t j = 0; j < JOBS; ++j) {
+			tests[j].size = sizes[c][j];
+			tests[j].data = (cl_uchar *) malloc(sizeof(cl_uchar) * tests[j].size);
+			tests[j].expected = (cl_uchar *) malloc(sizeof(cl_uchar) * tests[j].size);
+			clear[j] = (cl_uchar *) malloc(sizeof(cl_uchar) * tests[j].size);
+			fill_random(clear[j], tests[j].size);
+			fill_random(tests[j].key, sizeof(tests[j].key));
+			fill_random(tests[j].iv, sizeof(tests[j].iv));
+			memcpy(tests[j].data, clear[j], tests[j].size);
+			memcpy(tests[j].expected, clear[j], tests[j].size);
+			if (paes_engine_run(paes, tests[j].expected, tests[j].size, AES_MODE_ENCRYPT, AES_ENGINE_AUTO, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, chainings[c], tests[j].iv, tests[j].key, tests[j].key + KEY_SIZE_BITS / 8, SECTOR_SIZE, j, NULL) != 0)
+				return 2;
+		}
+
+		bool encrypted = run_jobs(paes, tests, AES_MODE_ENCRYPT, chainings[c]);
+		printf("%s encrypt %s\n", get_aes_chaining_name(chainings[c]), encrypted ? "ok" : "ko");
+		for (size_t j = 0; j < JOBS; ++j)
+			memcpy(tests[j].expected, clear[j], tests[j].size);
+		bool decrypted = run_jobs(paes, tests, AES_MODE_DECRYPT, chainings[c]);
+		printf("%s decrypt %s\n", get_aes_chaining_name(chainings[c]), decrypted ? "ok" : "ko");
+		ok = ok && encrypted && decrypted;
+
+		for (size_t j = 0; j < JOBS; ++j) {
+			free(tests[j].data);
+			free(tests[j].expected);
+			free(clear[j]);
+		}
+	}
+
+	paes_engine_destroy(paes);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env python
+#
+#    PAES - Parallel AES for CPUs and GPUs
+#    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, version 2 of the License.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+##############################################################################
+#
+# This test checks the asynchronous jobs of the PAES library, through the
+# test_async program (see test_async.c): for each chaining that supports them
+# several jobs with different sizes and keys are submitted at once, and each
+# one must call its callback exactly once and give the same data of the
+# synchronous engine, both encrypting and decrypting. The jobs need an OpenCL
+# device, so only "cpu" and "gpu" are tested.
+#
+
+from os import popen
+
+from common import BaseTest
+
+CHAININGS = ("ecb", "ctr", "xts")
+
+class TestAsync(BaseTest):
+	def test(self):
+		if self.device not in ("cpu", "gpu"):
+			print "The asynchronous jobs need the cpu or gpu device"
+			self.echo("The asynchronous jobs need the cpu or gpu device\n")
+			return
+		self.compile_test_program("test_async")
+		output = popen("./test_async %s" % self.device).read()
+		for chaining in CHAININGS:
+			for mode in ("encrypt", "decrypt"):
+				print "%s %s" % (chaining, mode),
+				self.echo("%s %s" % (chaining, mode))
+				if "%s %s ok\n" % (chaining, mode) in output:
+					res = "ok"
+				else:
+					res = "ko"
+				
+				# Avoids temporary directory's deletion
+				if res == "ko":
+					self.ok = False
+				
+				print res
+				self.echo(" %s\n" % res)
+
+TestAsync().run()
@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+#
+#    PAES - Parallel AES for CPUs and GPUs
+#    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, version 2 of the License.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+##############################################################################
+#
+# This test checks the batch mode: for each chaining that supports it a list
+# of files of different sizes (including the ones that aren't a multiple of
+# the block size), half of them with a password of their own, is encrypted
+# with a single launch, and every file must be decrypted by the usual single
+# file mode, and vice versa; for the chainings without a random
+# initialization vector each encrypted file must also be the same of the one
+# encrypted on its own.
+# Finally, two files with the same name in different directories must not
+# overwrite each other's output file: the batch must fail and the output
+# file must be the one of the first file in the list.
+#
+
+from os import mkdir, system
+
+from common import BaseTest
+
+# For each chaining: the minimum input size and whether it has a random IV
+CHAININGS = (("ecb", 1, False), ("ctr", 1, True), ("xts", 16, False))
+
+SIZES = (1, 15, 16, 17, 1000, 4096, 65536, 1048583)
+
+class TestBatch(BaseTest):
+	def test(self):
+		self.compile_paes()
+		for chaining, min_size, random_iv in CHAININGS:
+			print chaining,
+			self.echo(chaining)
+			
+			clear_dir = "clear-" + chaining
+			cypher_dir = clear_dir + ".e"
+			clear_dir_out = cypher_dir + ".d"
+			mkdir(clear_dir)
+			mkdir(cypher_dir + "s")
+			mkdir(clear_dir_out + "s")
+			names = []
+			passwords = {}
+			clear_list = open(clear_dir + ".list", "w")
+			cypher_list = open(cypher_dir + ".list", "w")
+			for size in SIZES:
+				if size >= min_size:
+					names.append(self.create_dummy(size))
+					system("mv %s %s" % (names[-1], clear_dir))
+					# The others take the password given with -p
+					password = len(names) % 2 == 0 and "\t" + "hola cola %d" % size or ""
+					passwords[names[-1]] = password and password[1:] or "hola cola"
+					clear_list.write("%s/%s%s\n" % (clear_dir, names[-1], password))
+					cypher_list.write("%s/%s%s\n" % (cypher_dir, names[-1], password))
+			clear_list.close()
+			cypher_list.close()
+			try:
+				self.paes(clear_dir + ".list", cypher_dir, "encrypt", 192, "hola cola", chaining, batch = True)
+				self.paes(cypher_dir + ".list", clear_dir_out, "decrypt", 192, "hola cola", chaining, batch = True)
+				res = "ok"
+				for name in names:
+					clearfile_in = clear_dir + "/" + name
+					cypherfile = cypher_dir + "/" + name
+					cypherfile_single = cypher_dir + "s/" + name
+					self.paes(clearfile_in, cypherfile_single, "encrypt", 192, passwords[name], chaining)
+					self.paes(cypherfile, clear_dir_out + "s/" + name, "decrypt", 192, passwords[name], chaining)
+					if self.diff(clearfile_in, clear_dir_out + "/" + name) != 0 or self.diff(clearfile_in, clear_dir_out + "s/" + name) != 0 or not (random_iv or self.diff(cypherfile, cypherfile_single) == 0):
+						res = "ko"
+			except Exception as e:
+				print "EXCEPTION:", e
+				self.echo("\n\nEXCEPTION: %s\n" % str(e))
+				res = "ko"
+				
+			# Avoids temporary directory's deletion
+			if res == "ko":
+				self.ok = False
+				
+			print res
+			self.echo(" %s\n" % res)
+
+		print "duplicates",
+		self.echo("duplicates")
+		try:
+			mkdir("first")
+			mkdir("second")
+			first_name = self.create_dummy(1000)
+			system("mv %s first/dup && dd if=/dev/urandom of=second/dup bs=1000 count=1 > /dev/null 2>&1" % first_name)
+			dup_list = open("dup.list", "w")
+			dup_list.write("first/dup\nsecond/dup\n")
+			dup_list.close()
+			res = "ok"
+			if system("./paes -B dup.list -o dup.e -m encrypt -k 192 -p 'hola cola' -d %s -M ecb > /dev/null 2>&1" % self.device) == 0:
+				res = "ko"
+			self.paes("dup.e/dup", "dup.e.d", "decrypt", 192, "hola cola", "ecb")
+			if self.diff("first/dup", "dup.e.d") != 0:
+				res = "ko"
+		except Exception as e:
+			print "EXCEPTION:", e
+			self.echo("\n\nEXCEPTION: %s\n" % str(e))
+			res = "ko"
+		if res == "ko":
+			self.ok = False
+		print res
+		self.echo(" %s\n" % res)
+
+TestBatch().run()
@@ -0,0 +1,151 @@
+#!/usr/bin/env python
+#
+#    PAES - Parallel AES for CPUs and GPUs
+#    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, version 2 of the License.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+##############################################################################
+##############################################################################
+#
+# This test checks the chainings other than ECB: for each of them and for
+# different file sizes (including the ones that aren't a multiple of the
+# block size) the relation decrypt(encrypt(data)) = data must hold true.
+# Encrypting twice the same data must give different results when the
+# chaining uses a new random initialization vector for each encryption, and
+# the same results otherwise (e.g. XTS, where the sector numbers make the
+# difference). For the authenticated chainings (e.g. GCM) decrypting a
+# corrupted file must fail. The second encryption and its decryption map
+# the files in memory.
+# Finally, the known answers: a file encrypted with each chaining must be
+# decrypted to the expected plaintext, and for the chainings without a random
+# initialization vector that plaintext must be encrypted to the very same
+# file. The chainings run standard AES, so the answers have been computed
+# with OpenSSL: aes-192-ctr and aes-192-cbc, and a separate XTS and GCM on top
+# of its aes-192-ecb, since its command line has neither a 192 bits XTS nor
+# GCM (test_vectors.py checks the vectors of the standards too).
+#
+
+from binascii import unhexlify
+from common import BaseTest
+from os.path import exists
+
+# For each chaining: the minimum input size, whether it has a random IV and
+# whether it's authenticated
+CHAININGS = (("ctr", 1, True, False), ("xts", 16, False, False), ("gcm", 1, True, True), ("cbc", 1, True, False))
+
+# The known answers: for each chaining, the file with PLAINTEXT encrypted
+# with the 192 bits key of the password "hola cola" (the first 24 bytes of its
+# SHA-256), in hex; as PAES writes it, the file starts with the initialization
+# vector, if the chaining has one
+PLAINTEXT = "The quick brown fox jumps over the lazy dog"
+KNOWN_ANSWERS = (
+	# The low 64 bits of the counter overflow after the first block
+	("ctr", "0123456789abcdefffffffffffffffff"
+		"3c92bee6b14057fecec0ec6858ce7f18c0c00ec783d3847d2daf3287310b67289ef917fc4e0711557a3e3b"),
+	# The first sector, with the tweak key of the same password; its last
+	# partial block steals the end of the block before
+	("xts", "754136488780760a91bc3331c05da3105191eec895c3521e440dfead95a9fbe30c20989970cc53cea97d55"),
+	# The 96 bits initialization vector, and the authentication tag at the end
+	("gcm", "cafebabefacedbaddecaf888"
+		"dc3140ad542620784061968a073f7f7129176848488430d34f9ed81ea829480541aed04d7a9f525a3ee3e4"
+		"9b1d5679ea354e6164d24cf71b6f1ab4"),
+	# The whole file is a single segment, padded to a whole block
+	("cbc", "000102030405060708090a0b0c0d0e0f"
+		"ae799a823ee346b9f2bd6ee1820aeed12beae108627f3f245a6fc6c58ea03c969dbe5a783268241e2de2643c7bf7f5c2"),
+)
+
+class TestChaining(BaseTest):
+	def test(self):
+		self.compile_paes()
+		for chaining, min_size, random_iv, authenticated in CHAININGS:
+			for size in (1, 15, 16, 17, 1000, 1048576, 1048583):
+				if size < min_size:
+					continue
+				print "%s %d" % (chaining, size),
+				self.echo("%s %d" % (chaining, size))
+				
+				clearfile_in = self.create_dummy(size)
+				cypherfile = clearfile_in + "." + chaining + ".e"
+				cypherfile2 = cypherfile + "2"
+				clearfile_out = cypherfile + ".d"
+				clearfile_out2 = cypherfile2 + ".d"
+				try:
+					self.paes(clearfile_in, cypherfile, "encrypt", 192, "hola cola", chaining)
+					self.paes(clearfile_in, cypherfile2, "encrypt", 192, "hola cola", chaining, map_files = True)
+					self.paes(cypherfile, clearfile_out, "decrypt", 192, "hola cola", chaining)
+					self.paes(cypherfile2, clearfile_out2, "decrypt", 192, "hola cola", chaining, map_files = True)
+					if self.diff(clearfile_in, clearfile_out) == 0 and self.diff(clearfile_in, clearfile_out2) == 0 and self.diff(clearfile_in, cypherfile) != 0 and (self.diff(cypherfile, cypherfile2) != 0) == random_iv:
+						res = "ok"
+					else:
+						res = "ko"
+					if authenticated and res == "ok":
+						# Flips a bit of the first encrypted byte, right after the IV:
+						# the decryption must fail and write nothing
+						data = bytearray(open(cypherfile, "rb").read())
+						data[12] ^= 1
+						open(cypherfile + ".bad", "wb").write(data)
+						try:
+							self.paes(cypherfile + ".bad", clearfile_out + ".bad", "decrypt", 192, "hola cola", chaining)
+						except Exception:
+							pass
+						try:
+							self.paes(cypherfile + ".bad", clearfile_out2 + ".bad", "decrypt", 192, "hola cola", chaining, map_files = True)
+						except Exception:
+							pass
+						if exists(clearfile_out + ".bad") or exists(clearfile_out2 + ".bad"):
+							res = "ko"
+				except Exception as e:
+					print "EXCEPTION:", e
+					self.echo("\n\nEXCEPTION: %s\n" % str(e))
+					res = "ko"
+					
+				# Avoids temporary directory's deletion
+				if res == "ko":
+					self.ok = False
+					
+				print res
+				self.echo(" %s\n" % res)
+
+		random_ivs = dict((chaining, random_iv) for chaining, min_size, random_iv, authenticated in CHAININGS)
+		for chaining, encrypted in KNOWN_ANSWERS:
+			print "%s known answer" % chaining,
+			self.echo("%s known answer" % chaining)
+			
+			clearfile_in = "known.txt"
+			cypherfile = "known." + chaining + ".e"
+			cypherfile2 = cypherfile + "2"
+			clearfile_out = cypherfile + ".d"
+			try:
+				open(clearfile_in, "wb").write(PLAINTEXT)
+				open(cypherfile, "wb").write(unhexlify(encrypted))
+				self.paes(cypherfile, clearfile_out, "decrypt", 192, "hola cola", chaining)
+				res = self.diff(clearfile_in, clearfile_out) == 0 and "ok" or "ko"
+				if not random_ivs[chaining]:
+					self.paes(clearfile_in, cypherfile2, "encrypt", 192, "hola cola", chaining)
+					if self.diff(cypherfile, cypherfile2) != 0:
+						res = "ko"
+			except Exception as e:
+				print "EXCEPTION:", e
+				self.echo("\n\nEXCEPTION: %s\n" % str(e))
+				res = "ko"
+			
+			# Avoids temporary directory's deletion
+			if res == "ko":
+				self.ok = False
+			
+			print res
+			self.echo(" %s\n" % res)
+
+TestChaining().run()
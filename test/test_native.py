@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+#
+#    PAES - Parallel AES for CPUs and GPUs
+#    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, version 2 of the License.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+##############################################################################
+#
+# This test checks the native engine (-d native), that runs on the processor
+# without OpenCL: for each chaining and for different file sizes a file
+# encrypted by the native engine must be decrypted by the OpenCL device, and
+# vice versa; for the chainings without a random initialization vector the
+# two encrypted files must also be the same. Each implementation of the
+# native engine that the processor supports is checked, the others are
+# skipped.
+#
+
+from common import BaseTest
+from os import environ, popen
+import re
+
+# For each chaining: the minimum input size and whether it has a random IV
+CHAININGS = (("ecb", 1, False), ("ctr", 1, True), ("xts", 16, False), ("gcm", 1, True), ("cbc", 1, True))
+
+# The implementations of the native engine; the ones that the processor
+# doesn't support would fall back to the fastest one that it does
+IMPLEMENTATIONS = ("table", "aes-ni", "vaes")
+
+class TestNative(BaseTest):
+	def selected_implementation(self):
+		# The implementation that paes runs, as it prints it
+		dummy = self.create_dummy(16)
+		output = popen("./paes -i %s -o %s.e -m encrypt -p 'hola cola' -d native 2> /dev/null" % (dummy, dummy)).read()
+		match = re.search("Engine is native (\S+)", output)
+		return match and match.group(1)
+		
+	def test(self):
+		self.compile_paes()
+		for implementation in IMPLEMENTATIONS:
+			environ["PAES_NATIVE"] = implementation
+			if self.selected_implementation() != implementation:
+				print "%s skipped, the processor lacks it" % implementation
+				self.echo("%s skipped, the processor lacks it\n" % implementation)
+				continue
+			for chaining, min_size, random_iv in CHAININGS:
+				for size in (1, 15, 16, 17, 1000, 1048576, 1048583):
+					if size < min_size:
+						continue
+					print "%s %s %d" % (implementation, chaining, size),
+					self.echo("%s %s %d" % (implementation, chaining, size))
+					
+					clearfile_in = self.create_dummy(size)
+					cypherfile = clearfile_in + "." + chaining + ".e"
+					cypherfile_native = cypherfile + "n"
+					clearfile_out = cypherfile + ".d"
+					clearfile_out_native = cypherfile_native + ".d"
+					try:
+						self.paes(clearfile_in, cypherfile, "encrypt", 256, "hola cola", chaining)
+						self.paes(clearfile_in, cypherfile_native, "encrypt", 256, "hola cola", chaining, device = "native")
+						self.paes(cypherfile, clearfile_out_native, "decrypt", 256, "hola cola", chaining, device = "native")
+						self.paes(cypherfile_native, clearfile_out, "decrypt", 256, "hola cola", chaining)
+						if self.diff(clearfile_in, clearfile_out) == 0 and self.diff(clearfile_in, clearfile_out_native) == 0 and (random_iv or self.diff(cypherfile, cypherfile_native) == 0):
+							res = "ok"
+						else:
+							res = "ko"
+					except Exception as e:
+						print "EXCEPTION:", e
+						self.echo("\n\nEXCEPTION: %s\n" % str(e))
+						res = "ko"
+						
+					# Avoids temporary directory's deletion
+					if res == "ko":
+						self.ok = False
+						
+					print res
+					self.echo(" %s\n" % res)
+		del environ["PAES_NATIVE"]
+
+TestNative().run()
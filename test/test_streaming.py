@@ -0,0 +1,70 @@
+#!/usr/bin/env python
+#
+#    PAES - Parallel AES for CPUs and GPUs
+#    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, version 2 of the License.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+##############################################################################
+#
+# This test checks the streaming mode: for each chaining that supports it and
+# for different file sizes (including the ones that aren't a multiple of the
+# chunk size or of the block size) a file encrypted a chunk at a time must be
+# decrypted by the usual whole file mode, and vice versa; for the chainings
+# without a random initialization vector the two encrypted files must also be
+# the same.
+#
+
+from common import BaseTest
+
+# For each chaining: the minimum input size and whether it has a random IV
+CHAININGS = (("ecb", 1, False), ("ctr", 1, True), ("xts", 16, False))
+
+class TestStreaming(BaseTest):
+	def test(self):
+		self.compile_paes()
+		for chaining, min_size, random_iv in CHAININGS:
+			for size in (1, 15, 16, 17, 1000, 4096, 1048576, 1048583):
+				if size < min_size:
+					continue
+				print "%s %d" % (chaining, size),
+				self.echo("%s %d" % (chaining, size))
+				
+				clearfile_in = self.create_dummy(size)
+				cypherfile = clearfile_in + "." + chaining + ".e"
+				cypherfile_streamed = cypherfile + "s"
+				clearfile_out = cypherfile + ".d"
+				clearfile_out_streamed = cypherfile_streamed + ".d"
+				try:
+					self.paes(clearfile_in, cypherfile, "encrypt", 192, "hola cola", chaining)
+					self.paes(clearfile_in, cypherfile_streamed, "encrypt", 192, "hola cola", chaining, chunk_size = "4k")
+					self.paes(cypherfile, clearfile_out_streamed, "decrypt", 192, "hola cola", chaining, chunk_size = "64k")
+					self.paes(cypherfile_streamed, clearfile_out, "decrypt", 192, "hola cola", chaining)
+					if self.diff(clearfile_in, clearfile_out) == 0 and self.diff(clearfile_in, clearfile_out_streamed) == 0 and (random_iv or self.diff(cypherfile, cypherfile_streamed) == 0):
+						res = "ok"
+					else:
+						res = "ko"
+				except Exception as e:
+					print "EXCEPTION:", e
+					self.echo("\n\nEXCEPTION: %s\n" % str(e))
+					res = "ko"
+					
+				# Avoids temporary directory's deletion
+				if res == "ko":
+					self.ok = False
+					
+				print res
+				self.echo(" %s\n" % res)
+
+TestStreaming().run()
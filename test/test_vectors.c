@@ -0,0 +1,176 @@
+/*
+    PAES - Parallel AES for CPUs and GPUs
+    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The program of test_vectors.py: it encrypts and decrypts the test vectors
+ * of the standards with their own keys, that the paes program can't take
+ * since it hashes a password, and checks the results; this way the chainings
+ * are checked against standard AES. It prints a line for each vector and
+ * mode, ending with "ok" or "ko".
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "paes_functions.h"
+
+//! The size of the longest vector, in bytes.
+#define MAX_VECTOR_SIZE 64
+
+//! The size of the longest key, in bytes.
+#define MAX_KEY_SIZE 32
+
+//! A test vector; the binary values are in hex.
+typedef struct {
+	const char *name;
+	aes_chaining chaining;
+	unsigned key_size_bits;
+	const char *key;	//!< the key, followed by the tweak key of AES_CHAINING_XTS
+	const char *iv;
+	cl_ulong sector;	//!< the XTS data unit (sector) number
+	const char *plaintext;
+	const char *ciphertext;
+	const char *tag;	//!< the AES_CHAINING_GCM authentication tag
+} test_vector;
+
+static const test_vector vectors[] = {
+	// NIST SP 800-38A, F.5.1, F.5.3 and F.5.5
+	{"ctr-128", AES_CHAINING_CTR, 128, "2b7e151628aed2a6abf7158809cf4f3c", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", 0,
+	 "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	 "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee", ""},
+	{"ctr-192", AES_CHAINING_CTR, 192, "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", 0,
+	 "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	 "1abc932417521ca24f2b0459fe7e6e0b090339ec0aa6faefd5ccc2c6f4ce8e941e36b26bd1ebc670d1bd1d665620abf74f78a7f6d29809585a97daec58c6b050", ""},
+	{"ctr-256", AES_CHAINING_CTR, 256, "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", 0,
+	 "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	 "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c52b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6", ""},
+	// IEEE 1619-2007, vectors 1, 2 and 15 to 18; the last ones steal the ciphertext
+	{"xts-1", AES_CHAINING_XTS, 128, "0000000000000000000000000000000000000000000000000000000000000000", "", 0,
+	 "0000000000000000000000000000000000000000000000000000000000000000",
+	 "917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e", ""},
+	{"xts-2", AES_CHAINING_XTS, 128, "1111111111111111111111111111111122222222222222222222222222222222", "", 0x3333333333ULL,
+	 "4444444444444444444444444444444444444444444444444444444444444444",
+	 "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0", ""},
+	{"xts-15", AES_CHAINING_XTS, 128, "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", "", 0x123456789aULL,
+	 "000102030405060708090a0b0c0d0e0f10",
+	 "6c1625db4671522d3d7599601de7ca09ed", ""},
+	{"xts-16", AES_CHAINING_XTS, 128, "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", "", 0x123456789aULL,
+	 "000102030405060708090a0b0c0d0e0f1011",
+	 "d069444b7a7e0cab09e24447d24deb1fedbf", ""},
+	{"xts-17", AES_CHAINING_XTS, 128, "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", "", 0x123456789aULL,
+	 "000102030405060708090a0b0c0d0e0f101112",
+	 "e5df1351c0544ba1350b3363cd8ef4beedbf9d", ""},
+	{"xts-18", AES_CHAINING_XTS, 128, "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0", "", 0x123456789aULL,
+	 "000102030405060708090a0b0c0d0e0f10111213",
+	 "9d84c813f719aa2c7be3f66171c7c5c2edbf9dac", ""},
+	// NIST SP 800-38A, F.2.1, F.2.3 and F.2.5; the vectors are a single segment, without padding
+	{"cbc-128", AES_CHAINING_CBC, 128, "2b7e151628aed2a6abf7158809cf4f3c", "000102030405060708090a0b0c0d0e0f", 0,
+	 "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	 "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7", ""},
+	{"cbc-192", AES_CHAINING_CBC, 192, "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "000102030405060708090a0b0c0d0e0f", 0,
+	 "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	 "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd", ""},
+	{"cbc-256", AES_CHAINING_CBC, 256, "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "000102030405060708090a0b0c0d0e0f", 0,
+	 "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	 "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b", ""},
+	// The GCM test cases 2, 3, 9 and 15 of McGrew and Viega, the ones without additional data
+	{"gcm-2", AES_CHAINING_GCM, 128, "00000000000000000000000000000000", "000000000000000000000000", 0,
+	 "00000000000000000000000000000000",
+	 "0388dace60b6a392f328c2b971b2fe78", "ab6e47d42cec13bdf53a67b21257bddf"},
+	{"gcm-3", AES_CHAINING_GCM, 128, "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", 0,
+	 "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+	 "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985", "4d5c2af327cd64a62cf35abd2ba6fab4"},
+	{"gcm-9", AES_CHAINING_GCM, 192, "feffe9928665731c6d6a8f9467308308feffe9928665731c", "cafebabefacedbaddecaf888", 0,
+	 "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+	 "3980ca0b3c00e841eb06fac4872a2757859e1ceaa6efd984628593b40ca1e19c7d773d00c144c525ac619d18c84a3f4718e2448b2fe324d9ccda2710acade256", "9924a7c8587336bfb118024db8674a14"},
+	{"gcm-15", AES_CHAINING_GCM, 256, "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", 0,
+	 "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+	 "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad", "b094dac5d93471bdec1a502270e3cc6c"},
+};
+
+/**
+ * Converts a hex string into bytes.
+ * \return the number of bytes
+ */
+static size_t from_hex(const char *hex, cl_uchar * bytes)
+{
+	size_t size = strlen(hex) / 2;
+	for (size_t i = 0; i < size; ++i) {
+		unsigned byte;
+		sscanf(hex + 2 * i, "%2x", &byte);
+		bytes[i] = (cl_uchar) byte;
+	}
+	return size;
+}
+
+/**
+ * Encrypts or decrypts a vector and checks the result; the GCM decryption checks the tag too.
+ * \return true if the result is the expected one, false otherwise
+ */
+static bool check_vector(const test_vector * vector, opencl_device device, aes_mode mode)
+{
+	cl_uchar key[2 * MAX_KEY_SIZE], iv[AES_IV_SIZE], tag[GCM_TAG_SIZE], expected_tag[GCM_TAG_SIZE];
+	cl_uchar plaintext[MAX_VECTOR_SIZE], ciphertext[MAX_VECTOR_SIZE], buffer[MAX_VECTOR_SIZE];
+
+	from_hex(vector->key, key);
+	from_hex(vector->iv, iv);
+	size_t size = from_hex(vector->plaintext, plaintext);
+	from_hex(vector->ciphertext, ciphertext);
+	from_hex(vector->tag, expected_tag);
+	memcpy(tag, expected_tag, sizeof(tag));
+
+	memcpy(buffer, mode == AES_MODE_ENCRYPT ? plaintext : ciphertext, size);
+	if (apply_aes(buffer, size, device, mode, AES_ENGINE_AUTO, AES_DISTRIBUTION_CONTIGUOUS, AES_LAYOUT_LINEAR, vector->chaining, iv, key, key + vector->key_size_bits / 8, vector->key_size_bits, vector->chaining == AES_CHAINING_XTS ? XTS_DEFAULT_SECTOR_SIZE : 0, vector->sector, tag, NULL, 0, 0) != 0)
+		return false;
+	if (vector->chaining == AES_CHAINING_GCM && memcmp(tag, expected_tag, sizeof(tag)) != 0)
+		return false;
+	return memcmp(buffer, mode == AES_MODE_ENCRYPT ? ciphertext : plaintext, size) == 0;
+}
+
+/**
+ * The main program.
+ * \param argc the number of command line arguments
+ * \param argv the command line arguments: the device (cpu|gpu|all|native|auto)
+ */
+int main(int argc, char *argv[])
+{
+	opencl_device device = OPENCL_DEVICE_NONE;
+	bool ok = true;
+
+	for (opencl_device d = 0; argc == 2 && d < OPENCL_DEVICE_NONE; ++d)
+		if (strcmp(argv[1], get_opencl_device_name(d)) == 0)
+			device = d;
+	if (device == OPENCL_DEVICE_NONE) {
+		fprintf(stderr, "Usage: %s cpu|gpu|all|native|auto\n", argv[0]);
+		return 2;
+	}
+
+	for (size_t v = 0; v < sizeof(vectors) / sizeof(vectors[0]); ++v) {
+		// OPENCL_DEVICE_ALL supports only ECB, CTR and XTS (see apply_aes)
+		if (device == OPENCL_DEVICE_ALL && (vectors[v].chaining == AES_CHAINING_GCM || vectors[v].chaining == AES_CHAINING_CBC))
+			continue;
+		for (aes_mode mode = AES_MODE_ENCRYPT; mode <= AES_MODE_DECRYPT; ++mode) {
+			bool right = check_vector(vectors + v, device, mode);
+			printf("%s %s %s\n", vectors[v].name, get_aes_mode_name(mode), right ? "ok" : "ko");
+			ok = ok && right;
+		}
+	}
+	return ok ? 0 : 1;
+}
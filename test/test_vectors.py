@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+#
+#    PAES - Parallel AES for CPUs and GPUs
+#    Copyright (C) 2009  Paolo Bernardi <paolo.bernardi@gmx.it>
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, version 2 of the License.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+##############################################################################
+#
+# This test checks the chainings against the test vectors of the standards,
+# through the test_vectors program (see test_vectors.c): the vectors have
+# their own keys, that the paes program can't take since it hashes a
+# password. Each vector must be encrypted to the expected ciphertext (and
+# GCM tag) and decrypted back to the plaintext; "all" skips GCM and CBC.
+#
+
+from os import popen
+
+from common import BaseTest
+
+# The vectors of test_vectors.c; their names start with their chaining
+VECTORS = ("ctr-128", "ctr-192", "ctr-256", "xts-1", "xts-2", "xts-15", "xts-16", "xts-17", "xts-18", "gcm-2", "gcm-3", "gcm-9", "gcm-15", "cbc-128", "cbc-192", "cbc-256")
+
+# The chainings that "all" doesn't support
+NOT_ALL = ("gcm", "cbc")
+
+class TestVectors(BaseTest):
+	def test(self):
+		self.compile_test_program("test_vectors")
+		output = popen("./test_vectors %s" % self.device).read()
+		for vector in VECTORS:
+			if self.device == "all" and vector.split("-")[0] in NOT_ALL:
+				continue
+			for mode in ("encrypt", "decrypt"):
+				print "%s %s" % (vector, mode),
+				self.echo("%s %s" % (vector, mode))
+				if "%s %s ok\n" % (vector, mode) in output:
+					res = "ok"
+				else:
+					res = "ko"
+				
+				# Avoids temporary directory's deletion
+				if res == "ko":
+					self.ok = False
+				
+				print res
+				self.echo(" %s\n" % res)
+
+TestVectors().run()